@@ -0,0 +1,157 @@
+#include "batch.h"
+#include "morph.h"
+#include "options.h"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <ctime>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+static bool isDirectory(const string& path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st)==0 && S_ISDIR(st.st_mode);
+}
+
+/// Reads the list of input files from a manifest or a directory
+static vector<string> listInputs(const string& listPath)
+{
+	vector<string> inputs;
+	if (isDirectory(listPath))
+	{
+		DIR* dir = opendir(listPath.c_str());
+		if (!dir)
+			throw "Can't open the input directory";
+		while (dirent* entry = readdir(dir))
+		{
+			string path = listPath+'/'+entry->d_name;
+			struct stat st;
+			if (stat(path.c_str(), &st)==0 && S_ISREG(st.st_mode))
+				inputs.push_back(path);
+		}
+		closedir(dir);
+		sort(begin(inputs), end(inputs));
+	}
+	else
+	{
+		ifstream list(listPath.c_str());
+		if (!list.is_open())
+			throw "Can't open the list of input files";
+		string line;
+		while (getline(list, line))
+		{
+			line.erase(line.find_last_not_of(" \t\r")+1);
+			line.erase(0, line.find_first_not_of(" \t"));
+			if (!line.empty() && line[0]!='#')
+				inputs.push_back(line);
+		}
+	}
+	return inputs;
+}
+
+static string getOutPath(const string& outPattern, const string& inPath)
+{
+	string name = inPath.substr(inPath.find_last_of("/\\")+1);
+	string outPath = outPattern;
+	size_t pos = outPath.find("%s");
+	if (pos!=string::npos)
+		return outPath.replace(pos, 2, name);
+	else if (isDirectory(outPattern))
+		return outPattern+'/'+name;
+	else
+		throw "The output must be a directory or contain %s in batch mode";
+}
+
+/// Hints the system to start reading the file in the background
+static void readAhead(const string& path)
+{
+#ifdef POSIX_FADV_WILLNEED
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd<0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+#else
+	(void)path;
+#endif
+}
+
+unsigned runBatch(std::string listPath, std::string outPattern, unsigned nThreads)
+{
+	vector<string> inputs;
+	try {
+		inputs = listInputs(listPath);
+		if (!inputs.empty())
+			getOutPath(outPattern, inputs[0]);
+	}
+	catch (const char* e) {
+		cout << "Error: " << e << "\n";
+		return 1;
+	}
+
+	if (!nThreads)
+		nThreads = max(thread::hardware_concurrency(), 1u);
+	nThreads = min(nThreads, (unsigned)inputs.size());
+	cout << "Morphing "<<inputs.size()<<" files with "<<nThreads<<" threads\n";
+
+	atomic<size_t> nextInput{0};
+	atomic<unsigned> nFailed{0};
+	unsigned baseSeed = time(NULL);
+	mutex outputMutex;
+
+	auto worker = [&]()
+	{
+		for (size_t i=nextInput++; i<inputs.size(); i=nextInput++)
+		{
+			// While we analyze this file, the file the next worker will pick can be read
+			if (i+nThreads < inputs.size())
+				readAhead(inputs[i+nThreads]);
+
+			const string& inPath = inputs[i];
+			stringstream log;
+			string error;
+			try {
+				// The workers already use every core, the variants of a file are made one after the other
+				morphFile(inPath, getOutPath(outPattern, inPath), baseSeed+i*argVariants, log, argVariants, 1);
+			}
+			catch (const char* e) {
+				error = e;
+			}
+			catch (const exception& e) {
+				error = e.what();
+			}
+
+			lock_guard<mutex> lock(outputMutex);
+			cout << "["<<i+1<<"/"<<inputs.size()<<"] "<<inPath;
+			if (error.empty())
+				cout << " : OK\n";
+			else
+			{
+				// The last line of the log is the step that failed
+				string logStr = log.str();
+				string step = logStr.substr(logStr.find_last_of('\n')+1);
+				cout << " : FAIL at "<<step<<" ("<<error<<")\n";
+				nFailed++;
+			}
+		}
+	};
+	vector<thread> workers;
+	for (unsigned i=0; i<nThreads; ++i)
+		workers.push_back(thread(worker));
+	for (thread& t : workers)
+		t.join();
+
+	cout << inputs.size()-nFailed << " files morphed, " << nFailed << " failed\n";
+	return nFailed;
+}
@@ -0,0 +1,14 @@
+#ifndef BATCH_H_INCLUDED
+#define BATCH_H_INCLUDED
+
+#include <string>
+
+/// Morphs every file listed in listPath (one path per line), or every file of the directory listPath.
+/// The files are processed in parallel by a pool of worker threads. A file that fails is reported
+/// and skipped, it doesn't abort the rest of the batch.
+/// @param outPattern Output path, %s is replaced by the name of the input file. Can also be a directory.
+/// @param nThreads Number of workers, 0 to use one per core
+/// @return Number of files that failed
+unsigned runBatch(std::string listPath, std::string outPattern, unsigned nThreads);
+
+#endif // BATCH_H_INCLUDED
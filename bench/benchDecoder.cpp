@@ -0,0 +1,229 @@
+#include "../mappedfile.h"
+#include "../peparser.h"
+#include "../disassembler.h"
+#include "../decoder.h"
+#include "../lengthkernel.h"
+#include "legacyDecoder.h"
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#define HAS_RDTSC
+#endif
+
+/// Compares the throughput of the table decoder and the legacy decoder on the same byte streams :
+/// the instructions found by the disassembler, and a linear sweep of the code sections.
+/// Then compares the bytes per cycle of the linear sweep through the decoder with the length kernels.
+/// Usage : benchDecoder file [rounds]
+
+using namespace std;
+
+/// Decodes every instruction of the stream rounds times
+/// @return Nanoseconds per instruction
+template<typename Decoder>
+static double run(Decoder decode, const uint8_t* image, const vector<uint32_t>& addrs, unsigned rounds,
+				uint64_t& totalSize)
+{
+	totalSize = 0;
+	auto start = chrono::steady_clock::now();
+	for (unsigned r=0; r<rounds; ++r)
+		for (uint32_t addr : addrs)
+			totalSize += decode(image+addr);
+	auto end = chrono::steady_clock::now();
+	return chrono::duration<double,nano>(end-start).count() / ((double)addrs.size()*rounds);
+}
+
+static void bench(const char* name, const uint8_t* image, const vector<uint32_t>& addrs, unsigned rounds)
+{
+	auto tableDecoder = [](const uint8_t* code)
+	{
+		const char* error;
+		return decodeInstructionLength(code, error);
+	};
+	unsigned nMismatches=0, nLegacyFailures=0;
+	for (uint32_t addr : addrs)
+	{
+		uint8_t legacySize = legacyInstructionLength(image+addr);
+		if (!legacySize)
+			nLegacyFailures++;
+		else if (legacySize != tableDecoder(image+addr))
+			nMismatches++;
+	}
+
+	uint64_t tableBytes, legacyBytes;
+	double tableNs = run(tableDecoder, image, addrs, rounds, tableBytes);
+	double legacyNs = run(legacyInstructionLength, image, addrs, rounds, legacyBytes);
+	cout << name << " : " << addrs.size() << " instructions, " << rounds << " rounds\n";
+	cout << "\ttable  : " << tableNs << " ns/instruction, " << tableBytes/(tableNs*addrs.size()*rounds)*1000
+		<< " MB/s\n";
+	cout << "\tlegacy : " << legacyNs << " ns/instruction, " << legacyBytes/(legacyNs*addrs.size()*rounds)*1000
+		<< " MB/s\n";
+	cout << "\tspeedup x" << legacyNs/tableNs << ", " << nMismatches << " different sizes, "
+		<< nLegacyFailures << " not supported by the legacy decoder\n";
+}
+
+static uint64_t readCycles()
+{
+#ifdef HAS_RDTSC
+	return __rdtsc();
+#else
+	return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+/// Walks the chain of instructions of the code sections, skipping a byte when an instruction can't be decoded
+/// @param getLengths Fills the lengths at every offset of a section, or does nothing to use only the decoder
+/// @return Bytes per cycle
+template<typename Lengths, typename Decoder>
+static double sweepCycles(Lengths getLengths, Decoder decode, const uint8_t* image,
+						const vector<pair<uint32_t,uint32_t>>& sections, unsigned rounds, uint64_t& nInstructions)
+{
+	uint64_t nBytes=0;
+	nInstructions = 0;
+	uint64_t start = readCycles();
+	for (unsigned r=0; r<rounds; ++r)
+	{
+		for (pair<uint32_t,uint32_t> bounds : sections)
+		{
+			const uint8_t* lengths = getLengths(bounds);
+			for (uint32_t addr=bounds.first; addr<bounds.second;)
+			{
+				uint8_t size = lengths ? lengths[addr-bounds.first] : 0;
+				if (!size)
+					size = decode(image+addr);
+				if (size)
+					nInstructions++;
+				addr += size ? size : 1;
+			}
+			nBytes += bounds.second-bounds.first;
+		}
+	}
+	uint64_t cycles = readCycles()-start;
+	nInstructions /= rounds;
+	return (double)nBytes/cycles;
+}
+
+static void benchKernels(const uint8_t* image, const vector<pair<uint32_t,uint32_t>>& sections, unsigned rounds)
+{
+	// Every offset is checked, not only the instructions of the sweep
+	size_t maxSize=0;
+	for (pair<uint32_t,uint32_t> bounds : sections)
+		maxSize = max<size_t>(maxSize, bounds.second-bounds.first);
+	unique_ptr<uint8_t[]> lengths(new uint8_t[maxSize]);
+
+	auto decodeLength = [](const uint8_t* code)
+	{
+		const char* error;
+		return decodeInstructionLength(code, error);
+	};
+	auto decodeFull = [](const uint8_t* code)
+	{
+		const char* error;
+		InstructionInfo info;
+		return decodeInstruction(code, info, error);
+	};
+	auto noKernel = [](pair<uint32_t,uint32_t>) -> const uint8_t* { return nullptr; };
+
+	uint64_t nInstructions;
+	cout << "Linear sweep of the code sections, " << rounds << " rounds";
+#ifndef HAS_RDTSC
+	cout << " (no cycle counter, using the clock ticks)";
+#endif
+	cout << "\n";
+	double full = sweepCycles(noKernel, decodeFull, image, sections, rounds, nInstructions);
+	cout << "\tdecodeInstruction (readInstruction) : " << full << " bytes/cycle, " << nInstructions << " instructions\n";
+	double length = sweepCycles(noKernel, decodeLength, image, sections, rounds, nInstructions);
+	cout << "\tdecodeInstructionLength : " << length << " bytes/cycle, " << nInstructions << " instructions\n";
+
+	for (LengthKernel kernel : {LengthKernel::scalar, LengthKernel::sse41, LengthKernel::avx2})
+	{
+		if (!isLengthKernelSupported(kernel))
+		{
+			cout << "\t" << getLengthKernelName(kernel) << " kernel : not supported by this CPU\n";
+			continue;
+		}
+
+		unsigned nMismatches=0, nCandidates=0, nOffsets=0;
+		for (pair<uint32_t,uint32_t> bounds : sections)
+		{
+			computeCandidateLengths(image+bounds.first, bounds.second-bounds.first, lengths.get(), kernel);
+			for (uint32_t addr=bounds.first; addr<bounds.second; ++addr, ++nOffsets)
+			{
+				uint8_t candidate = lengths[addr-bounds.first];
+				if (!candidate)
+					continue;
+				nCandidates++;
+				if (candidate != decodeLength(image+addr))
+					nMismatches++;
+			}
+		}
+
+		// Lengths of a whole section at once, the sweep then only needs the decoder for the uncommon instructions
+		auto withKernel = [&](pair<uint32_t,uint32_t> bounds) -> const uint8_t*
+		{
+			computeCandidateLengths(image+bounds.first, bounds.second-bounds.first, lengths.get(), kernel);
+			return lengths.get();
+		};
+		uint64_t nBytes=0, start=readCycles();
+		for (unsigned r=0; r<rounds; ++r)
+		{
+			for (pair<uint32_t,uint32_t> bounds : sections)
+			{
+				computeCandidateLengths(image+bounds.first, bounds.second-bounds.first, lengths.get(), kernel);
+				nBytes += bounds.second-bounds.first;
+			}
+		}
+		double kernelCycles = (double)nBytes/(readCycles()-start);
+		double sweep = sweepCycles(withKernel, decodeLength, image, sections, rounds, nInstructions);
+		cout << "\t" << getLengthKernelName(kernel) << " kernel : " << kernelCycles << " bytes/cycle for the lengths, "
+			<< sweep << " bytes/cycle with the boundaries walk, " << nInstructions << " instructions\n";
+		cout << "\t\t" << nCandidates*100.0/nOffsets << "% of the offsets handled by the kernel, "
+			<< nMismatches << " different sizes\n";
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		cout << "Usage : benchDecoder file [rounds]\n";
+		return 1;
+	}
+	unsigned rounds = argc>2 ? atoi(argv[2]) : 100;
+
+	try {
+		MappedFile file(argv[1]);
+		PEParser parser(file);
+		uint8_t* image = parser.getVirtualImage();
+
+		vector<uint32_t> found;
+		Disassembler disasm(parser);
+		for (InstructionRef ins : disasm.getCode())
+			found.push_back(ins.addr);
+		bench("Disassembled", image, found, rounds);
+
+		// Skip a byte when an instruction can't be decoded, the stream contains data and padding
+		vector<uint32_t> sweep;
+		for (pair<uint32_t,uint32_t> bounds : parser.getCodeSectionsVirtualBounds())
+		{
+			const char* error;
+			for (uint32_t addr=bounds.first; addr+16<bounds.second;)
+			{
+				sweep.push_back(addr);
+				uint8_t size = decodeInstructionLength(image+addr, error);
+				addr += size ? size : 1;
+			}
+		}
+		bench("Linear sweep", image, sweep, rounds);
+
+		benchKernels(image, parser.getCodeSectionsVirtualBounds(), rounds);
+	}
+	catch (const char* e) {
+		cout << "Error : " << e << "\n";
+		return 1;
+	}
+	return 0;
+}
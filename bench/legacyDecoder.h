@@ -0,0 +1,10 @@
+#ifndef LEGACYDECODER_H
+#define LEGACYDECODER_H
+
+#include <stdint.h>
+
+/// The chain of comparisons readInstruction used before the table decoder, kept to compare against it.
+/// @return Size of the instruction, or 0 if it isn't supported
+uint8_t legacyInstructionLength(const uint8_t* code);
+
+#endif // LEGACYDECODER_H
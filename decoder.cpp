@@ -0,0 +1,410 @@
+#include "decoder.h"
+
+/// The longest instruction the CPU accepts, prefixes included
+static const unsigned MAX_INSTRUCTION_SIZE = 15;
+
+/// Attributes of the one-byte opcode map (32-bit mode)
+static constexpr uint8_t oneByteAttr(unsigned op)
+{
+	return (op==0x26 || op==0x2E || op==0x36 || op==0x3E || (op>=0x64&&op<=0x67)
+			|| op==0xF0 || op==0xF2 || op==0xF3) ? opPrefix
+		: op==0x0F ? opInvalid // Escape to the two-bytes map
+		: (op<0x40 && (op&7)<4) ? opModRM // ALU Eb Gb, Ev Gv, Gb Eb, Gv Ev
+		: (op<0x40 && (op&7)==4) ? opImm8 // ALU AL Ib
+		: (op<0x40 && (op&7)==5) ? opImmZ // ALU eAX Iz
+		: op<0x62 ? opNone // PUSH/POP seg, DAA/DAS/AAA/AAS, INC/DEC/PUSH/POP Zv, PUSHA/POPA
+		: op<0x64 ? opModRM // BOUND, ARPL
+		: op==0x68 ? opImmZ
+		: op==0x69 ? opModRM|opImmZ
+		: op==0x6A ? opImm8
+		: op==0x6B ? opModRM|opImm8
+		: op<0x70 ? opNone // INS/OUTS
+		: op<0x80 ? opImm8 // Jcc Jb
+		: op==0x81 ? opModRM|opImmZ
+		: op<0x84 ? opModRM|opImm8
+		: op<0x90 ? opModRM
+		: op==0x9A ? opInvalid // CALLF Ap
+		: op<0xA0 ? opNone
+		: op<0xA4 ? opMoffs
+		: op==0xA8 ? opImm8
+		: op==0xA9 ? opImmZ
+		: op<0xB0 ? opNone // String instructions
+		: op<0xB8 ? opImm8 // MOV Zb Ib
+		: op<0xC0 ? opImmZ // MOV Zv Iv
+		: (op==0xC0 || op==0xC1 || op==0xC6) ? opModRM|opImm8
+		: (op==0xC2 || op==0xCA) ? opImm16 // RET Iw
+		: (op==0xC4 || op==0xC5) ? opModRM // LES, LDS
+		: op==0xC7 ? opModRM|opImmZ
+		: op==0xC8 ? opImm16|opImm8 // ENTER Iw Ib
+		: op==0xCD ? opImm8 // INT Ib
+		: op<0xD0 ? opNone
+		: op<0xD4 ? opModRM // Shift groups
+		: op<0xD6 ? opImm8 // AAM, AAD
+		: op<0xD8 ? opNone // SALC, XLAT
+		: op<0xE0 ? opModRM // x87 FPU
+		: op<0xE8 ? opImm8 // LOOP/JCXZ Jb, IN/OUT Ib
+		: op<0xEA ? opImmZ // CALL/JMP Jz
+		: op==0xEA ? opInvalid // JMPF Ap
+		: op==0xEB ? opImm8
+		: op<0xF6 ? opNone
+		: op==0xF6 ? opModRM|opGroup3|opImm8
+		: op==0xF7 ? opModRM|opGroup3|opImmZ
+		: op<0xFE ? opNone
+		: opModRM; // FE, FF groups
+}
+
+/// Attributes of the two-bytes opcode map (0x0F XX)
+static constexpr uint8_t twoBytesAttr(unsigned op)
+{
+	return (op==0x04 || op==0x0A || op==0x0C || (op>=0x24&&op<=0x27) || op==0x36 || op==0x39
+			|| (op>=0x3B&&op<=0x3F) || op==0x7A || op==0x7B || op==0xA6 || op==0xA7) ? opInvalid
+		: (op==0x38 || op==0x3A) ? opInvalid // Escapes to the three-bytes maps
+		: op<0x04 ? opModRM // Groups 6 and 7, LAR, LSL
+		: op<0x0D ? opNone // SYSCALL, CLTS, SYSRET, INVD, WBINVD, UD2
+		: op==0x0D ? opModRM // PREFETCHW
+		: op==0x0E ? opNone // FEMMS
+		: op==0x0F ? opModRM|opImm8 // 3DNow!, the opcode is in the immediate
+		: op<0x30 ? opModRM // SSE moves, hint NOPs, MOV Cd/Dd
+		: op<0x40 ? opNone // WRMSR, RDTSC, RDMSR, RDPMC, SYSENTER, SYSEXIT, GETSEC
+		: op<0x70 ? opModRM // CMOVcc, SSE, MMX
+		: op<0x74 ? opModRM|opImm8 // PSHUF, shift groups
+		: op==0x77 ? opNone // EMMS
+		: op<0x80 ? opModRM
+		: op<0x90 ? opImmZ // Jcc Jz
+		: op<0xA0 ? opModRM // SETcc
+		: op<0xA3 ? opNone // PUSH/POP FS, CPUID
+		: (op==0xA4 || op==0xAC || op==0xBA || op==0xC2 || (op>=0xC4&&op<=0xC6)) ? opModRM|opImm8
+		: (op>=0xA8 && op<=0xAA) ? opNone // PUSH/POP GS, RSM
+		: (op>=0xC8 && op<=0xCF) ? opNone // BSWAP Zv
+		: opModRM;
+}
+
+template<unsigned... I> struct IndexList {};
+template<unsigned N, unsigned... I> struct MakeIndexList : MakeIndexList<N-1, N-1, I...> {};
+template<unsigned... I> struct MakeIndexList<0, I...> { typedef IndexList<I...> type; };
+
+/// Attributes of each of the 256 values of a byte
+struct OpcodeTable
+{
+	uint8_t attr[256];
+};
+
+template<unsigned... I>
+static constexpr OpcodeTable makeOneByteTable(IndexList<I...>)
+{
+	return OpcodeTable{{oneByteAttr(I)...}};
+}
+
+template<unsigned... I>
+static constexpr OpcodeTable makeTwoBytesTable(IndexList<I...>)
+{
+	return OpcodeTable{{twoBytesAttr(I)...}};
+}
+
+/// Size of the ModRM byte, the SIB byte and the displacement, with 32-bit addressing.
+/// Doesn't include the displacement of a SIB byte without base.
+static constexpr uint8_t modRM32Size(unsigned modrm)
+{
+	return (modrm>>6)==3 ? 1 // Direct register
+		: ((modrm>>6)==0 && (modrm&7)==5) ? 5 // Absolute address
+		: 1 + ((modrm&7)==4) + ((modrm>>6)==1 ? 1 : (modrm>>6)==2 ? 4 : 0); // SIB byte, disp8 or disp32
+}
+
+template<unsigned... I>
+static constexpr OpcodeTable makeModRM32Table(IndexList<I...>)
+{
+	return OpcodeTable{{modRM32Size(I)...}};
+}
+
+static constexpr OpcodeTable oneByteTable = makeOneByteTable(MakeIndexList<256>::type());
+static constexpr OpcodeTable twoBytesTable = makeTwoBytesTable(MakeIndexList<256>::type());
+static constexpr OpcodeTable modRM32Table = makeModRM32Table(MakeIndexList<256>::type());
+
+static_assert(oneByteTable.attr[0x66]==opPrefix && oneByteTable.attr[0xE8]==opImmZ, "Bad one-byte opcode table");
+static_assert(twoBytesTable.attr[0x84]==opImmZ && twoBytesTable.attr[0xB6]==opModRM, "Bad two-bytes opcode table");
+
+/// Sizes depending on the operand-size override prefix (0x66)
+template<bool OpSize> struct OperandSize;
+template<> struct OperandSize<false>
+{
+	static constexpr unsigned immZ = 4;
+};
+template<> struct OperandSize<true>
+{
+	static constexpr unsigned immZ = 2;
+};
+
+/// Sizes depending on the address-size override prefix (0x67)
+template<bool AdSize> struct AddressSize;
+template<> struct AddressSize<false>
+{
+	static constexpr unsigned moffs = 4;
+	/// Size of the ModRM byte, the SIB byte and the displacement, with 32-bit addressing
+	static unsigned modRMLength(const uint8_t* modrm)
+	{
+		unsigned size = modRM32Table.attr[*modrm];
+		if ((*modrm&0xC7)==0x04 && (modrm[1]&7)==5) // SIB without a base, followed by a full displacement
+			size+=4;
+		return size;
+	}
+};
+template<> struct AddressSize<true>
+{
+	static constexpr unsigned moffs = 2;
+	/// Size of the ModRM byte and the displacement, with 16-bit addressing (there's no SIB)
+	static unsigned modRMLength(const uint8_t* modrm)
+	{
+		unsigned mod = *modrm>>6, rm = *modrm&7;
+		if (mod==3) // Direct register
+			return 1;
+		if (mod==0 && rm==6) // Absolute address
+			return 3;
+		return 1+mod; // No displacement, disp8 or disp16
+	}
+};
+
+/// Size of everything after the opcode bytes
+template<bool OpSize, bool AdSize>
+static unsigned operandsLength(uint8_t attr, const uint8_t* operands)
+{
+	unsigned size = 0;
+	if (attr & opModRM)
+	{
+		size += AddressSize<AdSize>::modRMLength(operands);
+		if ((attr & opGroup3) && ((*operands>>3)&7)>1) // Only TEST has an immediate
+			return size;
+	}
+	if (attr & opImm8)
+		size += 1;
+	if (attr & opImm16)
+		size += 2;
+	if (attr & opImmZ)
+		size += OperandSize<OpSize>::immZ;
+	if (attr & opMoffs)
+		size += AddressSize<AdSize>::moffs;
+	return size;
+}
+
+/// Indexed by opSize | adSize<<1
+static unsigned (*const operandsLengths[4])(uint8_t, const uint8_t*) =
+{
+	operandsLength<false,false>, operandsLength<true,false>,
+	operandsLength<false,true>, operandsLength<true,true>
+};
+
+/// Reads the prefixes and the opcode bytes
+/// @return Start of the operands, or nullptr if the instruction isn't supported
+static inline const uint8_t* decodeOpcode(const uint8_t* code, uint8_t& attr, uint8_t& prefixes, const char*& error)
+{
+	const uint8_t* p = code;
+	prefixes = 0;
+	while (oneByteTable.attr[*p]==opPrefix)
+	{
+		if (*p==0x66)
+			prefixes |= prefixOpSize;
+		else if (*p==0x67)
+			prefixes |= prefixAdSize;
+		else if (*p==0xF0)
+			prefixes |= prefixLock;
+		else if (*p==0xF2 || *p==0xF3)
+			prefixes |= prefixRep;
+		else
+			prefixes |= prefixSegment;
+		if (++p-code >= (int)MAX_INSTRUCTION_SIZE)
+		{
+			error = "Too many prefixes";
+			return nullptr;
+		}
+	}
+
+	uint8_t op = *p++;
+	if (op!=0x0F)
+	{
+		attr = oneByteTable.attr[op];
+		if (attr & opInvalid)
+		{
+			error = (op==0x9A || op==0xEA) ? "Far branches not supported" : "Invalid opcode";
+			return nullptr;
+		}
+		if (op==0xFF && (((*p>>3)&7)==3 || ((*p>>3)&7)==5))
+		{
+			error = "Far branches not supported";
+			return nullptr;
+		}
+		if ((op==0xC4 || op==0xC5 || op==0x62) && (*p>>6)==3)
+		{
+			error = "VEX and EVEX instructions not supported";
+			return nullptr;
+		}
+	}
+	else
+	{
+		uint8_t op2 = *p++;
+		if (op2==0x38)
+		{
+			p++;
+			attr = opModRM;
+		}
+		else if (op2==0x3A)
+		{
+			p++;
+			attr = opModRM|opImm8;
+		}
+		else
+			attr = twoBytesTable.attr[op2];
+		if (attr & opInvalid)
+		{
+			error = "Invalid opcode";
+			return nullptr;
+		}
+	}
+	return p;
+}
+
+uint8_t decodeInstructionLength(const uint8_t* code, const char*& error)
+{
+	uint8_t attr, prefixes;
+	const uint8_t* p = decodeOpcode(code, attr, prefixes, error);
+	if (!p)
+		return 0;
+
+	unsigned size = p-code + operandsLengths[prefixes&(prefixOpSize|prefixAdSize)](attr, p);
+	if (size > MAX_INSTRUCTION_SIZE)
+	{
+		error = "Instruction too long";
+		return 0;
+	}
+	return size;
+}
+
+uint8_t decodeInstruction(const uint8_t* code, InstructionInfo& info, const char*& error)
+{
+	uint8_t attr, prefixes;
+	const uint8_t* p = decodeOpcode(code, attr, prefixes, error);
+	if (!p)
+		return 0;
+
+	info.prefixes = prefixes;
+	info.nPrefixes = 0;
+	while (oneByteTable.attr[code[info.nPrefixes]]==opPrefix)
+		info.nPrefixes++;
+	const uint8_t* opcode = code+info.nPrefixes;
+	info.opcodeSize = p-opcode;
+	info.type = classifyInstruction(opcode);
+	info.operands = classifyOperands(opcode);
+	info.modrmOffset = info.sibOffset = 0;
+	info.dispOffset = info.dispSize = 0;
+
+	bool adSize = prefixes & prefixAdSize;
+	if (attr & opModRM)
+	{
+		info.modrmOffset = p-code;
+		uint8_t modrm = *p++;
+		unsigned mod = modrm>>6, rm = modrm&7;
+		if (mod!=3 && !adSize)
+		{
+			if (rm==4)
+			{
+				info.sibOffset = p-code;
+				uint8_t sib = *p++;
+				if (mod==0 && (sib&7)==5)
+					info.dispSize = 4;
+			}
+			else if (mod==0 && rm==5)
+				info.dispSize = 4;
+			if (mod==1)
+				info.dispSize = 1;
+			else if (mod==2)
+				info.dispSize = 4;
+		}
+		else if (mod!=3)
+			info.dispSize = (mod==0 && rm==6) ? 2 : mod;
+		if (info.dispSize)
+			info.dispOffset = p-code;
+		p += info.dispSize;
+	}
+	else if (attr & opMoffs)
+	{
+		// The absolute address of MOV AL/EAX Ob/Ov is a displacement without ModRM
+		info.dispOffset = p-code;
+		info.dispSize = adSize ? 2 : 4;
+		p += info.dispSize;
+		attr &= ~opMoffs;
+	}
+
+	info.immSize = operandsLengths[prefixes&(prefixOpSize|prefixAdSize)](attr&~opModRM, p);
+	if ((attr & opGroup3) && ((code[info.modrmOffset]>>3)&7)>1)
+		info.immSize = 0;
+	info.immOffset = info.immSize ? p-code : 0;
+
+	unsigned size = p-code + info.immSize;
+	if (size > MAX_INSTRUCTION_SIZE)
+	{
+		error = "Instruction too long";
+		return 0;
+	}
+	decodeRegisterEffects(code, info);
+	return size;
+}
+
+uint8_t getOneByteOpcodeAttr(uint8_t op)
+{
+	return oneByteTable.attr[op];
+}
+
+uint8_t getModRM32Size(uint8_t modrm)
+{
+	return modRM32Table.attr[modrm];
+}
+
+insType classifyInstruction(const uint8_t* ins)
+{
+	if (ins[0]==0x90)
+		return insType::nop;
+	else if ((ins[0]>=0x70&&ins[0]<=0x7F) || (ins[0]>=0xE0&&ins[0]<=0xE3) || (ins[0]==0x0F&&ins[1]>=0x80&&ins[1]<=0x8F))
+		return insType::condJump;
+	else if ((ins[0]>=0xE9&&ins[0]<=0xEB) || (ins[0]==0xFF&&(((ins[1]>>3)&7)==4||((ins[1]>>3)&7)==5)))
+		return insType::uncondJump;
+	else if (ins[0]==0x9A || ins[0]==0xE8 || (ins[0]==0xFF&&(((ins[1]>>3)&7)==2||((ins[1]>>3)&7)==3)))
+		return insType::call;
+	else if (ins[0]==0xC2 || ins[0]==0xC3 || ins[0]==0xCA || ins[0]==0xCB || ins[0]==0xCF)
+		return insType::ret;
+	else if ((ins[0]>=0xCC&&ins[0]<=0xCE) || ins[0]==0xF1)
+		return insType::intCall;
+	else if (ins[0]==0x9B || (ins[0]>=0xD8&&ins[0]<=0xDF) || (ins[0]==0x0F&&ins[1]==0x77))
+		return insType::x87fpu;
+	else if (ins[0]==0x06 || ins[0]==0x07 || ins[0]==0x0E || ins[0]==0x16 || ins[0]==0x17
+			|| ins[0]==0x1E || ins[0]==0x1F || (ins[0]>=0x50&&ins[0]<=0x62) || ins[0]==0x68 || ins[0]==0x6A
+			|| ins[0]==0x8F || ins[0]==0x9C || ins[0]==0x9D || ins[0]==0xC8 || ins[0]==0xC9
+			|| (ins[0]==0xFF&&((ins[1]>>3)&7)==6) ||
+			(ins[0]==0x0F && (ins[1]==0xA0 || ins[1]==0xA1 || ins[1]==0xA8 || ins[1]==0xA9)))
+		return insType::stack;
+	else
+		return insType::other;
+}
+
+opType classifyOperands(const uint8_t* ins)
+{
+	uint8_t op=ins[0];
+
+	if (op==0x6 || op==0x7 || op==0xE || op==0x16 || op==0x17 || op==0x1E || op==0x1F
+		|| op==0x27 || op==0x2F || op==0x37 || op==0x3F
+		|| (op>=0x40&&op<=0x61) || (op>=0x6C&&op<=0x6F) || (op>=0x90&&op<=0x99)
+		|| (op>=0x9B&&op<=0x9F) || (op>=0xA4&&op<=0xA7) || (op>=0xAA&&op<=0xAF) || op==0xC3 || op==0xC9
+		|| op==0xCB || op==0xCC || op==0xCE || op==0xCF || op==0xD7 || (op>=0xEC&&op<=0xEF)
+		|| op==0xF4 || op==0xF5 || (op>=0xF8&&op<=0xFD) || op==0xF0 || op==0xF2 || op==0xF3
+		|| op==0x67 || op==0x66 || op==0x2E || op==0x36 || op==0x3E || op==0x26 || op==0x64 || op==0x65)
+		return opType::none;
+	else if (op==0x00||op==0x08||op==0x10||op==0x18||op==0x20||op==0x28||op==0x30||op==0x38||op==0x88||op==0x84)
+		return opType::EbGb;
+	else if (op==0x02||op==0x0A||op==0x12||op==0x1A||op==0x22||op==0x2A||op==0x32||op==0x3A||op==0x8A||op==0x86)
+		return opType::GbEb;
+	else if (op==0x01||op==0x09||op==0x11||op==0x19||op==0x21||op==0x29||op==0x31||op==0x39||op==0x85||op==0x89)
+		return opType::EvGv;
+	else if (op==0x03||op==0x0B||op==0x13||op==0x1B||op==0x23||op==0x2B||op==0x33||op==0x3B||op==0x87||op==0x8B)
+		return opType::GvEv;
+	else if (op==0x8D)
+		return opType::GvM;
+	else
+		return opType::other;
+}
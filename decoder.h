@@ -0,0 +1,117 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdint.h>
+
+/// Type of an instruction
+enum class insType : uint8_t
+{
+	other,			// Instructions that don't have their own code
+	nop,			// Instructions that do nothing, not necessarily 0x90 (NOP)
+	condJump,		// Conditional JMPs
+	uncondJump,		// Unconditional JMPs
+	call,			// CALL instructions
+	ret,			// RET instructions
+	intCall,		// Calls to interrupt procedures
+	x87fpu,			// x87 instructions for the FPU
+	stack			// Stack instructions (POPs/PUSHs)
+};
+
+/// Type of the operands of an instruction
+enum class opType : uint8_t
+{
+	other,
+	none,
+	GvEv,
+	EvGv,
+	GbEb,
+	EbGb,
+	GvM,
+	Ib,
+	Iv
+};
+
+/// Attributes of an opcode, enough to find the length of the instruction.
+/// The sizes of the immediates add up, ENTER Iw Ib is opImm16|opImm8.
+enum OpcodeAttr : uint8_t
+{
+	opNone		= 0,		///< Just the opcode
+	opModRM		= 1<<0,		///< Followed by a ModRM byte, and possibly a SIB byte and a displacement
+	opImm8		= 1<<1,		///< 1 byte immediate or rel8
+	opImm16		= 1<<2,		///< 2 bytes immediate
+	opImmZ		= 1<<3,		///< 2 or 4 bytes immediate or rel, depending on the operand-size
+	opMoffs		= 1<<4,		///< 2 or 4 bytes absolute address, depending on the address-size (MOV AL/EAX Ob/Ov)
+	opGroup3	= 1<<5,		///< F6/F7 groups, only /0 and /1 have an immediate
+	opPrefix	= 1<<6,		///< Prefix byte, not an opcode
+	opInvalid	= 1<<7		///< Invalid or not supported, or an escape to another opcode map
+};
+
+/// Prefixes of an instruction, by group
+enum PrefixFlags : uint8_t
+{
+	prefixOpSize	= 1<<0,		///< 0x66 Operand-size override
+	prefixAdSize	= 1<<1,		///< 0x67 Address-size override
+	prefixLock		= 1<<2,		///< 0xF0
+	prefixRep		= 1<<3,		///< 0xF2 or 0xF3
+	prefixSegment	= 1<<4		///< Segment override
+};
+
+/// Registers and other state an instruction reads or writes, as the bits of a mask. The GPRs are in encoding order.
+/// A write that can leave part of the old value (8/16-bit or conditional writes) is counted as a read too,
+/// so the registers an instruction writes without reading are the ones it kills.
+enum RegisterMask : uint16_t
+{
+	regEax		= 1<<0,
+	regEcx		= 1<<1,
+	regEdx		= 1<<2,
+	regEbx		= 1<<3,
+	regEsp		= 1<<4,
+	regEbp		= 1<<5,
+	regEsi		= 1<<6,
+	regEdi		= 1<<7,
+	regGPRs		= 0xFF,
+	regFlags	= 1<<8,		///< EFLAGS as a whole, writing part of the flags reads them
+	regMemory	= 1<<9,		///< Any memory, the stack included. Pointers to locals are common, so it isn't split.
+	regAll		= 0x3FF		///< Calls, returns, system, x87 and SIMD instructions, and the ones we don't know
+};
+
+/// Attributes of a decoded instruction, computed once by the decoder and stored with the instruction.
+/// The offsets are from the start of the instruction, prefixes included, and are 0 if the field is absent.
+struct InstructionInfo
+{
+	insType type;
+	opType operands;
+	uint8_t prefixes;		///< PrefixFlags of all the prefixes
+	uint8_t nPrefixes;		///< Number of prefix bytes, the opcode starts right after
+	uint8_t opcodeSize;		///< 1 to 3 bytes, 0x0F and the 0x38/0x3A escapes included
+	uint8_t modrmOffset;
+	uint8_t sibOffset;
+	uint8_t dispOffset;		///< Displacement of the ModRM, or absolute address of MOV AL/EAX Ob/Ov
+	uint8_t dispSize;
+	uint8_t immOffset;		///< Immediate or relative branch offset
+	uint8_t immSize;
+	uint16_t uses;			///< RegisterMask of what the instruction may read
+	uint16_t defs;			///< RegisterMask of what the instruction may write
+};
+
+/// Finds the size of the instruction starting at code, including all its prefixes.
+/// Only the one-byte and two-bytes (0x0F) opcode maps and the 0F38/0F3A three-bytes maps are supported.
+/// @param error Reason of the failure when the instruction isn't supported
+/// @return Size of the instruction, or 0 if it's invalid or not supported
+uint8_t decodeInstructionLength(const uint8_t* code, const char*& error);
+/// Same as decodeInstructionLength, and fills the attributes of the instruction
+uint8_t decodeInstruction(const uint8_t* code, InstructionInfo& info, const char*& error);
+/// Fills the uses and defs of an instruction whose other attributes are decoded.
+/// Conservative, anything it doesn't know reads and writes regAll.
+void decodeRegisterEffects(const uint8_t* code, InstructionInfo& info);
+/// OpcodeAttr of an opcode of the one-byte map
+uint8_t getOneByteOpcodeAttr(uint8_t op);
+/// Size of the ModRM byte, the SIB byte and the displacement with 32-bit addressing,
+/// without the displacement of a SIB byte without base
+uint8_t getModRM32Size(uint8_t modrm);
+/// Type of the instruction whose opcode starts at ins (after the prefixes)
+insType classifyInstruction(const uint8_t* ins);
+/// Type of the operands of the instruction whose opcode starts at ins (after the prefixes)
+opType classifyOperands(const uint8_t* ins);
+
+#endif // DECODER_H
@@ -0,0 +1,474 @@
+#include "decoder.h"
+
+/// Accumulates what the instruction being decoded reads and writes
+struct RegisterEffects
+{
+	const uint8_t* code;
+	const InstructionInfo& info;
+	uint16_t uses;
+	uint16_t defs;
+	bool opSize; ///< 16-bit operands, writing a register keeps its upper half
+
+	uint8_t modrm() const {return code[info.modrmOffset];}
+	bool isRegisterOperand() const {return (modrm()>>6)==3;}
+	/// The 8-bit registers AL to BH are parts of EAX to EBX
+	static uint16_t reg(unsigned n, bool byteOp) {return 1<<(byteOp ? n&3 : n);}
+
+	void read(uint16_t regs) {uses |= regs;}
+	void write(uint16_t regs, bool partial)
+	{
+		defs |= regs;
+		if (partial)
+			uses |= regs;
+	}
+	/// Registers of the address of the ModRM memory operand
+	uint16_t addressRegisters() const
+	{
+		unsigned mod = modrm()>>6, rm = modrm()&7;
+		if (info.prefixes & prefixAdSize)
+		{
+			static const uint16_t regs16[8] = {regEbx|regEsi, regEbx|regEdi, regEbp|regEsi, regEbp|regEdi,
+												regEsi, regEdi, regEbp, regEbx};
+			return (mod==0 && rm==6) ? 0 : regs16[rm];
+		}
+		if (rm==4)
+		{
+			uint8_t sib = code[info.sibOffset];
+			unsigned index = (sib>>3)&7, base = sib&7;
+			return (index!=4 ? 1<<index : 0) | ((mod!=0 || base!=5) ? 1<<base : 0);
+		}
+		return (mod==0 && rm==5) ? 0 : 1<<rm;
+	}
+	void readE(bool byteOp)
+	{
+		if (isRegisterOperand())
+			uses |= reg(modrm()&7, byteOp);
+		else
+			uses |= addressRegisters() | regMemory;
+	}
+	void writeE(bool byteOp)
+	{
+		if (isRegisterOperand())
+			write(reg(modrm()&7, byteOp), byteOp || opSize);
+		else
+		{
+			uses |= addressRegisters();
+			defs |= regMemory;
+		}
+	}
+	void readG(bool byteOp) {uses |= reg((modrm()>>3)&7, byteOp);}
+	void writeG(bool byteOp) {write(reg((modrm()>>3)&7, byteOp), byteOp || opSize);}
+	void push()
+	{
+		uses |= regEsp;
+		defs |= regEsp|regMemory;
+	}
+	void pop()
+	{
+		uses |= regEsp|regMemory;
+		defs |= regEsp;
+	}
+	void unknown() {uses = defs = regAll;}
+};
+
+/// Instructions of the two-bytes map (0x0F XX) working on the general purpose registers
+static void decodeTwoBytesEffects(RegisterEffects& e, uint8_t op)
+{
+	if (op>=0x18 && op<=0x1F) // Prefetches and hint NOPs
+		return;
+	if (op>=0x40 && op<=0x4F) // CMOVcc, the destination may be left as it is
+	{
+		e.read(regFlags);
+		e.readE(false);
+		e.readG(false);
+		e.writeG(false);
+		return;
+	}
+	if (op>=0x80 && op<=0x8F) // Jcc
+	{
+		e.read(regFlags);
+		return;
+	}
+	if (op>=0x90 && op<=0x9F) // SETcc
+	{
+		e.read(regFlags);
+		e.writeE(true);
+		return;
+	}
+	if (op>=0xC8) // BSWAP
+	{
+		e.read(RegisterEffects::reg(op&7, false));
+		e.write(RegisterEffects::reg(op&7, false), false);
+		return;
+	}
+
+	unsigned group = e.info.modrmOffset ? (e.modrm()>>3)&7 : 0;
+	switch (op)
+	{
+		case 0x31: // RDTSC
+			e.write(regEax|regEdx, false);
+			break;
+		case 0xA2: // CPUID
+			e.read(regEax|regEcx);
+			e.write(regEax|regEcx|regEdx|regEbx, false);
+			break;
+		case 0xA3: // BT, ZF is kept
+			e.readE(false);
+			e.readG(false);
+			e.write(regFlags, true);
+			break;
+		case 0xAB: case 0xB3: case 0xBB: // BTS, BTR, BTC
+			e.readE(false);
+			e.readG(false);
+			e.writeE(false);
+			e.write(regFlags, true);
+			break;
+		case 0xBA: // BT, BTS, BTR, BTC Ev Ib
+			if (group<4)
+			{
+				e.unknown();
+				break;
+			}
+			e.readE(false);
+			if (group!=4)
+				e.writeE(false);
+			e.write(regFlags, true);
+			break;
+		case 0xA4: case 0xA5: case 0xAC: case 0xAD: // SHLD, SHRD, a count of 0 changes nothing
+			if (op&1)
+				e.read(regEcx);
+			e.readE(false);
+			e.readG(false);
+			e.writeE(false);
+			e.write(regFlags, true);
+			break;
+		case 0xAF: // IMUL Gv Ev
+			e.readE(false);
+			e.readG(false);
+			e.writeG(false);
+			e.write(regFlags, false);
+			break;
+		case 0xB0: case 0xB1: // CMPXCHG
+			e.read(regEax);
+			e.readE(op==0xB0);
+			e.readG(op==0xB0);
+			e.writeE(op==0xB0);
+			e.write(regEax, true);
+			e.write(regFlags, false);
+			break;
+		case 0xB6: case 0xBE: // MOVZX, MOVSX Gv Eb
+		case 0xB7: case 0xBF: // MOVZX, MOVSX Gv Ew
+			e.readE(!(op&1));
+			e.writeG(false);
+			break;
+		case 0xBC: case 0xBD: // BSF, BSR, the destination is kept if the source is 0
+			e.readE(false);
+			e.readG(false);
+			e.writeG(false);
+			e.write(regFlags, false);
+			break;
+		case 0xC0: case 0xC1: // XADD
+			e.readE(op==0xC0);
+			e.readG(op==0xC0);
+			e.writeE(op==0xC0);
+			e.writeG(op==0xC0);
+			e.write(regFlags, false);
+			break;
+		default:
+			e.unknown();
+	}
+}
+
+void decodeRegisterEffects(const uint8_t* code, InstructionInfo& info)
+{
+	RegisterEffects e{code, info, 0, 0, (info.prefixes & prefixOpSize)!=0};
+	const uint8_t* opcode = code+info.nPrefixes;
+	uint8_t op = opcode[0];
+	bool byteOp = !(op&1);
+	unsigned group = info.modrmOffset ? (e.modrm()>>3)&7 : 0;
+
+	if (info.opcodeSize==3)
+		e.unknown();
+	else if (op==0x0F)
+		decodeTwoBytesEffects(e, opcode[1]);
+	else if (op<0x40 && (op&7)<6) // ADD, OR, ADC, SBB, AND, SUB, XOR, CMP
+	{
+		unsigned alu = op>>3;
+		if ((op&7)<4)
+		{
+			e.readE(byteOp);
+			e.readG(byteOp);
+			if (alu!=7 && (op&7)<2)
+				e.writeE(byteOp);
+			else if (alu!=7)
+				e.writeG(byteOp);
+			// XOR or SUB of a register with itself doesn't depend on its value
+			if ((alu==5 || alu==6) && !byteOp && !e.opSize && e.isRegisterOperand()
+				&& ((e.modrm()>>3)&7)==(e.modrm()&7))
+				e.uses = 0;
+		}
+		else
+		{
+			e.read(regEax);
+			if (alu!=7)
+				e.write(regEax, byteOp || e.opSize);
+		}
+		if (alu==2 || alu==3)
+			e.read(regFlags);
+		e.write(regFlags, false);
+	}
+	else if (op>=0x40 && op<=0x4F) // INC, DEC Zv, CF is kept
+	{
+		e.read(RegisterEffects::reg(op&7, false));
+		e.write(RegisterEffects::reg(op&7, false), e.opSize);
+		e.write(regFlags, true);
+	}
+	else if (op>=0x50 && op<=0x57) // PUSH Zv
+	{
+		e.read(RegisterEffects::reg(op&7, false));
+		e.push();
+	}
+	else if (op>=0x58 && op<=0x5F) // POP Zv
+	{
+		e.pop();
+		e.write(RegisterEffects::reg(op&7, false), e.opSize);
+	}
+	else if (op>=0x70 && op<=0x7F) // Jcc
+		e.read(regFlags);
+	else if (op>=0x91 && op<=0x97) // XCHG eAX Zv
+	{
+		e.read(regEax|RegisterEffects::reg(op&7, false));
+		e.write(regEax|RegisterEffects::reg(op&7, false), e.opSize);
+	}
+	else if (op>=0xB0 && op<=0xB7) // MOV Zb Ib
+		e.write(RegisterEffects::reg(op&7, true), true);
+	else if (op>=0xB8 && op<=0xBF) // MOV Zv Iv
+		e.write(RegisterEffects::reg(op&7, false), e.opSize);
+	else if ((op>=0xA4 && op<=0xA7) || (op>=0xAA && op<=0xAF)) // String instructions, they read DF
+	{
+		// With a REP prefix ECX counts down, and they may not run at all
+		uint16_t counter = (info.prefixes & prefixRep) ? regEcx : 0;
+		e.read(regFlags|counter);
+		e.write(counter, true);
+		if (op<=0xA5) // MOVS
+		{
+			e.read(regEsi|regEdi|regMemory);
+			e.write(regEsi|regEdi|regMemory, true);
+		}
+		else if (op<=0xA7) // CMPS
+		{
+			e.read(regEsi|regEdi|regMemory);
+			e.write(regEsi|regEdi|regFlags, true);
+		}
+		else if (op<=0xAB) // STOS
+		{
+			e.read(regEax);
+			e.write(regEdi|regMemory, true);
+		}
+		else if (op<=0xAD) // LODS
+		{
+			e.read(regMemory);
+			e.write(regEax|regEsi, true);
+		}
+		else // SCAS
+		{
+			e.read(regEax|regEdi|regMemory);
+			e.write(regEdi|regFlags, true);
+		}
+	}
+	else switch (op)
+	{
+		case 0x06: case 0x0E: case 0x16: case 0x1E: // PUSH seg
+			e.push();
+			break;
+		case 0x27: case 0x2F: case 0x37: case 0x3F: // DAA, DAS, AAA, AAS
+			e.read(regEax|regFlags);
+			e.write(regEax|regFlags, true);
+			break;
+		case 0x60: // PUSHA
+			e.read(regGPRs);
+			e.push();
+			break;
+		case 0x61: // POPA
+			e.pop();
+			e.write(regGPRs, e.opSize);
+			break;
+		case 0x68: case 0x6A: // PUSH Iz, Ib
+			e.push();
+			break;
+		case 0x69: case 0x6B: // IMUL Gv Ev Iz, Ib
+			e.readE(false);
+			e.writeG(false);
+			e.write(regFlags, false);
+			break;
+		case 0x80: case 0x81: case 0x82: case 0x83: // Group 1, same operations as the ALU opcodes
+			e.readE(op==0x80 || op==0x82);
+			if (group!=7)
+				e.writeE(op==0x80 || op==0x82);
+			if (group==2 || group==3)
+				e.read(regFlags);
+			e.write(regFlags, false);
+			break;
+		case 0x84: case 0x85: // TEST
+			e.readE(byteOp);
+			e.readG(byteOp);
+			e.write(regFlags, false);
+			break;
+		case 0x86: case 0x87: // XCHG
+			e.readE(byteOp);
+			e.readG(byteOp);
+			e.writeE(byteOp);
+			e.writeG(byteOp);
+			break;
+		case 0x88: case 0x89: // MOV Eb Gb, Ev Gv
+			e.readG(byteOp);
+			e.writeE(byteOp);
+			break;
+		case 0x8A: case 0x8B: // MOV Gb Eb, Gv Ev
+			e.readE(byteOp);
+			e.writeG(byteOp);
+			break;
+		case 0x8C: // MOV Ew Sw
+			e.opSize = true;
+			e.writeE(false);
+			break;
+		case 0x8D: // LEA, doesn't access the memory
+			if (e.isRegisterOperand())
+				e.unknown();
+			else
+			{
+				e.read(e.addressRegisters());
+				e.writeG(false);
+			}
+			break;
+		case 0x8F: // POP Ev
+			e.pop();
+			e.writeE(false);
+			break;
+		case 0x90: // NOP, PAUSE
+		case 0x9B: // FWAIT
+		case 0xE9: case 0xEB: // JMP Jz, Jb
+			break;
+		case 0x98: // CWDE, CBW
+			e.read(regEax);
+			e.write(regEax, e.opSize);
+			break;
+		case 0x99: // CDQ, CWD
+			e.read(regEax);
+			e.write(regEdx, e.opSize);
+			break;
+		case 0x9C: // PUSHF
+			e.read(regFlags);
+			e.push();
+			break;
+		case 0x9D: // POPF
+			e.pop();
+			e.write(regFlags, false);
+			break;
+		case 0x9E: // SAHF
+			e.read(regEax);
+			e.write(regFlags, true);
+			break;
+		case 0x9F: // LAHF
+			e.read(regFlags);
+			e.write(regEax, true);
+			break;
+		case 0xA0: case 0xA1: // MOV AL/eAX Ob/Ov
+			e.read(regMemory);
+			e.write(regEax, byteOp || e.opSize);
+			break;
+		case 0xA2: case 0xA3: // MOV Ob/Ov AL/eAX
+			e.read(regEax);
+			e.write(regMemory, false);
+			break;
+		case 0xA8: case 0xA9: // TEST AL/eAX
+			e.read(regEax);
+			e.write(regFlags, false);
+			break;
+		case 0xC0: case 0xC1: case 0xD0: case 0xD1: case 0xD2: case 0xD3: // Shift groups, a count of 0 changes nothing
+			if (op>=0xD2)
+				e.read(regEcx);
+			e.readE(byteOp);
+			e.writeE(byteOp);
+			e.write(regFlags, true);
+			break;
+		case 0xC6: case 0xC7: // MOV Eb Ib, Ev Iz
+			if (group)
+				e.unknown(); // XABORT, XBEGIN
+			else
+				e.writeE(byteOp);
+			break;
+		case 0xC8: // ENTER
+			e.read(regEsp|regEbp|regMemory);
+			e.write(regEsp|regEbp|regMemory, false);
+			break;
+		case 0xC9: // LEAVE
+			e.read(regEbp|regMemory);
+			e.write(regEsp|regEbp, e.opSize);
+			break;
+		case 0xD4: case 0xD5: // AAM, AAD
+			e.read(regEax);
+			e.write(regEax, true);
+			e.write(regFlags, false);
+			break;
+		case 0xD6: // SALC
+			e.read(regFlags);
+			e.write(regEax, true);
+			break;
+		case 0xD7: // XLAT
+			e.read(regEax|regEbx|regMemory);
+			e.write(regEax, true);
+			break;
+		case 0xE0: case 0xE1: case 0xE2: // LOOPNE, LOOPE, LOOP
+			if (op!=0xE2)
+				e.read(regFlags);
+			e.read(regEcx);
+			e.write(regEcx, true);
+			break;
+		case 0xE3: // JECXZ
+			e.read(regEcx);
+			break;
+		case 0xF5: case 0xF8: case 0xF9: case 0xFC: case 0xFD: // CMC, CLC, STC, CLD, STD
+			e.write(regFlags, true);
+			break;
+		case 0xF6: case 0xF7: // Group 3
+			e.readE(byteOp);
+			if (group<2) // TEST
+				e.write(regFlags, false);
+			else if (group==2) // NOT
+				e.writeE(byteOp);
+			else if (group==3) // NEG
+			{
+				e.writeE(byteOp);
+				e.write(regFlags, false);
+			}
+			else // MUL, IMUL, DIV, IDIV, in AX or eDX:eAX
+			{
+				e.read(byteOp || group<6 ? regEax : regEax|regEdx);
+				e.write(byteOp ? regEax : regEax|regEdx, byteOp || e.opSize);
+				e.write(regFlags, false);
+			}
+			break;
+		case 0xFE: case 0xFF: // Groups 4 and 5
+			if (group<2) // INC, DEC, CF is kept
+			{
+				e.readE(byteOp);
+				e.writeE(byteOp);
+				e.write(regFlags, true);
+			}
+			else if (op==0xFF && group==4) // JMP Ev
+				e.readE(false);
+			else if (op==0xFF && group==6) // PUSH Ev
+			{
+				e.readE(false);
+				e.push();
+			}
+			else
+				e.unknown();
+			break;
+		default:
+			e.unknown();
+	}
+	info.uses = e.uses;
+	info.defs = e.defs;
+}
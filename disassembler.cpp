@@ -1,12 +1,19 @@
 #include "disassembler.h"
 #include <sstream>
 #include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <thread>
 
 #define DEBUG_OUTPUT 0
 
 using namespace std;
 
-Disassembler::Disassembler(PEParser& Parser)
+/// A root whose flows reach more new instructions than this isn't decoded, it's probably not code
+static const size_t ROOT_MAX_INSTRUCTIONS = 64*1024;
+
+Disassembler::Disassembler(PEParser& Parser, std::string cacheDir, unsigned decodeThreads, bool linearSweep,
+						uint32_t SignaturesHash, bool WillAnalyze)
 : parser(Parser),
 virtualImage{Parser.getVirtualImage()},
 
@@ -14,138 +21,130 @@ codeBounds{parser.getCodeSectionsVirtualBounds()},
 imageBase{parser.getImageBase()},
 entryPoint{parser.getEntryPoint()},
 
-code{}, branches{}, blocks{}, refdAddrs{}, refs{},
-startOfEntrySection{0}, endOfEntrySection{0}
+code{codeBounds.empty() ? 0 : codeBounds.back().second}, editedAddrs{}, branches{}, blocks{}, blockDests{}, byteClasses{},
+xrefs{}, xrefRanges{}, cfg{},
+startOfEntrySection{0}, endOfEntrySection{0},
+analyzed{false}, loadedFromCache{false}, cachePath{}, inputHash{0},
+decodedInParallel{decodeThreads>1 && !linearSweep}, decodedLinearly{linearSweep}, signaturesHash{SignaturesHash},
+willAnalyze{WillAnalyze}, noReturnFunctions{}, sweepReport{},
+sweptCode{}, sweptHint{0}
 {
-    // Find the bounds of the section containing the entry point
+	// Find the bounds of the section containing the entry point
+	endOfEntrySection = getCodeSectionEnd(entryPoint);
+	if (endOfEntrySection)
+		startOfEntrySection = parser.getSectionVirtualAddr(parser.getSectionAt(entryPoint));
+	if (startOfEntrySection==0 || endOfEntrySection==0)
+		throw "Invalid entry point or code sections";
+
+	uint32_t endOfCode=0;
 	for (pair<uint32_t,uint32_t>& p : codeBounds)
+		endOfCode = max(endOfCode, p.second);
+	byteClasses.resize(endOfCode);
+
+	// Time to disasm, unless we already did it for this exact file
+	if (!cacheDir.empty())
+		loadedFromCache = loadCache(cacheDir);
+	// The flows stop after the calls to noreturn functions. Finding the internal ones needs the code, and decoding
+	// again with them only removes code after those calls, so no function can return again and this converges.
+	while (!loadedFromCache)
 	{
-		//cout << "SEC START 0x"<<hex<<p.first-virtualImage<<dec<<endl;
-		//cout << "SEC END 0x"<<hex<<p.second-virtualImage<<dec<<endl;
-		//cout << "ENTRY 0x"<<hex<<entryPoint-virtualImage<<dec<<endl;
-		if (entryPoint>=p.first&&entryPoint<p.second)
-		{
-			//cout << "SECTION FOUND\n";
-			startOfEntrySection=p.first;
-			endOfEntrySection=p.second;
+		if (linearSweep)
+			readCodeLinear(entryPoint, decodeThreads>1 ? decodeThreads : max(thread::hardware_concurrency(), 1u));
+		else if (decodeThreads>1)
+			readCodeParallel(entryPoint, decodeThreads);
+		else
+			readCode(entryPoint);
+		code.finalize();
+		if (!findNoReturnFunctions())
 			break;
-		}
+		code.clear();
+		branches.clear();
+		fill(begin(byteClasses), end(byteClasses), byteUndecoded);
 	}
-	if (startOfEntrySection==0 || endOfEntrySection==0)
-		throw "Invalid entry point or code sections";
+	vector<DecodedInstruction>().swap(sweptCode);
+}
 
-	// Time to disasm
-	readCode(entryPoint);
+Disassembler::Disassembler(const Disassembler& Analyzed, PEParser& Parser)
+: parser(Parser),
+virtualImage{Parser.getVirtualImage()},
+
+codeBounds{Analyzed.codeBounds},
+imageBase{Analyzed.imageBase},
+entryPoint{Analyzed.entryPoint},
+
+code{Analyzed.code}, editedAddrs{}, branches{Analyzed.branches}, blocks{Analyzed.blocks}, blockDests{Analyzed.blockDests},
+byteClasses{Analyzed.byteClasses},
+xrefs{Analyzed.xrefs}, xrefRanges{Analyzed.xrefRanges}, cfg{Analyzed.cfg},
+startOfEntrySection{Analyzed.startOfEntrySection}, endOfEntrySection{Analyzed.endOfEntrySection},
+analyzed{Analyzed.analyzed}, loadedFromCache{Analyzed.loadedFromCache}, cachePath{}, inputHash{Analyzed.inputHash},
+decodedInParallel{Analyzed.decodedInParallel}, decodedLinearly{Analyzed.decodedLinearly}, signaturesHash{Analyzed.signaturesHash},
+willAnalyze{Analyzed.willAnalyze}, noReturnFunctions{Analyzed.noReturnFunctions}, sweepReport(Analyzed.sweepReport),
+sweptCode{}, sweptHint{0}
+{
 }
 
 void Disassembler::readCode(uint32_t addr)
 {
-	for (uint32_t ip = addr; ip<endOfEntrySection ;)
+	// Depth-first, like a recursive descent, but with an explicit stack so deep call chains can't overflow.
+	// When we follow a branch, the address after it is pushed, and that flow resumes once the branch is done.
+	// Each flow stops at the end of the code section it started in.
+	vector<uint32_t> worklist;
+	uint32_t sectionEnd = getCodeSectionEnd(addr);
+	auto nextFlow = [&](uint32_t& ip)
+	{
+		while (!worklist.empty())
+		{
+			ip = worklist.back();
+			worklist.pop_back();
+			sectionEnd = getCodeSectionEnd(ip);
+			// If we reach a referenced address that isn't a known branch dest, stop, since it could be data.
+			if (!(getByteClass(ip) & (bytePossibleData|byteData)))
+				return true;
+		}
+		return false;
+	};
+
+	for (uint32_t ip = addr;;)
 	{
-		if (code.find(ip)!=end(code))
+		if (ip>=sectionEnd || getByteClass(ip) & byteInsStart)
 		{
 			#if (DEBUG_OUTPUT)
 			cout << "Reached already processed instruction, returning\n";
 			#endif
-			return;
+			if (!nextFlow(ip))
+				return;
+			continue;
 		}
 
 		uint8_t iSize = readInstruction(ip);
 		if (iSize==0)
-			return;
+		{
+			if (!nextFlow(ip))
+				return;
+			continue;
+		}
 
-		vector<uint8_t> newIns = code[ip];
+		// The instruction is still identical to the virtual image
+		const uint8_t* newIns = virtualImage+ip;
 		#if (DEBUG_OUTPUT)
 		cout << "New instruction at offset 0x"<<hex<<ip<<" : ";
-		for(unsigned i=0; i<newIns.size();++i)
+		for(unsigned i=0; i<iSize;++i)
 			cout<<(int)newIns[i]<<" ";
 		cout<<dec<<"\n";
 		#endif
 
 		ip += iSize;
 
-		// Follow branches
-		int64_t off=0;
-		bool endOfFlow=false; // Set to true if the code flow isn't directly after (e.g. RET or unconditional JMP)
-		if (newIns[0]>=0x70 && newIns[0]<=0x7F) // Branch rel8
-			off = (int8_t)newIns[1];
-		else if (newIns[0]==0xC2 || newIns[0]==0xC3 || newIns[0]==0xCA || newIns[0]==0xCB || newIns[0]==0xCF) // RET
-			endOfFlow=true;
-		else if (newIns[0]==0xE8) // CALL rel32
-			off = (int)(newIns[1] + ((int)newIns[2]<<8) + ((int)newIns[3]<<16) + ((int)newIns[4]<<24));
-		else if (newIns[0]==0xE9) // JMP rel32
-		{
-			off = (int)(newIns[1] + ((int)newIns[2]<<8) + ((int)newIns[3]<<16) + ((int)newIns[4]<<24));
-			endOfFlow=true;
-		}
-		else if (newIns[0]==0xEB)
-		{
-			off = (int8_t)newIns[1];
-			endOfFlow=true;
-		}
-		else if (newIns[0]==0xFF)
-		{
-			if (getReg(newIns[1])==2) // CALL Ev
-			{
-				// We can't follow Ev operands when they refer to the content of a register
-				if (getMod(newIns[1])==0 && getRM(newIns[1])==5) // Absolute address
-					off = (newIns[2] + ((int)newIns[3]<<8) + ((int)newIns[4]<<16) + ((int)newIns[5]<<24))
-					-(int)ip-(int)imageBase; // Make the address absolute, not an offset
-				else
-				{
-					#if (DEBUG_OUTPUT)
-					cout << "Couldn't follow call branch refering to a register\n";
-					#endif
-				}
-			}
-			else if (getReg(newIns[1])==4) // JMP Ev
-			{
-				// We can't follow Ev operands when they refer to the content of a register
-				if (getMod(newIns[1])==0 && getRM(newIns[1])==5) // Absolute address
-				{
-					off = (newIns[2] + ((int)newIns[3]<<8) + ((int)newIns[4]<<16) + ((int)newIns[5]<<24))
-					-(int)ip-(int)imageBase; // Make the address absolute, not an offset
-					endOfFlow=true;
-				}
-				else
-				{
-					#if (DEBUG_OUTPUT)
-					cout << "Couldn't follow jump branch refering to a register\n";
-					#endif
-					endOfFlow=true;
-				}
-			}
-			else if (getReg(newIns[1])==3) // CALLF Mp
-				throw "CALLF Mp not supported";
-			else if (getReg(newIns[1])==5) // JUMPF Mp
-				throw "JMPF Mp not supported";
-		}
-		else if (newIns[0]==0x0F)
-		{
-			// Two opcodes instructions
-			if (newIns[1]>=0x80&&newIns[1]<=0x8F) // JXX Jv
-				off = (int)(newIns[2] + ((int)newIns[3]<<8) + ((int)newIns[4]<<16) + ((int)newIns[5]<<24));
-		}
+		// Follow branches, and find data references
+		uint32_t newIp, ref;
+		bool endOfFlow = getInstructionFlow(newIns, ip, newIp, ref);
+		// If this addr is known code, don't mark it as may-be-data, if it's already data, then nothing to do.
+		if (isAddrInternal(ref))
+			markRef(ref, bytePossibleData);
 
-		// Find data references
-		if (newIns[0]>=0xB8 && newIns[0]<=0xBF) // MOV Zv, Iv
-		{
-			uint32_t ref = (uint32_t)(newIns[1] + ((int)newIns[2]<<8) + ((int)newIns[3]<<16) + ((int)newIns[4]<<24))-(uint32_t)imageBase;
-			if (isAddrInternal(ref))
-			{
-				// If this addr is known code, don't mark it as may-be-data, if it's already data, then nothing to do.
-				if (refdAddrs.find(ref) == end(refdAddrs))
-				{
-					//cout << "FOUND POSSIBLE DATA REF: 0x"<<hex<<(uint32_t)ref-(int)virtualImage<<dec<<endl;
-					refdAddrs.insert(pair<uint32_t,DetectedType>(ref, DetectedType::possibleData));
-				}
-			}
-		}
-
-		if (off!=0)
+		if (newIp!=(uint32_t)-1)
 		{
 			// Check bounds
-			uint32_t newIp = ip+off;
 			//cout <<hex<<"dataSize:0x"<<(int)dataSize<<", newIp:0x"<<(int)(newIp-data)<<dec<<"\n";
 			if (!isAddrInternal(newIp))
 			{
@@ -158,9 +157,12 @@ void Disassembler::readCode(uint32_t addr)
 				#if (DEBUG_OUTPUT)
 				cout << "Found branch to : 0x"<<hex<<(int)(newIp)<<dec<<"\n";
 				#endif
-				//cout << "ADDING CODE REF TO : 0x"<<hex<<(int)(newIp-virtualImage)<<dec<<"\n";
-				refdAddrs.insert(pair<uint32_t,DetectedType>(newIp, DetectedType::code));
-				readCode(newIp);
+				markRef(newIp, byteCodeRef);
+				if (!endOfFlow)
+					worklist.push_back(ip);
+				ip = newIp;
+				sectionEnd = getCodeSectionEnd(ip);
+				continue;
 			}
 		}
 		if (endOfFlow)
@@ -168,28 +170,140 @@ void Disassembler::readCode(uint32_t addr)
 			#if (DEBUG_OUTPUT)
 			cout << "Returning after reaching end of flow\n";
 			#endif
-			return;
+			if (!nextFlow(ip))
+				return;
+			continue;
 		}
 
-		// If we reach a referenced address that isn't a known branch dest, return, since it could be data.
-		auto it = refdAddrs.find(ip);
-		if (it!=end(refdAddrs))
+		// If we reach a referenced address that isn't a known branch dest, stop, since it could be data.
+		if (getByteClass(ip) & (bytePossibleData|byteData))
 		{
-			if (it->second==DetectedType::possibleData || it->second==DetectedType::data)
-			{
-				//#if (DEBUG_OUTPUT)
-				//cout << "Reached possible data, returning\n";
-				//#endif
+			if (!nextFlow(ip))
 				return;
+		}
+	}
+}
+
+bool Disassembler::isValidRoot(uint32_t root, const vector<uint8_t>& lengths)
+{
+	if (getByteClass(root) & (byteInsStart|byteInsBody|byteData))
+		return false;
+	auto getLength = [&](uint32_t ip)
+	{
+		if (!lengths.empty() && lengths[ip])
+			return lengths[ip];
+		const char* error;
+		return decodeInstructionLength(virtualImage+ip, error);
+	};
+
+	// Visits at least everything readCode would decode from the root, so readCode can't fail on it afterwards
+	unordered_set<uint32_t> visited;
+	vector<uint32_t> worklist{root};
+	while (!worklist.empty())
+	{
+		uint32_t ip = worklist.back();
+		worklist.pop_back();
+		uint32_t sectionEnd = getCodeSectionEnd(ip);
+		while (ip<sectionEnd && !(getByteClass(ip) & byteInsStart) && visited.insert(ip).second)
+		{
+			if (visited.size()>ROOT_MAX_INSTRUCTIONS || getByteClass(ip) & byteInsBody)
+				return false;
+			uint8_t size = getLength(ip);
+			if (!size)
+				return false;
+			for (uint32_t i=ip+1; i<ip+size && i<byteClasses.size(); ++i)
+				if (byteClasses[i] & byteInsStart)
+					return false;
+
+			const uint8_t* ins = virtualImage+ip;
+			ip += size;
+			uint32_t dest, ref;
+			bool endOfFlow = getInstructionFlow(ins, ip, dest, ref);
+			if (dest!=(uint32_t)-1 && isAddrInternal(dest))
+				worklist.push_back(dest);
+			if (endOfFlow)
+				break;
+		}
+	}
+	return true;
+}
+
+bool Disassembler::getInstructionFlow(const uint8_t* ins, uint32_t nextIp, uint32_t& branchDest, uint32_t& dataRef)
+{
+	// Follow branches
+	int64_t off=0;
+	bool endOfFlow=false; // Set to true if the code flow isn't directly after (e.g. RET or unconditional JMP)
+	if (ins[0]>=0x70 && ins[0]<=0x7F) // Branch rel8
+		off = (int8_t)ins[1];
+	else if (ins[0]==0xC2 || ins[0]==0xC3 || ins[0]==0xCA || ins[0]==0xCB || ins[0]==0xCF) // RET
+		endOfFlow=true;
+	else if (ins[0]==0xE8) // CALL rel32
+		off = (int)(ins[1] + ((int)ins[2]<<8) + ((int)ins[3]<<16) + ((int)ins[4]<<24));
+	else if (ins[0]==0xE9) // JMP rel32
+	{
+		off = (int)(ins[1] + ((int)ins[2]<<8) + ((int)ins[3]<<16) + ((int)ins[4]<<24));
+		endOfFlow=true;
+	}
+	else if (ins[0]==0xEB)
+	{
+		off = (int8_t)ins[1];
+		endOfFlow=true;
+	}
+	else if (ins[0]==0xFF)
+	{
+		if (getReg(ins[1])==2) // CALL Ev
+		{
+			// We can't follow Ev operands when they refer to the content of a register
+			if (getMod(ins[1])==0 && getRM(ins[1])==5) // Absolute address
+				off = (ins[2] + ((int)ins[3]<<8) + ((int)ins[4]<<16) + ((int)ins[5]<<24))
+				-(int)nextIp-(int)imageBase; // Make the address absolute, not an offset
+			else
+			{
+				#if (DEBUG_OUTPUT)
+				cout << "Couldn't follow call branch refering to a register\n";
+				#endif
+			}
+		}
+		else if (getReg(ins[1])==4) // JMP Ev
+		{
+			// We can't follow Ev operands when they refer to the content of a register
+			if (getMod(ins[1])==0 && getRM(ins[1])==5) // Absolute address
+			{
+				off = (ins[2] + ((int)ins[3]<<8) + ((int)ins[4]<<16) + ((int)ins[5]<<24))
+				-(int)nextIp-(int)imageBase; // Make the address absolute, not an offset
+				endOfFlow=true;
 			}
 			else
 			{
 				#if (DEBUG_OUTPUT)
-				cout << "Reched referenced addr, but it's not data\n";
+				cout << "Couldn't follow jump branch refering to a register\n";
 				#endif
+				endOfFlow=true;
 			}
 		}
+		else if (getReg(ins[1])==3) // CALLF Mp
+			throw "CALLF Mp not supported";
+		else if (getReg(ins[1])==5) // JUMPF Mp
+			throw "JMPF Mp not supported";
+	}
+	else if (ins[0]==0x0F)
+	{
+		// Two opcodes instructions
+		if (ins[1]>=0x80&&ins[1]<=0x8F) // JXX Jv
+			off = (int)(ins[2] + ((int)ins[3]<<8) + ((int)ins[4]<<16) + ((int)ins[5]<<24));
 	}
+
+	// Find data references
+	dataRef = (uint32_t)-1;
+	if (ins[0]>=0xB8 && ins[0]<=0xBF) // MOV Zv, Iv
+		dataRef = (uint32_t)(ins[1] + ((int)ins[2]<<8) + ((int)ins[3]<<16) + ((int)ins[4]<<24))-(uint32_t)imageBase;
+
+	branchDest = off!=0 ? nextIp+off : (uint32_t)-1;
+
+	// Calls to functions that never return end the flow, what follows is often padding or data
+	if ((ins[0]==0xE8 || (ins[0]==0xFF && getReg(ins[1])==2)) && branchDest!=(uint32_t)-1 && isNoReturn(branchDest))
+		endOfFlow=true;
+	return endOfFlow;
 }
 
 uint8_t getMod(uint8_t modrm)
@@ -218,90 +332,43 @@ const char* Disassembler::generateOpcodeErrorInfo(const char* error, uint32_t ad
 	return estr->c_str();
 }
 
-void Disassembler::addOpcodes(std::vector<uint8_t>& instruction, uint32_t addr, unsigned count)
-{
-	for (unsigned i=0;i<count;++i)
-		instruction.push_back(*(virtualImage+addr+i));
-}
-
-const std::map<uint32_t ,std::vector<uint8_t>>& Disassembler::getCode()
+const InstructionStore& Disassembler::getCode()
 {
 	return code;
 }
 
-std::vector<uint8_t> Disassembler::removePrefixes(const std::vector<uint8_t>& instruction)
+uint8_t Disassembler::countPrefixes(const uint8_t* instruction, uint8_t size)
 {
-	std::vector<uint8_t> result = instruction;
-	while(!instruction.empty())
-	{
-		uint8_t op = result[0];
-		if (op==0xF0 || op==0xF2 || op==0xF3 || op==0x66 || op==0x67 || op==0x2E
-			|| op==0x36 || op==0x3E || op==0x26 || op==0x64 || op==0x65)
-			result.erase(begin(result));
-		else
-			break;
-	}
-	return result;
+	uint8_t n=0;
+	while (n<size && isPrefix(instruction[n]))
+		n++;
+	return n;
 }
 
 insType Disassembler::getInstructionType(const std::vector<uint8_t>& instruction)
 {
-	vector<uint8_t> ins = removePrefixes(instruction);
+	return getInstructionType(instruction.data(), instruction.size());
+}
 
-	if (!ins.size())
-		return insType::other;
-	else if (ins[0]==0x90)
-		return insType::nop;
-	else if ((ins[0]>=0x70&&ins[0]<=0x7F) || (ins[0]>=0xE0&&ins[0]<=0xE3) || (ins[0]==0x0F&&ins[1]>=0x80&&ins[1]<=0x8F))
-		return insType::condJump;
-	else if ((ins[0]>=0xE9&&ins[0]<=0xEB) || (ins[0]==0xFF&&(getReg(ins[1])==4||getReg(ins[1])==5)))
-		return insType::uncondJump;
-	else if (ins[0]==0x9A || ins[0]==0xE8 || (ins[0]==0xFF&&(getReg(ins[1])==2||getReg(ins[1])==3)))
-		return insType::call;
-	else if (ins[0]==0xC2 || ins[0]==0xC3 || ins[0]==0xCA || ins[0]==0xCB || ins[0]==0xCF)
-		return insType::ret;
-	else if ((ins[0]>=0xCC&&ins[0]<=0xCE) || ins[0]==0xF1)
-		return insType::intCall;
-	else if (ins[0]==0x9B || (ins[0]>=0xD8&&ins[0]<=0xDF) || (ins[0]==0x0F&&ins[1]==0x77))
-		return insType::x87fpu;
-	else if (ins[0]==0x06 || ins[0]==0x07 || ins[0]==0x0E || ins[0]==0x16 || ins[0]==0x17
-			|| ins[0]==0x1E || ins[0]==0x1F || (ins[0]>=0x50&&ins[0]<=0x62) || ins[0]==0x68 || ins[0]==0x6A
-			|| ins[0]==0x8F || ins[0]==0x9C || ins[0]==0x9D || ins[0]==0xC8 || ins[0]==0xC9
-			|| (ins[0]==0xFF&&getReg(ins[1])==6) ||
-			(ins[0]==0x0F && (ins[1]==0xA0 || ins[1]==0xA1 || ins[1]==0xA8 || ins[1]==0xA9)))
-		return insType::stack;
-	else
+insType Disassembler::getInstructionType(const uint8_t* instruction, uint8_t size)
+{
+	uint8_t nPrefixes = countPrefixes(instruction, size);
+	if (nPrefixes==size)
 		return insType::other;
+	return classifyInstruction(instruction+nPrefixes);
 }
 
 opType Disassembler::getOperandsType(const std::vector<uint8_t>& instruction)
 {
-	vector<uint8_t> ins = removePrefixes(instruction);
+	return getOperandsType(instruction.data(), instruction.size());
+}
 
-	if (!ins.size())
-		return opType::none;
-	uint8_t op=ins[0];
-
-	if (op==0x6 || op==0x7 || op==0xE || op==0x16 || op==0x17 || op==0x1E || op==0x1F
-		|| op==0x27 || op==0x2F || op==0x37 || op==0x3F
-		|| (op>=0x40&&op<=0x61) || (op>=0x6C&&op<=0x6F) || (op>=0x90&&op<=0x99)
-		|| (op>=0x9B&&op<=0x9F) || (op>=0xA4&&op<=0xA7) || (op>=0xAA&&op<=0xAF) || op==0xC3 || op==0xC9
-		|| op==0xCB || op==0xCC || op==0xCE || op==0xCF || op==0xD7 || (op>=0xEC&&op<=0xEF)
-		|| op==0xF4 || op==0xF5 || (op>=0xF8&&op<=0xFD) || op==0xF0 || op==0xF2 || op==0xF3
-		|| op==0x67 || op==0x66 || op==0x2E || op==0x36 || op==0x3E || op==0x26 || op==0x64 || op==0x65)
+opType Disassembler::getOperandsType(const uint8_t* instruction, uint8_t size)
+{
+	uint8_t nPrefixes = countPrefixes(instruction, size);
+	if (nPrefixes==size)
 		return opType::none;
-	else if (op==0x00||op==0x08||op==0x10||op==0x18||op==0x20||op==0x28||op==0x30||op==0x38||op==0x88||op==0x84)
-		return opType::EbGb;
-	else if (op==0x02||op==0x0A||op==0x12||op==0x1A||op==0x22||op==0x2A||op==0x32||op==0x3A||op==0x8A||op==0x86)
-		return opType::GbEb;
-	else if (op==0x01||op==0x09||op==0x11||op==0x19||op==0x21||op==0x29||op==0x31||op==0x39||op==0x85||op==0x89)
-		return opType::EvGv;
-	else if (op==0x03||op==0x0B||op==0x13||op==0x1B||op==0x23||op==0x2B||op==0x33||op==0x3B||op==0x87||op==0x8B)
-		return opType::GvEv;
-	else if (op==0x8D)
-		return opType::GvM;
-	else
-		return opType::other;
+	return classifyOperands(instruction+nPrefixes);
 }
 
 bool Disassembler::isPrefix(uint8_t op)
@@ -310,124 +377,167 @@ bool Disassembler::isPrefix(uint8_t op)
 			|| op==0x36 || op==0x3E || op==0x26 || op==0x64 || op==0x65);
 }
 
-uint32_t Disassembler::getBranchDest(uint32_t addr, std::vector<uint8_t>& instruction)
+Branch Disassembler::getBranch(InstructionRef ins)
 {
-	std::vector<uint8_t> ins = removePrefixes(instruction);
-	uint8_t insSize=ins.size();
-	if (!insSize)
-		throw "Empty instruction";
-	else if (instruction[0]==0x66||instruction[0]==0x67)
+	insType type = ins.info->type;
+	// 16-bit branches can't be followed, like the ones through registers
+	uint32_t dest = ins.info->prefixes & (prefixOpSize|prefixAdSize) ? (uint32_t)-1 : getBranchDest(ins);
+	if (type==insType::condJump)
+		return {dest==(uint32_t)-1 ? BranchType::regCondJump : BranchType::condJump, ins.addr, dest};
+	else if (type==insType::uncondJump)
+		return {dest==(uint32_t)-1 ? BranchType::regJump : BranchType::jump, ins.addr, dest};
+	else
+		return {dest==(uint32_t)-1 ? BranchType::regCall : BranchType::call, ins.addr, dest};
+}
+
+uint32_t Disassembler::getBranchDest(InstructionRef ins)
+{
+	const InstructionInfo& info = *ins.info;
+	if (info.prefixes & (prefixOpSize|prefixAdSize))
 		throw "Size-override prefixes not supported";
-	uint8_t op = ins[0];
+	if (info.type!=insType::condJump && info.type!=insType::uncondJump && info.type!=insType::call)
+		throw "Instruction is not a supported branch instruction";
 
-	// Relative Jbs
-	if ((op>=0x70&&op<=0x7F) || (op>=0xE0&&op<=0xE3) || op==0xEB)
-	{
-		return addr + insSize + (int8_t)ins[1];
-	}
-	// Absolute addresses Ap
-	else if (op==0xEA || op==0x9A)
-	{
-		throw "Absolute adresses resolution not implemented (not tested, at least)";
-		return addr+(ins[1] + ((int)ins[2]<<8) + ((int)ins[3]<<16) + ((int)ins[4]<<24))-(int)imageBase;
-		cout << "RESULT:0x"<<hex<<addr<<dec<<"\n";
-	}
-	// Relative Jv non-extended
-	else if (op==0xE9 || op==0xE8)
-	{
-		return addr + insSize + (int32_t)((uint32_t)ins[1] + ((uint32_t)(ins[2])<<8)
-					+ (((uint32_t)ins[3])<<16) + (((uint32_t)ins[4])<<24));
-	}
-	// Relative Jv extended
-	else if (op==0x0F&&ins[1]>=0x80&&ins[1]<=0x8F)
-	{
-		return addr + insSize + (int32_t)((uint32_t)ins[2] + ((uint32_t)(ins[3])<<8)
-					+ (((uint32_t)ins[4])<<16) + (((uint32_t)ins[5])<<24));
-	}
 	// Ev
-	else if (op==0xFF&&(getReg(ins[1])==2 || getReg(ins[1])==4))
+	if (ins.opcode()[0]==0xFF)
 	{
-		uint8_t op2=ins[1];
-		if (getMod(op2)==0 && getRM(op2)==5) // Absolute address
+		if (getMod(ins.modrm())==0 && getRM(ins.modrm())==5) // Absolute address
 		{
-			return ((uint32_t)ins[2] + ((uint32_t)(ins[3])<<8)
-					+ (((uint32_t)ins[4])<<16) + (((uint32_t)ins[5])<<24)) - (uint32_t)imageBase;
+			const uint8_t* disp = ins.bytes+info.dispOffset;
+			return ((uint32_t)disp[0] + ((uint32_t)(disp[1])<<8)
+					+ (((uint32_t)disp[2])<<16) + (((uint32_t)disp[3])<<24)) - (uint32_t)imageBase;
 		}
 		else
 			return (uint32_t)-1;
 	}
-	// Mp
-	else if (op==0xFF&&(getReg(ins[1])==3 || getReg(ins[1])==5))
-	{
-		throw "Mp address resolution not implemented";
-	}
+
+	// Relative Jb or Jv
+	const uint8_t* imm = ins.bytes+info.immOffset;
+	if (info.immSize==1)
+		return ins.addr + ins.size + (int8_t)imm[0];
+	else if (info.immSize==4)
+		return ins.addr + ins.size + (int32_t)((uint32_t)imm[0] + ((uint32_t)(imm[1])<<8)
+					+ (((uint32_t)imm[2])<<16) + (((uint32_t)imm[3])<<24));
 	else
 		throw "Instruction is not a supported branch instruction";
-
-	// We should never reach this point.
-	return 0;
 }
 
 void Disassembler::editInstruction(uint32_t addr,std::vector<uint8_t> ins)
 {
-	code[addr]=ins;
+	editInstruction(addr, ins.data(), ins.size());
+}
+
+void Disassembler::editInstruction(uint32_t addr, const uint8_t* ins, uint8_t size)
+{
+	InstructionInfo info;
+	const char* error;
+	if (decodeInstruction(ins, info, error) != size)
+		throw "Edited instruction is invalid";
+	code.insert(addr, ins, size, info);
+	editedAddrs.push_back(addr);
+}
+
+void Disassembler::swapInstructions(uint32_t addr)
+{
+	size_t index = code.find(addr);
+	if (index==InstructionStore::npos || index+1>=code.size() || code.getAddr(index+1)!=addr+code.getSize(index))
+		throw "Can't swap instructions that aren't adjacent";
+	uint32_t oldSecond = code.getAddr(index+1);
+	code.swapWithNext(index);
+	uint32_t newSecond = code.getAddr(index+1);
+	editedAddrs.push_back(addr);
+	editedAddrs.push_back(newSecond);
+
+	// The second instruction now starts where the first one ended
+	byteClasses[oldSecond] = (byteClasses[oldSecond] & ~byteInsStart) | byteInsBody;
+	byteClasses[newSecond] = (byteClasses[newSecond] & ~byteInsBody) | byteInsStart;
+}
+
+uint8_t Disassembler::getByteClass(uint32_t addr)
+{
+	return addr<byteClasses.size() ? byteClasses[addr] : (uint8_t)byteUndecoded;
+}
+
+void Disassembler::markInstruction(uint32_t addr, uint8_t size)
+{
+	byteClasses[addr] |= byteInsStart;
+	for (uint32_t i=addr+1; i<addr+size && i<byteClasses.size(); ++i)
+		byteClasses[i] |= byteInsBody;
+}
+
+void Disassembler::markRef(uint32_t addr, ByteClass type)
+{
+	// The first reference found decides if it's code or data
+	if (!(byteClasses[addr] & (byteCodeRef|bytePossibleData|byteData)))
+		byteClasses[addr] |= type;
+}
+
+uint32_t Disassembler::getCodeSectionEnd(uint32_t addr)
+{
+	return parser.getCodeSectionEnd(addr);
 }
 
 bool Disassembler::isAddrInternal(uint32_t addr)
 {
-	for (pair<uint32_t,uint32_t>& p : codeBounds)
-		if (addr>=p.first && addr<p.second)
-			return true;
-	return false;
+	return parser.getCodeSectionEnd(addr)!=0;
 }
 
-vector<Branch> Disassembler::getXRefs(uint32_t addr)
+pair<const uint32_t*, const uint32_t*> Disassembler::getXRefs(uint32_t addr)
 {
-	vector<Branch> refs;
-	for (Branch& b : branches)
-	{
-		if (b.dest == addr)
-			refs.push_back(b);
-	}
-	return refs;
+	auto it = xrefRanges.find(addr);
+	if (it == end(xrefRanges))
+		return {nullptr, nullptr};
+	return {xrefs.data()+it->second.first, xrefs.data()+it->second.second};
 }
 
 bool Disassembler::hasXRefs(uint32_t addr)
 {
-	// The keys of refs are the destinations, the values are the sources
-	return refs.find(addr) != end(refs);
+	return xrefRanges.find(addr) != end(xrefRanges);
 }
 
-Block* Disassembler::getBlockOfAddr(uint32_t addr)
+const vector<Branch>& Disassembler::getBranches()
 {
-	Block* result=nullptr;
+	return branches;
+}
 
-	for (Block& b : blocks)
-	{
-		if (addr>=b.startAddr && addr<b.endAddr)
-		{
-			result=&b;
-			break;
-		}
-	}
-	return result;
+const vector<Block>& Disassembler::getBlocks()
+{
+	return blocks;
+}
+
+pair<const uint32_t*, const uint32_t*> Disassembler::getBlockDests(const Block& block)
+{
+	return {blockDests.data()+block.destsStart, blockDests.data()+block.destsEnd};
 }
 
-bool Disassembler::isAddrInBlock(const uint32_t addr)
+const ControlFlowGraph& Disassembler::getCFG()
+{
+	return cfg;
+}
+
+Block* Disassembler::getBlockOfAddr(uint32_t addr)
 {
-	// Profiling said we spent ~95% of the time in there during analysis.
-	// Reverse iterators turned out to be somewhat faster for the analysis we did
-	for (auto s = blocks.rbegin(), e=blocks.rend(); s!=e; ++s)
-		if (addr<s->endAddr && addr>=s->startAddr)
-			return true;
-	return false;
+	// The blocks are sorted and disjoint, only the last one starting before addr can contain it
+	auto it = upper_bound(begin(blocks), end(blocks), addr,
+						[](uint32_t addr, const Block& b){return addr < b.startAddr;});
+	if (it == begin(blocks))
+		return nullptr;
+	--it;
+	if (addr>=it->startAddr && addr<it->endAddr)
+		return &*it;
+	return nullptr;
 }
 
 void Disassembler::updateVirtualImageFromInstructions()
 {
-	for (const pair<uint32_t ,std::vector<uint8_t>>& ins : code)
+	// The other instructions are still identical to the virtual image, no need to touch their pages
+	for (uint32_t addr : editedAddrs)
 	{
-		for (uint8_t i=0; i<ins.second.size(); ++i)
-			*(virtualImage+ins.first+i)=ins.second[i];
+		size_t index = code.find(addr);
+		if (index==InstructionStore::npos) // Swapped with an instruction of another size since
+			continue;
+		memcpy(virtualImage+addr, code.getBytes(index), code.getSize(index));
 	}
+	editedAddrs.clear();
+	code.finalize();
 }
@@ -2,9 +2,14 @@
 #define DECOMPILER_H
 
 #include "peparser.h"
+#include "instructionstore.h"
+#include "decoder.h"
+#include "signaturescanner.h"
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -29,32 +34,16 @@ enum DetectedType
 	unknown			///< This could be anything, if it follows non-branching code, we assume it's code.
 };
 
-/// Type of an instruction
-enum class insType
+/// What the disassembler knows about a byte of the code sections, a combination of flags.
+/// Only one of the reference flags (code ref, possible data, data) is set, the first reference found wins.
+enum ByteClass : uint8_t
 {
-	other,			// Instructions that don't have their own code
-	nop,			// Instructions that do nothing, not necessarily 0x90 (NOP)
-	condJump,		// Conditional JMPs
-	uncondJump,		// Unconditional JMPs
-	call,			// CALL instructions
-	ret,			// RET instructions
-	intCall,		// Calls to interrupt procedures
-	x87fpu,			// x87 instructions for the FPU
-	stack			// Stack instructions (POPs/PUSHs)
-};
-
-/// Type of the operands of an instruction
-enum class opType
-{
-	other,
-	none,
-	GvEv,
-	EvGv,
-	GbEb,
-	EbGb,
-	GvM,
-	Ib,
-	Iv
+	byteUndecoded		= 0,
+	byteInsStart		= 1<<0,		///< First byte of a decoded instruction
+	byteInsBody			= 1<<1,		///< Other bytes of a decoded instruction
+	byteCodeRef			= 1<<2,		///< Destination of a branch
+	bytePossibleData	= 1<<3,		///< Referenced by an instruction, could be data
+	byteData			= 1<<4		///< Known to be data
 };
 
 enum class BranchType
@@ -74,25 +63,68 @@ struct Branch
 	uint32_t dest;		// Destination of the branch, or -1 if unresolved
 };
 
-/// State of a register at the end of a block of code.
-struct BlockRegister
+/// Values of the registers known at a point of the code, for the constant propagation of analyze()
+struct RegisterValues
 {
-	int32_t value=0;				///< Only makes sense if isValueKnown is true
-	bool modified=false;			///< True if the value is modified by the function
-	bool isValueKnown=false;		///< True if you can guarantee that the register always has this value
-	bool inheritedValue=false;		///< True is the value was inherited from a previous block. Implied modified=false.
+	uint8_t known;			///< Mask of the registers whose value is known, in encoding order like RegisterMask
+	uint32_t values[8];		///< EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI. Only meaningful if the bit is in known
 };
 
 /// Block of code. Jumps can only land at the start of a block, and may only start at the end of a block.
+/// Plain data, the destinations are stored with those of the other blocks (see Disassembler::getBlockDests)
 struct Block
 {
 	uint32_t startAddr;					///< Address of the first instruction
 	uint32_t endAddr;					///< Just after the last instruction. NOT included in the block
-	//BlockRegister registers[8]; 		///< EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI
-	//bool analyzed=false;				///< True when the register analysis is finished for this block
-	std::vector<uint32_t>& destAddrs;	///< Addresses this block jumps to at the end (not called blocks)
+	uint32_t destsStart;				///< Range of the addresses this block jumps to at the end (not called blocks)
+	uint32_t destsEnd;
+	uint16_t liveIn;					///< RegisterMask of the registers and flags live at the start of the block
+	uint16_t liveOut;					///< RegisterMask of the registers and flags live at the end of the block
+};
+
+/// Instruction decoded ahead of time by a worker, not in the InstructionStore yet
+struct DecodedInstruction
+{
+	uint32_t addr;
+	uint8_t size;
+	InstructionInfo info;
+};
 
-	Block():startAddr{},endAddr{},destAddrs(*(new std::vector<uint32_t>)){}
+/// How the linear sweep of the code sections compares with the recursive descent
+struct SweepReport
+{
+	unsigned nThreads;
+	uint64_t sweptBytes;		///< Size of the code sections
+	uint32_t nSwept;			///< Instructions found by the linear sweep
+	uint32_t nResynced;			///< Instructions decoded again to resynchronise the chunks boundaries
+	uint32_t nReachable;		///< Instructions found by the recursive descent
+	uint32_t nAgreed;			///< Reachable instructions the sweep had found too, reused instead of decoded again
+	uint32_t nPruned;			///< Swept instructions that aren't reachable, dropped
+	uint64_t reachableBytes;
+	uint64_t agreedBytes;
+	double sweepTime;			///< Seconds
+	double descentTime;			///< Seconds, of all the passes decoding again after finding noreturn functions
+};
+
+/// What the signature scan added to the instructions found from the entry point
+struct SignatureReport
+{
+	uint32_t nHits;				///< Positions matching a signature, or following padding
+	uint32_t nRoots;			///< Hits that were decoded as new roots
+	uint32_t nInstructions;		///< Instructions decoded from the new roots
+	double scanTime;			///< Seconds, to find the hits
+	double decodeTime;			///< Seconds, to check and decode the hits
+};
+
+/// Control flow graph of the blocks, in compressed sparse row form.
+/// The successors of the block i are succs[succOffsets[i]] to succs[succOffsets[i+1]-1], same for the predecessors.
+/// Calls aren't edges, a block containing a call flows to the next instruction.
+struct ControlFlowGraph
+{
+	std::vector<uint32_t> succOffsets;	///< One per block, plus one for the end
+	std::vector<uint32_t> succs;		///< Indexes in the blocks vector
+	std::vector<uint32_t> predOffsets;	///< One per block, plus one for the end
+	std::vector<uint32_t> preds;		///< Indexes in the blocks vector
 };
 
 uint8_t getMod(uint8_t modrm); ///< Gets the MOD part of the ModRM
@@ -102,42 +134,135 @@ uint8_t getRM(uint8_t modrm); ///< Gets the R/M part of the ModRM
 class Disassembler
 {
 	public:
-		Disassembler(PEParser& Parser);
-		void analyze(); ///< Build the branches and Blocks vectors
-		const std::map<uint32_t ,std::vector<uint8_t>>& getCode();
+		/// @param cacheDir If not empty, the instructions are loaded from the analysis cache of this file if there is one
+		/// @param decodeThreads Number of threads decoding the instructions, 1 to decode sequentially
+		/// @param linearSweep Sweep the code sections in parallel first, and keep what the recursive descent reaches of it
+		/// @param SignaturesHash hashSignatures of what decodeSignatures will be called with, so that only the cache
+		/// of a run that decoded the same signatures is used
+		/// @param WillAnalyze analyze() will be called. It decodes the targets of the branches it resolves,
+		/// so only the cache of a run that analyzed too is used.
+		Disassembler(PEParser& Parser, std::string cacheDir="", unsigned decodeThreads=1, bool linearSweep=false,
+					uint32_t SignaturesHash=0, bool WillAnalyze=false);
+		/// Copies the instructions and the analysis of another disassembler, without decoding anything.
+		/// @param Parser Parser of a copy of the same file, the copy's virtual image is used from now on
+		Disassembler(const Disassembler& Analyzed, PEParser& Parser);
+		void analyze(); ///< Sort the branches, build the Blocks vector, the control flow graph and the liveness
+		const std::vector<Branch>& getBranches();
+		const std::vector<Block>& getBlocks();
+		/// Addresses the block jumps to at the end, not counting the branch ending it (see getCFG)
+		std::pair<const uint32_t*, const uint32_t*> getBlockDests(const Block& block);
+		const ControlFlowGraph& getCFG();
+		/// Finds the branches landing at this address. O(1)
+		/// @return Range of indexes in the branches vector
+		std::pair<const uint32_t*, const uint32_t*> getXRefs(uint32_t addr);
+		const InstructionStore& getCode();
+		/// Replaces the instruction at addr, or adds a new one
+		void editInstruction(uint32_t addr, const uint8_t* ins, uint8_t size);
 		void editInstruction(uint32_t addr,std::vector<uint8_t> ins);
+		/// Swaps the instruction at addr with the one right after it, which then starts at addr.
+		/// The blocks and branches aren't updated, so neither instruction may be a branch or a branch destination.
+		void swapInstructions(uint32_t addr);
+		static insType getInstructionType(const uint8_t* instruction, uint8_t size);
 		static insType getInstructionType(const std::vector<uint8_t>& instruction);
+		static opType getOperandsType(const uint8_t* instruction, uint8_t size);
 		static opType getOperandsType(const std::vector<uint8_t>& instruction);
-		/// Returns the instructions without any prefixes
-		static std::vector<uint8_t> removePrefixes(const std::vector<uint8_t>& instruction);
+		/// Returns the number of prefixes at the start of the instruction
+		static uint8_t countPrefixes(const uint8_t* instruction, uint8_t size);
 		/// Returns the destination of the branch instruction
-		/// @param addr Offset of the instruction
 		/// @param instruction Must be a branching instruction
 		/// @return Destination address (offset relative to virtual image), or -1 if the branch depends on a register
-		uint32_t getBranchDest(uint32_t addr, std::vector<uint8_t>& instruction);
-		/// Adds count opcodes to the instruction
-		void addOpcodes(std::vector<uint8_t>& instruction, uint32_t addr, unsigned count);
+		uint32_t getBranchDest(InstructionRef instruction);
+		/// Branch record of a jump or call instruction. Unresolved if it depends on a register or has a 16-bit operand.
+		Branch getBranch(InstructionRef instruction);
 		static bool isPrefix(uint8_t op);
-		bool isAddrInternal(uint32_t addr); ///< Is the address inside the data buffer or not
-		void updateVirtualImageFromInstructions(); ///< Applies the changes to the intructions to the virtual image
+		bool isAddrInternal(uint32_t addr); ///< Is the address inside a code section. O(1), asks the parser's page table
+		uint32_t getCodeSectionEnd(uint32_t addr); ///< End of the code section containing addr, or 0 if there is none. O(1)
+		/// Does a call to dest never return. dest is an internal function or an IAT slot.
+		/// Knows the noreturn imports, their thunks (JMP [slot]), and the functions found by findNoReturnFunctions.
+		bool isNoReturn(uint32_t dest);
+		uint8_t getByteClass(uint32_t addr); ///< ByteClass flags of the byte at addr. O(1)
+		void updateVirtualImageFromInstructions(); ///< Applies the edited intructions to the virtual image
+		bool isAnalyzed(); ///< True if analyze() was run, or its results were loaded from the cache
+		bool isFromCache(); ///< True if the instructions were loaded from the analysis cache instead of decoded
+		/// Searches the code sections for function signatures, and decodes the hits no branch reaches as new roots.
+		/// A hit is only used if every instruction reachable from it is valid and doesn't overlap the code already found.
+		/// @param paddingBoundaries Also try the aligned addresses following INT3 or NOP padding
+		SignatureReport decodeSignatures(const std::vector<Signature>& signatures, bool paddingBoundaries);
+		/// Comparison of the linear sweep and the recursive descent, only filled when decoding with linearSweep
+		const SweepReport& getSweepReport();
+		/// Saves the instructions and the analysis in the cache directory given to the constructor.
+		/// Must be called before any instruction is edited. Throws a const char* on failure.
+		void saveCache();
 	protected:
+		/// Loads the instructions and the analysis from the cache file of the input in cacheDir
+		/// @return false if there is no valid cache file for this input
+		bool loadCache(std::string cacheDir);
+		uint32_t getDecodeFlags(); ///< Cache flags of the options the instructions were decoded with
 		/// Adds the given instruction to the internal code data structure
 		/// Throws a const char* if an invalid opcode is encountered
 		/// @param addr Address of the instruction to read in the data buffer
-		/// @return number of bytes read for this instruction
+		/// @return number of bytes read for this instruction, or 0 if relocations show it's data
 		uint8_t readInstruction(uint32_t addr);
-		/// Fills the internal code data structure starting from addr in the data buffer
+		/// True if a relocated field overlaps the instruction anywhere else than exactly on its 32-bit
+		/// displacement or immediate. Code is never relocated, so the instruction is really data.
+		bool hasMisplacedRelocations(uint32_t addr, uint8_t size, const InstructionInfo& info);
+		/// Fills the internal code data structure starting from addr in the data buffer.
+		/// Follows the branches into all the code sections, not only the one containing addr.
 		void readCode(uint32_t addr);
+		/// Same as readCode, but the branch targets are decoded by nThreads workers stealing work from each other.
+		/// Each code section has a worker owning it, the targets found in other sections are handed to their owner.
+		/// Where the flows stop on possible data depends on the order the targets are decoded in,
+		/// so the instructions found can be slightly different than with readCode.
+		/// A flow stops at an instruction overlapping one already claimed by another flow.
+		void readCodeParallel(uint32_t addr, unsigned nThreads);
+		/// Splits the code sections in chunks decoded linearly by nThreads workers, and resynchronises the chunks.
+		/// The recursive descent from addr then keeps the swept instructions it reaches, and only decodes those
+		/// the sweep missed. The result is the same as readCode's.
+		/// The sweep is only done once, the instructions stay in sweptCode until they're freed by the caller.
+		void readCodeLinear(uint32_t addr, unsigned nThreads);
+		/// Fills sweptCode with the instructions of the linear sweep, for readCodeLinear
+		void sweepCode(unsigned nThreads);
+		/// True if readCode can decode from root : every instruction reachable from it is valid,
+		/// doesn't overlap the code already found, and there aren't too many of them.
+		/// @param lengths Candidate lengths of the length kernel, indexed by address, or empty to use the decoder
+		bool isValidRoot(uint32_t root, const std::vector<uint8_t>& lengths);
+		/// Finds where the code flow goes after an instruction, the way readCode follows it
+		/// @param nextIp Address just after the instruction
+		/// @param branchDest Set to the destination of the branch, or -1 if there is none or it can't be followed
+		/// @param dataRef Set to the address the instruction may reference as data, or -1
+		/// @return True if the flow doesn't continue after the instruction (e.g. RET or unconditional JMP)
+		bool getInstructionFlow(const uint8_t* ins, uint32_t nextIp, uint32_t& branchDest, uint32_t& dataRef);
+		/// Adds the called functions that can't return to noReturnFunctions, until there are no more
+		/// @return True if any was added, the code must then be decoded again to stop after the calls to them
+		bool findNoReturnFunctions();
+		/// Follows the decoded code of a function, true if it can reach a RET or somewhere we can't follow
+		bool canReturn(uint32_t function);
+		void markInstruction(uint32_t addr, uint8_t size); ///< Marks the bytes of a decoded instruction
+		/// Marks a referenced address as code or (possible) data, unless it was already referenced
+		void markRef(uint32_t addr, ByteClass type);
 		/// Append info about the last opcode found
 		const char* generateOpcodeErrorInfo(const char* error, uint32_t addr);
-		/// Reads blocks of code (recursively) and add them to blocks
-		/// Doesn't analyze the registers of the block.
-		Block readBlocks(uint32_t addr);
-		void analyzeBlock(Block& block); ///< Analyzes the registers part of the block
-		std::vector<Branch> getXRefs(uint32_t addr); ///< Finds the branches landing at this address
-		bool hasXRefs(uint32_t addr); ///< Are there branches landing at this address.
-		Block* getBlockOfAddr(uint32_t addr); ///< Gets the block containing this address or nullptr if not found
-		bool isAddrInBlock(const uint32_t addr);
+		/// Cuts the decoded code in blocks at the leaders (branch destinations, fallthroughs of conditional jumps and
+		/// entry point), in one pass over the instructions. The blocks are sorted and disjoint. O(n log n)
+		/// Doesn't analyze the registers of the blocks.
+		void buildBlocks();
+		/// Propagates the constant register values over the CFG, and resolves the calls and jumps through registers
+		/// or through read-only memory it can. The new targets are decoded, and the blocks rebuilt.
+		/// Then only the blocks that are new, or lead to new ones, are propagated again, until nothing is resolved.
+		void resolveIndirectBranches();
+		/// Effect of an instruction on the known register values. Calls keep EBX, ESI, EDI and EBP.
+		void emulateInstruction(InstructionRef instruction, RegisterValues& regs);
+		/// Reads a dword that can't change at runtime : loaded from the file, in a read-only section and not an import
+		/// @param va Absolute address, with the image base
+		bool readConstant(uint32_t va, uint32_t& value);
+		bool hasXRefs(uint32_t addr); ///< Are there branches landing at this address. O(1)
+		void buildXRefs(); ///< Indexes the branches by destination
+		void buildCFG(); ///< Builds the control flow graph from the blocks and the branches
+		/// Finds the registers and flags live at the start and at the end of each block, needs the CFG.
+		/// Worklist over the blocks with the masks of the instructions, linear in practice.
+		/// Leaving the CFG (returns, jumps we can't follow) makes everything live, and so do calls.
+		void computeLiveness();
+		Block* getBlockOfAddr(uint32_t addr); ///< Gets the block containing this address or nullptr if not found. O(log n)
 	private:
 		/// Virtual address corresponding to the start of the data block
 		PEParser& parser;
@@ -145,15 +270,34 @@ class Disassembler
 		std::vector<std::pair<uint32_t,uint32_t>> codeBounds; ///< Bounds of the executable sections
 		uint32_t imageBase;
 		uint32_t entryPoint; ///< Entry point, offset inside the virtual image
-		std::map<uint32_t ,std::vector<uint8_t>> code; ///< All the disassembled instructions and their addresses
+		InstructionStore code; ///< All the disassembled instructions and their addresses
+		std::vector<uint32_t> editedAddrs; ///< Instructions edited since the last updateVirtualImageFromInstructions
+		/// Recorded by the decoders as they find the branches, sorted by source by analyze()
 		std::vector<Branch> branches;
-		std::vector<Block> blocks;
-		/// Addresses (offsets) referenced by instructions. Could be data or code used as a function pointer.
-		/// Or could just be a constant that happens to be a valid address (offset)
-		std::map<uint32_t, DetectedType> refdAddrs;
-		std::multimap<uint32_t, uint32_t> refs; ///< The key is the destination, the values are the sources
+		std::vector<Block> blocks; ///< Sorted by address
+		std::vector<uint32_t> blockDests; ///< Destinations of all the blocks, each block has a range
+		/// ByteClass of each byte of the code sections, indexed by address.
+		/// The references could be data or code used as a function pointer,
+		/// or could just be a constant that happens to be a valid address (offset)
+		std::vector<uint8_t> byteClasses;
+		std::vector<uint32_t> xrefs; ///< Indexes of the resolved branches, grouped by destination, the groups in no particular order
+		/// Destination of branches to the range of xrefs landing there
+		std::unordered_map<uint32_t, std::pair<uint32_t,uint32_t>> xrefRanges;
+		ControlFlowGraph cfg;
 		uint32_t startOfEntrySection; ///< Start of the section containing the entry point.
 		uint32_t endOfEntrySection; ///< End of the section containing the entry point.
+		bool analyzed; ///< True when branches, blocks, xrefs and the CFG are up to date
+		bool loadedFromCache;
+		std::string cachePath; ///< Cache file of this input, empty if the cache isn't used
+		uint64_t inputHash; ///< Hash of the content of the input file, used as the cache key
+		bool decodedInParallel; ///< The cache is only used by a run decoding the same way
+		bool decodedLinearly;
+		uint32_t signaturesHash; ///< hashSignatures of the signatures decoded, or expected in the cache before it's loaded
+		bool willAnalyze; ///< The cache is only used by a run that analyzes too
+		std::unordered_set<uint32_t> noReturnFunctions; ///< Internal functions that never return
+		SweepReport sweepReport;
+		std::vector<DecodedInstruction> sweptCode; ///< Sorted by address, reused by readInstruction while the constructor decodes
+		size_t sweptHint; ///< Index in sweptCode of the instruction readInstruction will probably ask for next
 };
 
 #endif // DECOMPILER_H
@@ -1,6 +1,7 @@
 #include "disassembler.h"
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 
@@ -34,203 +35,153 @@ void Disassembler::analyze()
 
 	/// IDA can resolve some register-dependant jumps.
 	/// Often we have X blocks higher : mov reg, ds:0xXXXXXX, then later call reg
-	/// We should store what registers are modified by what blocks, and to what values if we know.
-	/// But most of the time, those register-dependant jumps are used to call imports, not internal addresses.
+	/// Most of the time, those register-dependant jumps are used to call imports, not internal addresses.
 
-	// Build initial branches vector and refs map
-	branches.clear();
-	for (std::pair<uint32_t ,std::vector<uint8_t>> elem : code)
-	{
-		insType iType = getInstructionType(elem.second);
-		if (iType==insType::condJump)
-		{
-			uint32_t dest = getBranchDest(elem.first, elem.second);
-			if (dest==(uint32_t)-1)
-				branches.push_back({BranchType::regCondJump, elem.first, dest});
-			else
-			{
-				branches.push_back({BranchType::condJump, elem.first, dest});
-				refs.insert({dest,elem.first}); // The key is the destination, values are sources
-			}
-		}
-		else if (iType==insType::uncondJump)
-		{
-			uint32_t dest = getBranchDest(elem.first, elem.second);
-			if (dest==(uint32_t)-1)
-				branches.push_back({BranchType::regJump, elem.first, dest});
-			else
-			{
-				branches.push_back({BranchType::jump, elem.first, dest});
-				refs.insert({dest,elem.first}); // The key is the destination, values are sources
-			}
-		}
-		else if (iType==insType::call)
-		{
-			uint32_t dest = getBranchDest(elem.first, elem.second);
-			if (dest==(uint32_t)-1)
-				branches.push_back({BranchType::regCall, elem.first, dest});
-			else
-			{
-				branches.push_back({BranchType::call, elem.first, dest});
-				refs.insert({dest,elem.first}); // The key is the destination, values are sources
-			}
-		}
-	}
+	// The branches were recorded while decoding, in the order the flows reached them
+	auto bySource = [](const Branch& a, const Branch& b){return a.source < b.source;};
+	if (!is_sorted(begin(branches), end(branches), bySource))
+		sort(begin(branches), end(branches), bySource);
+	buildXRefs();
 
 	// Build initial blocks vector (jump flow analysis)
-	blocks.clear();
-	readBlocks(entryPoint);
-	for (Branch& b : branches)
-		if (b.type==BranchType::call && isAddrInternal(b.dest))
-			readBlocks(b.dest);
-
-	/// TODO: Analyze blocks to find what registers are modified and with what
-	/// Use register analysis at the same time to resolve some register dependant calls
-	/// If we can resolve a register-dependant branch, add it to a temp vector of resolved branches and
-	/// finish analysing the current block.
-	/// Then disassemble the code pointed by the newly resolved jumps (using readCode())
-
-	/// Read blocks of the code pointed by the newly resolved jumps
-	/// If the new jumps lands in the middle of another block, readBlock() will split the block in half.
-	/// If we need to split a block in half, we have to cancel the previous analysis done on the block.
-
-	/** BLOCK ANALYSIS
-	If the block was already analyzed, return;
-	Work on a temporary BlockRegister[8] array, not directly on the block's array.
-	Read the instructions, if a register is given a value from read-only memory, fetch that value
-	If a register is modified, keep up with the modifications
-	If it is impossible to guarantee that the register will always have this value, mark it as unknown
-	If a CALL is encountered, do not follow it, and assume that EAX, ECX and EDX have been modified and are unknown.
-	If an instruction is unknown (can't determine the modification), assume that all registers are modified and unknown.
-	Use a function BlockRegister[8] emulate(BlockRegister[8], vector<uint8_t>) that emulates the effect of one
-	instruction on the registers and give the result. If an instruction tries to read from another section that isn't
-	a read-only section, consider that the value read is unknown.
-	When reaching the end of the block :
-	If we have inherited registers, but we know that they are modified, override the inheritance with what we know.
-	if the next block isn't analyzed yet, don't analyze it. Set the analyzed flag for our block.
-	If we know the value of a register and if the next block knowns the value of the register by inheritance
-	and the value is different, mark the value as unknown by inheritance, if the value is the same, do nothing.
-	If in the next block the value is unknown, unmodified, and not inherited yet, set the value with ours.
-	**/
+	buildBlocks();
+	buildCFG();
+	// The register values known at each block resolve some of the branches through registers,
+	// the code they reach is decoded and the blocks cut again
+	resolveIndirectBranches();
+	computeLiveness();
+	analyzed=true;
 }
 
-Block Disassembler::readBlocks(uint32_t addr)
+void Disassembler::buildXRefs()
 {
-	//cout << "Reading 0x"<<hex<<(int)addr-(int)data<<dec<<" ";
-	vector<uint8_t> firstIns=code[addr];
-	uint8_t insSize = firstIns.size();
-	insType iType = getInstructionType(firstIns);
-
-	if (insSize==0)
-		throw "Instruction with null size while reading blocks (start)";
-
-	// Start with a block of 1 instruction
-	Block block;
-	block.startAddr=addr;
-	block.endAddr=addr+insSize;
+	// Counting sort grouping the resolved branches by destination, in the order of the hash map. The callers only ever
+	// look up the branches of one destination, so the groups don't need to be in address order.
+	xrefs.clear();
+	xrefRanges.clear();
+	for (const Branch& b : branches)
+		if (b.dest!=(uint32_t)-1)
+			xrefRanges[b.dest].second++;
+	uint32_t offset=0;
+	for (auto& range : xrefRanges)
+	{
+		range.second.first = offset;
+		offset += range.second.second;
+		range.second.second = range.second.first;
+	}
+	xrefs.resize(offset);
+	for (uint32_t i=0; i<branches.size(); ++i)
+		if (branches[i].dest!=(uint32_t)-1)
+			xrefs[xrefRanges[branches[i].dest].second++] = i;
+}
 
-	// If the first instruction is a jump or ret, stop here
-	if (iType==insType::condJump)
+void Disassembler::buildCFG()
+{
+	// Collect the edges, then counting sort them by source block and by destination block
+	vector<pair<uint32_t,uint32_t>> edges;
+	auto addEdge = [&](uint32_t from, uint32_t toAddr)
 	{
-		blocks.push_back(block);
-		uint32_t jumpDest = getBranchDest(addr, firstIns);
-		if (jumpDest!=(uint32_t)-1 && isAddrInternal(jumpDest))
-			if (!isAddrInBlock(jumpDest))
-			{
-				//cout << "Jumping cond to taken 0x"<<hex<<(int)jumpDest-(int)data<<dec<<"\n";
-				readBlocks(jumpDest);
-			}
-		if (!isAddrInBlock(addr+insSize))
-		{
-			//cout << "Jumping cond to alter 0x"<<hex<<(int)addr+insSize-(int)data<<dec<<"\n";
-			readBlocks(addr+insSize);
-		}
-		return block;
+		Block* to = getBlockOfAddr(toAddr);
+		if (to)
+			edges.push_back({from, (uint32_t)(to-blocks.data())});
+	};
+	for (uint32_t i=0; i<blocks.size(); ++i)
+	{
+		const Block& block = blocks[i];
+		for (uint32_t j=block.destsStart; j<block.destsEnd; ++j)
+			addEdge(i, blockDests[j]);
+
+		// The branches are in the order of the code, find the last instruction of the block among them
+		auto it = lower_bound(begin(branches), end(branches), block.endAddr,
+							[](const Branch& b, uint32_t addr){return b.source < addr;});
+		if (it==begin(branches) || (--it)->source < block.startAddr)
+			continue;
+		size_t index = code.find(it->source);
+		if (index==InstructionStore::npos || it->source+code.getSize(index)!=block.endAddr)
+			continue;
+		if (it->type==BranchType::jump || it->type==BranchType::condJump)
+			addEdge(i, it->dest);
+		if (it->type==BranchType::condJump || it->type==BranchType::regCondJump)
+			addEdge(i, block.endAddr);
 	}
-	else if(iType==insType::uncondJump)
+
+	size_t nBlocks = blocks.size();
+	cfg.succOffsets.assign(nBlocks+1, 0);
+	cfg.predOffsets.assign(nBlocks+1, 0);
+	for (const pair<uint32_t,uint32_t>& e : edges)
 	{
-		blocks.push_back(block);
-		uint32_t jumpDest = getBranchDest(addr, firstIns);
-		if (jumpDest!=(uint32_t)-1 && isAddrInternal(jumpDest))
-			if (!isAddrInBlock(jumpDest))
-			{
-				//cout << "Jumping cond to taken 0x"<<hex<<(int)jumpDest-(int)data<<dec<<"\n";
-				readBlocks(jumpDest);
-			}
-		return block;
+		cfg.succOffsets[e.first+1]++;
+		cfg.predOffsets[e.second+1]++;
 	}
-	else if(iType==insType::ret)
+	for (size_t i=0; i<nBlocks; ++i)
 	{
-		blocks.push_back(block);
-		return block;
+		cfg.succOffsets[i+1] += cfg.succOffsets[i];
+		cfg.predOffsets[i+1] += cfg.predOffsets[i];
 	}
-
-	// Process the rest of the block
-	addr+=insSize;
-	for (;;)
+	cfg.succs.resize(edges.size());
+	cfg.preds.resize(edges.size());
+	vector<uint32_t> succPos(begin(cfg.succOffsets), end(cfg.succOffsets)-1);
+	vector<uint32_t> predPos(begin(cfg.predOffsets), end(cfg.predOffsets)-1);
+	for (const pair<uint32_t,uint32_t>& e : edges)
 	{
-		//cout << "Checking 0x"<<hex<<(int)addr-(int)data<<dec<<" ";
-		vector<uint8_t> ins = code[addr];
-		insSize = ins.size();
-		iType = getInstructionType(ins);
+		cfg.succs[succPos[e.first]++] = e.second;
+		cfg.preds[predPos[e.second]++] = e.first;
+	}
+}
 
-		if (insSize==0)
-			throw "Instruction with null size while reading blocks";
+void Disassembler::buildBlocks()
+{
+	blocks.clear();
+	blockDests.clear();
 
-		// If instruction is a jump or ret, add it and stop (and process jumps recursively)
-		if (iType==insType::condJump)
-		{
-			block.endAddr+=insSize;
-			blocks.push_back(block);
-			uint32_t jumpDest = getBranchDest(addr, ins);
-			if (jumpDest!=(uint32_t)-1 && isAddrInternal(jumpDest))
-				if (!isAddrInBlock(jumpDest))
-				{
-					//cout << "Jumping cond to taken 0x"<<hex<<(int)jumpDest-(int)data<<dec<<"\n";
-					readBlocks(jumpDest);
-				}
-			if (!isAddrInBlock(addr+insSize))
-			{
-				//cout << "Jumping cond to alter 0x"<<hex<<(int)addr+insSize-(int)data<<dec<<"\n";
-				readBlocks(addr+insSize);
-			}
-			return block;
-		}
-		else if(iType==insType::uncondJump)
-		{
-			block.endAddr+=insSize;
-			blocks.push_back(block);
-			uint32_t jumpDest = getBranchDest(addr, ins);
-			if (jumpDest!=(uint32_t)-1 && isAddrInternal(jumpDest))
-				if (!isAddrInBlock(jumpDest))
-				{
-					//cout << "Jumping uncond to taken 0x"<<hex<<(int)jumpDest-(int)data<<dec<<"\n";
-					readBlocks(jumpDest);
-				}
-			return block;
-		}
-		else if(iType==insType::ret)
+	// Blocks start at the leaders : the entry point, the branch destinations and the fallthroughs of the
+	// conditional jumps. The calls flow to the next instruction, so their return address isn't a leader.
+	vector<uint32_t> leaders{entryPoint};
+	leaders.reserve(branches.size()*2+1);
+	for (const Branch& b : branches)
+	{
+		if (b.dest!=(uint32_t)-1)
+			leaders.push_back(b.dest);
+		if (b.type==BranchType::condJump || b.type==BranchType::regCondJump)
 		{
-			block.endAddr+=insSize;
-			blocks.push_back(block);
-			return block;
+			size_t index = code.find(b.source);
+			if (index!=InstructionStore::npos)
+				leaders.push_back(b.source+code.getSize(index));
 		}
+	}
+	sort(begin(leaders), end(leaders));
+	leaders.erase(unique(begin(leaders), end(leaders)), end(leaders));
 
-		// If the instruction is xref'd, stop here without adding it.
-		if (hasXRefs(addr))
+	// Each block runs from its leader to a jump or a ret, to the next leader, or to where the decoded code stops.
+	// The leaders and the instructions are both in address order, so the blocks come out sorted and disjoint.
+	auto nextLeader = begin(leaders);
+	for (uint32_t leader : leaders)
+	{
+		size_t index = code.find(leader);
+		if (index==InstructionStore::npos) // Outside the code, or inside another instruction
+			continue;
+		nextLeader = upper_bound(nextLeader, end(leaders), leader);
+		uint32_t nDests = blockDests.size();
+		Block block{leader, leader, nDests, nDests, 0, 0};
+		for (;;)
 		{
-			block.destAddrs.push_back(addr);
-			blocks.push_back(block);
-
-			if (!isAddrInBlock(addr))
-				readBlocks(addr);
-
-			return block;
+			InstructionRef ins = code[index];
+			block.endAddr = ins.addr+ins.size;
+			insType type = ins.info->type;
+			if (type==insType::condJump || type==insType::uncondJump || type==insType::ret)
+				break;
+			// The decoder stopped the flow here, after a noreturn call or before possible data
+			if (++index==code.size() || code.getAddr(index)!=block.endAddr)
+				break;
+			while (nextLeader!=end(leaders) && *nextLeader<block.endAddr)
+				++nextLeader;
+			if (nextLeader!=end(leaders) && *nextLeader==block.endAddr)
+			{
+				blockDests.push_back(block.endAddr);
+				block.destsEnd = blockDests.size();
+				break;
+			}
 		}
-
-		// Regular instruction, add it to the block
-		block.endAddr+=insSize;
-		addr+=insSize;
+		blocks.push_back(block);
 	}
-	return block;
 }
@@ -0,0 +1,275 @@
+#include "disassembler.h"
+#include "mappedfile.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+/// Format of the cache files. Bump the version whenever the layout or the meaning of the data changes,
+/// old cache files are then ignored and overwritten.
+/// The file is the header followed by arrays of 32-bit words, in this order :
+/// instructions addresses, instructions sizes (one byte each, padded to 4 bytes), branches (type, source, dest),
+/// blocks (start, end, number of dests), blocks dests, referenced addresses (addr, type), noreturn functions.
+/// The bytes of the instructions aren't stored, they're read back from the virtual image.
+/// The xrefs, the control flow graph and the liveness aren't stored either, they're rebuilt from the branches and blocks.
+/// The instructions found depend on how they were decoded, so the cache is only used by a run with the same options.
+/// The analysis decodes the targets of the indirect branches it resolves, so that includes whether it ran.
+static const uint32_t CACHE_MAGIC = 0x4F544944; // "DITO"
+static const uint32_t CACHE_VERSION = 10;
+static const uint32_t CACHE_FLAG_ANALYZED = 1;
+static const uint32_t CACHE_FLAG_PARALLEL = 1<<1;
+static const uint32_t CACHE_FLAG_LINEAR_SWEEP = 1<<2;
+static const uint32_t CACHE_KEY_FLAGS = CACHE_FLAG_ANALYZED|CACHE_FLAG_PARALLEL|CACHE_FLAG_LINEAR_SWEEP;
+
+struct CacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t inputHash;
+	uint64_t inputSize;
+	uint32_t flags;
+	uint32_t nInstructions;
+	uint32_t nBranches;
+	uint32_t nBlocks;
+	uint32_t nBlockDests;
+	uint32_t nRefdAddrs;
+	uint32_t signaturesHash;
+	uint32_t nNoReturnFunctions;
+};
+
+/// Hash of the whole content of the input, 8 bytes at a time (FNV-1a on 64-bit words)
+static uint64_t hashData(const uint8_t* data, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i=0;
+	for (; i+8<=size; i+=8)
+	{
+		uint64_t word;
+		memcpy(&word, data+i, 8);
+		hash = (hash^word)*0x100000001b3ULL;
+		hash ^= hash>>32;
+	}
+	for (; i<size; ++i)
+		hash = (hash^data[i])*0x100000001b3ULL;
+	return hash^size;
+}
+
+/// Size of the file described by the header, or 0 if the counts don't make sense
+static size_t getCacheSize(const CacheHeader& header)
+{
+	uint64_t nWords = (uint64_t)header.nInstructions + (header.nInstructions+3)/4
+					+ header.nBranches*3ULL + header.nBlocks*3ULL + header.nBlockDests
+					+ header.nRefdAddrs*2ULL + header.nNoReturnFunctions;
+	if (nWords > (SIZE_MAX-sizeof(CacheHeader))/4)
+		return 0;
+	return sizeof(CacheHeader) + nWords*4;
+}
+
+uint32_t Disassembler::getDecodeFlags()
+{
+	return (decodedInParallel ? CACHE_FLAG_PARALLEL : 0) | (decodedLinearly ? CACHE_FLAG_LINEAR_SWEEP : 0);
+}
+
+bool Disassembler::loadCache(std::string cacheDir)
+{
+	pair<uint8_t*,size_t> input = parser.getData();
+	inputHash = hashData(input.first, input.second);
+	stringstream path;
+	path << cacheDir << '/' << hex << setw(16) << setfill('0') << inputHash << ".cache";
+	cachePath = path.str();
+
+	// A missing or unreadable cache just means we have to disassemble
+	MappedFile* file;
+	try {
+		file = new MappedFile(cachePath);
+	}
+	catch (const char*) {
+		return false;
+	}
+	unique_ptr<MappedFile> fileOwner(file);
+
+	const uint8_t* data = file->getData();
+	size_t size = file->getSize();
+	if (size < sizeof(CacheHeader))
+		return false;
+	CacheHeader header;
+	memcpy(&header, data, sizeof(CacheHeader));
+	if (header.magic!=CACHE_MAGIC || header.version!=CACHE_VERSION
+		|| header.inputHash!=inputHash || header.inputSize!=input.second
+		|| (header.flags & CACHE_KEY_FLAGS)!=((willAnalyze ? CACHE_FLAG_ANALYZED : 0) | getDecodeFlags())
+		|| header.signaturesHash!=signaturesHash
+		|| getCacheSize(header)!=size)
+		return false;
+
+	const uint32_t* words = (const uint32_t*)(data+sizeof(CacheHeader));
+	const uint32_t* addrs = words;
+	const uint8_t* sizes = (const uint8_t*)(addrs+header.nInstructions);
+	words = addrs + header.nInstructions + (header.nInstructions+3)/4;
+
+	// A corrupted file can have the right size but not the right counts, check them before following them
+	for (uint32_t i=0; i<header.nBranches; ++i)
+		if (words[i*3] > (uint32_t)BranchType::regCall)
+			return false;
+	const uint32_t* blockWords = words + header.nBranches*3;
+	uint64_t nDests = 0;
+	for (uint32_t i=0; i<header.nBlocks; ++i)
+		nDests += blockWords[i*3+2];
+	if (nDests!=header.nBlockDests)
+		return false;
+
+	// Nothing must be left of a partial load, the instructions are decoded again from scratch
+	auto fail = [&]()
+	{
+		code.clear();
+		fill(begin(byteClasses), end(byteClasses), byteUndecoded);
+		return false;
+	};
+
+	code.reserve(header.nInstructions, header.nInstructions*4);
+	// The attributes of the instructions aren't cached, decoding them again is cheap
+	for (uint32_t i=0; i<header.nInstructions; ++i)
+	{
+		InstructionInfo info;
+		const char* error;
+		if (!sizes[i] || !isAddrInternal(addrs[i]) || !isAddrInternal(addrs[i]+sizes[i]-1)
+			|| decodeInstruction(virtualImage+addrs[i], info, error)!=sizes[i])
+			return fail();
+		code.insert(addrs[i], virtualImage+addrs[i], sizes[i], info);
+		markInstruction(addrs[i], sizes[i]);
+	}
+	code.finalize();
+
+	branches.reserve(header.nBranches);
+	for (uint32_t i=0; i<header.nBranches; ++i, words+=3)
+		branches.push_back({(BranchType)words[0], words[1], words[2]});
+
+	const uint32_t* dests = words + header.nBlocks*3;
+	blocks.reserve(header.nBlocks);
+	blockDests.reserve(header.nBlockDests);
+	for (uint32_t i=0; i<header.nBlocks; ++i, words+=3)
+	{
+		uint32_t nDests = blockDests.size();
+		blockDests.insert(end(blockDests), dests, dests+words[2]);
+		dests += words[2];
+		blocks.push_back({words[0], words[1], nDests, (uint32_t)blockDests.size(), 0, 0});
+	}
+	words = dests;
+
+	for (uint32_t i=0; i<header.nRefdAddrs; ++i, words+=2)
+	{
+		if (!isAddrInternal(words[0]))
+			continue;
+		if (words[1]==DetectedType::code)
+			markRef(words[0], byteCodeRef);
+		else if (words[1]==DetectedType::possibleData)
+			markRef(words[0], bytePossibleData);
+		else if (words[1]==DetectedType::data)
+			markRef(words[0], byteData);
+	}
+
+	// Decoding more code from the signatures or the resolved branches needs them to stop where a fresh run does
+	for (uint32_t i=0; i<header.nNoReturnFunctions; ++i, ++words)
+		if (isAddrInternal(*words))
+			noReturnFunctions.insert(*words);
+
+	buildXRefs();
+	buildCFG();
+	computeLiveness();
+
+	analyzed = header.flags & CACHE_FLAG_ANALYZED;
+	return true;
+}
+
+void Disassembler::saveCache()
+{
+	if (cachePath.empty())
+		throw "No cache directory";
+	if (!editedAddrs.empty())
+		throw "Can't cache edited instructions";
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(CacheHeader));
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.inputHash = inputHash;
+	header.inputSize = parser.getData().second;
+	header.flags = (analyzed ? CACHE_FLAG_ANALYZED : 0) | getDecodeFlags();
+	header.signaturesHash = signaturesHash;
+	header.nInstructions = code.size();
+	header.nBranches = branches.size();
+	header.nBlocks = blocks.size();
+	header.nBlockDests = blockDests.size();
+	for (uint8_t byteClass : byteClasses)
+		if (byteClass & (byteCodeRef|bytePossibleData|byteData))
+			header.nRefdAddrs++;
+	header.nNoReturnFunctions = noReturnFunctions.size();
+
+	vector<uint32_t> words;
+	words.reserve((getCacheSize(header)-sizeof(CacheHeader))/4);
+	for (size_t i=0; i<code.size(); ++i)
+		words.push_back(code.getAddr(i));
+	words.resize(words.size() + (header.nInstructions+3)/4);
+	uint8_t* sizes = (uint8_t*)(words.data()+header.nInstructions);
+	for (size_t i=0; i<code.size(); ++i)
+		*sizes++ = code.getSize(i);
+	for (const Branch& b : branches)
+		words.insert(end(words), {(uint32_t)b.type, b.source, b.dest});
+	for (const Block& block : blocks)
+		words.insert(end(words), {block.startAddr, block.endAddr, block.destsEnd-block.destsStart});
+	for (const Block& block : blocks)
+		words.insert(end(words), begin(blockDests)+block.destsStart, begin(blockDests)+block.destsEnd);
+	for (uint32_t addr=0; addr<byteClasses.size(); ++addr)
+	{
+		if (byteClasses[addr] & byteCodeRef)
+			words.insert(end(words), {addr, (uint32_t)DetectedType::code});
+		else if (byteClasses[addr] & bytePossibleData)
+			words.insert(end(words), {addr, (uint32_t)DetectedType::possibleData});
+		else if (byteClasses[addr] & byteData)
+			words.insert(end(words), {addr, (uint32_t)DetectedType::data});
+	}
+	size_t noReturnStart = words.size();
+	words.insert(end(words), begin(noReturnFunctions), end(noReturnFunctions));
+	sort(begin(words)+noReturnStart, end(words));
+
+	// Write to a temporary file first, so a concurrent run never reads a partial cache
+	stringstream tmpPath;
+	tmpPath << cachePath << ".tmp" << hex << (uintptr_t)this;
+	{
+		ofstream out(tmpPath.str(), ios::binary|ios::trunc);
+		if (!out.is_open())
+			throw "Can't create the cache file";
+		out.write((const char*)&header, sizeof(CacheHeader));
+		out.write((const char*)words.data(), words.size()*4);
+		if (!out)
+		{
+			out.close();
+			remove(tmpPath.str().c_str());
+			throw "Can't write the cache file";
+		}
+	}
+	if (rename(tmpPath.str().c_str(), cachePath.c_str()))
+	{
+		// Windows doesn't replace existing files
+		remove(cachePath.c_str());
+		if (rename(tmpPath.str().c_str(), cachePath.c_str()))
+		{
+			remove(tmpPath.str().c_str());
+			throw "Can't write the cache file";
+		}
+	}
+}
+
+bool Disassembler::isFromCache()
+{
+	return loadedFromCache;
+}
+
+bool Disassembler::isAnalyzed()
+{
+	return analyzed;
+}
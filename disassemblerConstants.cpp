@@ -0,0 +1,323 @@
+#include "disassembler.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+/// Address of the ModRM memory operand, if all the registers it's made of are known
+static bool getOperandAddress(InstructionRef ins, const RegisterValues& regs, uint32_t& va)
+{
+	const InstructionInfo& info = *ins.info;
+	if (!info.modrmOffset || (ins.modrm()>>6)==3 || (info.prefixes & (prefixAdSize|prefixSegment)))
+		return false;
+	unsigned mod = ins.modrm()>>6, rm = ins.modrm()&7;
+	va = 0;
+	if (info.dispSize==1)
+		va = (int8_t)ins[info.dispOffset];
+	else if (info.dispSize==4)
+		memcpy(&va, ins.bytes+info.dispOffset, 4);
+	auto add = [&](unsigned reg, uint32_t scale)
+	{
+		if (!(regs.known>>reg & 1))
+			return false;
+		va += regs.values[reg]*scale;
+		return true;
+	};
+	if (rm==4)
+	{
+		uint8_t sib = ins.sib();
+		unsigned index = (sib>>3)&7, base = sib&7;
+		if (index!=4 && !add(index, 1<<(sib>>6)))
+			return false;
+		return (mod==0 && base==5) || add(base, 1);
+	}
+	return (mod==0 && rm==5) || add(rm, 1);
+}
+
+/// Keeps the values both states agree on
+/// @return True if into changed
+static bool meetValues(RegisterValues& into, const RegisterValues& other)
+{
+	uint8_t known = into.known & other.known;
+	for (unsigned reg=0; reg<8; ++reg)
+		if ((known>>reg & 1) && into.values[reg]!=other.values[reg])
+			known &= ~(1<<reg);
+	bool changed = known!=into.known;
+	into.known = known;
+	return changed;
+}
+
+bool Disassembler::readConstant(uint32_t va, uint32_t& value)
+{
+	uint32_t rva = va-imageBase;
+	SectionHandle section = parser.getSectionAt(rva);
+	if (section==INVALID_SECTION || parser.getSectionAt(rva+3)!=section
+		|| (parser.getSectionFlags(section) & IMAGE_SCN_MEM_WRITE)
+		|| parser.getFileOffset(rva)==(uint32_t)-1 || parser.getFileOffset(rva+3)==(uint32_t)-1)
+		return false;
+	// The loader writes the addresses of the imports, even in read-only sections
+	if (parser.getImport(rva))
+		return false;
+	memcpy(&value, virtualImage+rva, 4);
+	return true;
+}
+
+void Disassembler::emulateInstruction(InstructionRef ins, RegisterValues& regs)
+{
+	const InstructionInfo& info = *ins.info;
+	if (info.type==insType::call)
+	{
+		regs.known &= ~(regEax|regEcx|regEdx|regEsp);
+		return;
+	}
+
+	// Whatever the instruction writes is unknown, unless it's one of the few we follow
+	uint8_t known = regs.known & ~(info.defs & regGPRs);
+	int dest = -1;
+	uint32_t value, va;
+	bool isKnown = false;
+	if (!(info.prefixes & (prefixOpSize|prefixAdSize)) && info.opcodeSize==1)
+	{
+		uint8_t op = ins.opcode()[0];
+		uint8_t modrm = info.modrmOffset ? ins.modrm() : 0;
+		unsigned reg = (modrm>>3)&7, rm = modrm&7;
+		bool regOperand = info.modrmOffset && (modrm>>6)==3;
+		uint32_t imm = 0;
+		if (info.immSize==1)
+			imm = (int8_t)ins[info.immOffset];
+		else if (info.immSize==4)
+			memcpy(&imm, ins.bytes+info.immOffset, 4);
+
+		if (op>=0xB8 && op<=0xBF) // MOV Zv Iv
+		{
+			dest = op&7;
+			value = imm;
+			isKnown = true;
+		}
+		else if (op==0x8B && regOperand) // MOV Gv Ev
+		{
+			dest = reg;
+			value = regs.values[rm];
+			isKnown = regs.known>>rm & 1;
+		}
+		else if (op==0x89 && regOperand) // MOV Ev Gv
+		{
+			dest = rm;
+			value = regs.values[reg];
+			isKnown = regs.known>>reg & 1;
+		}
+		else if (op==0x8B) // MOV Gv M
+		{
+			dest = reg;
+			isKnown = getOperandAddress(ins, regs, va) && readConstant(va, value);
+		}
+		else if (op==0xA1 && !(info.prefixes & prefixSegment)) // MOV eAX Ov
+		{
+			dest = 0;
+			memcpy(&va, ins.bytes+info.dispOffset, 4);
+			isKnown = readConstant(va, value);
+		}
+		else if (op==0x8D) // LEA
+		{
+			dest = reg;
+			isKnown = getOperandAddress(ins, regs, value);
+		}
+		else if ((op==0x29 || op==0x2B || op==0x31 || op==0x33) && regOperand && reg==rm) // SUB, XOR with itself
+		{
+			dest = reg;
+			value = 0;
+			isKnown = true;
+		}
+		else if ((op==0x81 || op==0x83) && regOperand && (reg<2 || reg==4 || reg==5 || reg==6)) // Group 1, not ADC SBB CMP
+		{
+			dest = rm;
+			isKnown = regs.known>>rm & 1;
+			value = regs.values[rm];
+			value = reg==0 ? value+imm : reg==1 ? value|imm : reg==4 ? value&imm : reg==5 ? value-imm : value^imm;
+		}
+		else if (op>=0x40 && op<=0x4F) // INC, DEC Zv
+		{
+			dest = op&7;
+			isKnown = regs.known>>dest & 1;
+			value = op<0x48 ? regs.values[dest]+1 : regs.values[dest]-1;
+		}
+	}
+	if (dest>=0 && isKnown)
+	{
+		known |= 1<<dest;
+		regs.values[dest] = value;
+	}
+	regs.known = known;
+}
+
+void Disassembler::resolveIndirectBranches()
+{
+	auto bySource = [](const Branch& b, uint32_t addr){return b.source < addr;};
+	auto findBranch = [&](uint32_t source)
+	{
+		auto it = lower_bound(begin(branches), end(branches), source, bySource);
+		return (it!=end(branches) && it->source==source) ? &*it : nullptr;
+	};
+	// Calls and jumps through a register or through memory, still unresolved
+	auto isUnresolved = [&](InstructionRef ins)
+	{
+		if ((ins.info->type!=insType::call && ins.info->type!=insType::uncondJump) || ins.opcode()[0]!=0xFF
+			|| (ins.info->prefixes & (prefixOpSize|prefixAdSize)))
+			return false;
+		const Branch* b = findBranch(ins.addr);
+		return b && b->dest==(uint32_t)-1;
+	};
+	// The functions and the code referenced as data can be entered with any value
+	auto isRoot = [&](uint32_t i)
+	{
+		uint32_t start = blocks[i].startAddr;
+		if (cfg.predOffsets[i]==cfg.predOffsets[i+1] || start==entryPoint
+			|| (getByteClass(start) & (bytePossibleData|byteData)))
+			return true;
+		pair<const uint32_t*, const uint32_t*> range = getXRefs(start);
+		for (const uint32_t* xref=range.first; xref!=range.second; ++xref)
+			if (branches[*xref].type==BranchType::call)
+				return true;
+		return false;
+	};
+	auto forEachInstruction = [&](const Block& block, RegisterValues& regs, bool evaluate,
+								vector<pair<uint32_t,uint32_t>>& found)
+	{
+		bool hasCandidates = false;
+		for (size_t index=code.find(block.startAddr);
+			index!=InstructionStore::npos && index<code.size() && code.getAddr(index)<block.endAddr; ++index)
+		{
+			InstructionRef ins = code[index];
+			if (isUnresolved(ins))
+			{
+				hasCandidates = true;
+				uint32_t value, va;
+				bool isKnown;
+				if ((ins.modrm()>>6)==3)
+				{
+					isKnown = regs.known>>(ins.modrm()&7) & 1;
+					value = regs.values[ins.modrm()&7];
+				}
+				else
+					isKnown = getOperandAddress(ins, regs, va) && readConstant(va, value);
+				if (evaluate && isKnown)
+					found.push_back({ins.addr, value-imageBase});
+			}
+			emulateInstruction(ins, regs);
+		}
+		return hasCandidates;
+	};
+
+	// Values at the start of the blocks, by address so they survive the blocks being rebuilt
+	unordered_map<uint32_t, RegisterValues> entries;
+	vector<uint32_t> worklist;
+	vector<uint8_t> inWorklist;
+	vector<uint32_t> candidates; // Blocks with unresolved branches, evaluated once the values are final
+	vector<pair<uint32_t,uint32_t>> found; // Branch source and destination
+	vector<pair<uint32_t,uint32_t>> resolved; // What was found and decoded in the last round
+	for (;;)
+	{
+		size_t nBlocks = blocks.size();
+		inWorklist.assign(nBlocks, 0);
+		auto push = [&](uint32_t i)
+		{
+			if (!inWorklist[i])
+			{
+				inWorklist[i] = 1;
+				worklist.push_back(i);
+			}
+		};
+
+		// Start from the roots, and from what flows into the blocks not seen yet
+		for (uint32_t i=0; i<nBlocks; ++i)
+		{
+			auto it = entries.find(blocks[i].startAddr);
+			if (isRoot(i))
+			{
+				if (it==end(entries) || it->second.known)
+				{
+					entries[blocks[i].startAddr].known = 0;
+					push(i);
+				}
+			}
+			else if (it==end(entries))
+			{
+				for (uint32_t p=cfg.predOffsets[i]; p<cfg.predOffsets[i+1]; ++p)
+					if (entries.count(blocks[cfg.preds[p]].startAddr))
+						push(cfg.preds[p]);
+			}
+		}
+		// A resolved branch can land in a block that has values already, they have to meet what the branch brings
+		for (const pair<uint32_t,uint32_t>& r : resolved)
+			if (Block* source = getBlockOfAddr(r.first))
+				push(source-blocks.data());
+
+		candidates.clear();
+		while (!worklist.empty())
+		{
+			uint32_t i = worklist.back();
+			worklist.pop_back();
+			inWorklist[i] = 0;
+			RegisterValues regs = entries[blocks[i].startAddr];
+			if (forEachInstruction(blocks[i], regs, false, found))
+				candidates.push_back(i);
+			for (uint32_t s=cfg.succOffsets[i]; s<cfg.succOffsets[i+1]; ++s)
+			{
+				uint32_t succ = cfg.succs[s];
+				auto it = entries.find(blocks[succ].startAddr);
+				if (it==end(entries))
+				{
+					entries.insert({blocks[succ].startAddr, regs});
+					push(succ);
+				}
+				else if (meetValues(it->second, regs))
+					push(succ);
+			}
+		}
+
+		// The values only become unknown as the propagation goes, so they're only final now
+		found.clear();
+		sort(begin(candidates), end(candidates));
+		candidates.erase(unique(begin(candidates), end(candidates)), end(candidates));
+		for (uint32_t i : candidates)
+		{
+			RegisterValues regs = entries[blocks[i].startAddr];
+			forEachInstruction(blocks[i], regs, true, found);
+		}
+
+		// Each new target is checked right before it's decoded, against the targets decoded before it too
+		resolved.clear();
+		for (const pair<uint32_t,uint32_t>& f : found)
+		{
+			uint32_t target = f.second;
+			if (!isAddrInternal(target))
+				continue;
+			uint8_t byteClass = getByteClass(target);
+			if ((byteClass & byteData) || ((byteClass & byteInsBody) && !(byteClass & byteInsStart)))
+				continue;
+			// The value could be anything, even a constant that happens to point in the code
+			if (!(byteClass & byteInsStart) && !isValidRoot(target, {}))
+				continue;
+			// An explicit branch makes it code, even if an instruction referenced it as possible data
+			byteClasses[target] = (byteClass & ~bytePossibleData) | byteCodeRef;
+			if (!(byteClass & byteInsStart))
+				readCode(target);
+			resolved.push_back(f);
+		}
+		if (resolved.empty())
+			break;
+
+		// Cut the blocks again with the new branches
+		code.finalize();
+		sort(begin(branches), end(branches), [](const Branch& a, const Branch& b){return a.source < b.source;});
+		for (const pair<uint32_t,uint32_t>& r : resolved)
+		{
+			Branch* b = findBranch(r.first);
+			b->type = b->type==BranchType::regCall ? BranchType::call : BranchType::jump;
+			b->dest = r.second;
+		}
+		buildXRefs();
+		buildBlocks();
+		buildCFG();
+	}
+}
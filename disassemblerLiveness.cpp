@@ -0,0 +1,69 @@
+#include "disassembler.h"
+
+using namespace std;
+
+void Disassembler::computeLiveness()
+{
+	// The memory is always live, only the registers and the flags are tracked
+	const uint16_t tracked = regGPRs|regFlags;
+	size_t nBlocks = blocks.size();
+
+	// What each block reads before writing it, and what it kills
+	vector<uint16_t> blockUses(nBlocks), blockDefs(nBlocks);
+	vector<uint8_t> leavesCFG(nBlocks);
+	for (size_t i=0; i<nBlocks; ++i)
+	{
+		Block& block = blocks[i];
+		uint16_t uses=0, defs=0;
+		insType lastType = insType::other;
+		for (size_t index=code.find(block.startAddr);
+			index!=InstructionStore::npos && index<code.size() && code.getAddr(index)<block.endAddr; ++index)
+		{
+			const InstructionInfo& info = code.getInfo(index);
+			uses |= info.uses & ~defs;
+			defs |= info.defs;
+			lastType = info.type;
+		}
+		blockUses[i] = uses & tracked;
+		blockDefs[i] = defs & tracked;
+
+		// A block without all its successors in the CFG flows somewhere we don't know
+		unsigned nSuccs = cfg.succOffsets[i+1]-cfg.succOffsets[i];
+		unsigned nExpected = lastType==insType::condJump ? 2 : lastType==insType::ret ? (unsigned)-1 : 1;
+		leavesCFG[i] = nSuccs<nExpected;
+		block.liveIn = blockUses[i];
+		block.liveOut = 0;
+	}
+
+	// Backward dataflow, the blocks are first visited from the end of the code
+	vector<uint32_t> worklist;
+	worklist.reserve(nBlocks);
+	vector<uint8_t> inWorklist(nBlocks, 1);
+	for (uint32_t i=0; i<nBlocks; ++i)
+		worklist.push_back(i);
+	while (!worklist.empty())
+	{
+		uint32_t i = worklist.back();
+		worklist.pop_back();
+		inWorklist[i] = 0;
+		Block& block = blocks[i];
+
+		uint16_t liveOut = leavesCFG[i] ? tracked : 0;
+		for (uint32_t s=cfg.succOffsets[i]; s<cfg.succOffsets[i+1]; ++s)
+			liveOut |= blocks[cfg.succs[s]].liveIn;
+		block.liveOut = liveOut;
+		uint16_t liveIn = blockUses[i] | (liveOut & ~blockDefs[i]);
+		if (liveIn==block.liveIn)
+			continue;
+		block.liveIn = liveIn;
+		for (uint32_t p=cfg.predOffsets[i]; p<cfg.predOffsets[i+1]; ++p)
+		{
+			uint32_t pred = cfg.preds[p];
+			if (!inWorklist[pred])
+			{
+				inWorklist[pred] = 1;
+				worklist.push_back(pred);
+			}
+		}
+	}
+}
@@ -0,0 +1,103 @@
+#include "disassembler.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+bool Disassembler::isNoReturn(uint32_t dest)
+{
+	const Import* import = parser.getImport(dest);
+	if (import)
+		return import->noReturn;
+	if (noReturnFunctions.count(dest))
+		return true;
+
+	// Thunk of an import, JMP [slot]
+	uint32_t sectionEnd = getCodeSectionEnd(dest);
+	if (sectionEnd && dest+6<=sectionEnd && virtualImage[dest]==0xFF && virtualImage[dest+1]==0x25)
+	{
+		uint32_t slot;
+		memcpy(&slot, virtualImage+dest+2, 4);
+		import = parser.getImport(slot-imageBase);
+		return import && import->noReturn;
+	}
+	return false;
+}
+
+bool Disassembler::canReturn(uint32_t function)
+{
+	vector<uint32_t> worklist{function};
+	unordered_set<uint32_t> visited;
+	while (!worklist.empty())
+	{
+		uint32_t ip = worklist.back();
+		worklist.pop_back();
+		while (visited.insert(ip).second)
+		{
+			size_t index = code.find(ip);
+			if (index==InstructionStore::npos)
+				return true; // The flow stopped on possible data, we can't tell
+			InstructionRef ins = code[index];
+			insType type = ins.info->type;
+			if (type==insType::ret)
+				return true;
+			if (type!=insType::call && type!=insType::condJump && type!=insType::uncondJump)
+			{
+				ip += ins.size;
+				continue;
+			}
+			if (ins.info->prefixes & (prefixOpSize|prefixAdSize))
+				return true;
+
+			uint32_t dest = getBranchDest(ins);
+			if (type==insType::call)
+			{
+				if (dest!=(uint32_t)-1 && isNoReturn(dest))
+					break;
+				ip += ins.size;
+				continue;
+			}
+			// Jumps through registers or jump tables, and tail calls out of the module, may return
+			if (dest==(uint32_t)-1)
+				return true;
+			if (isNoReturn(dest))
+			{
+				if (type==insType::uncondJump)
+					break;
+			}
+			else if (!isAddrInternal(dest))
+				return true;
+			else
+				worklist.push_back(dest);
+			if (type==insType::uncondJump)
+				break;
+			ip += ins.size;
+		}
+	}
+	return false;
+}
+
+bool Disassembler::findNoReturnFunctions()
+{
+	vector<uint32_t> functions;
+	for (const Branch& b : branches)
+		if (b.type==BranchType::call && code.contains(b.dest) && !noReturnFunctions.count(b.dest))
+			functions.push_back(b.dest);
+	sort(begin(functions), end(functions));
+	functions.erase(unique(begin(functions), end(functions)), end(functions));
+
+	// A function calling another one only found in this pass needs another pass
+	bool found=false, foundInPass;
+	do
+	{
+		foundInPass=false;
+		for (uint32_t function : functions)
+		{
+			if (noReturnFunctions.count(function) || canReturn(function))
+				continue;
+			noReturnFunctions.insert(function);
+			found = foundInPass = true;
+		}
+	} while (foundInPass);
+	return found;
+}
@@ -0,0 +1,224 @@
+#include "disassembler.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+/// Branch targets waiting to be decoded by a worker.
+/// The owner pushes and pops at the back, the other workers steal at the front.
+struct WorkDeque
+{
+	WorkDeque() : lock(), targets() {}
+	mutex lock;
+	deque<uint32_t> targets;
+};
+
+/// Only used while decoding, a flow stopped at this byte because an instruction being decoded had claimed it
+static const uint8_t byteWanted = 1<<7;
+
+void Disassembler::readCodeParallel(uint32_t addr, unsigned nThreads)
+{
+	// The classification map is shared by the workers. An instruction is only kept by the worker that claims all
+	// of its bytes, so no instruction is decoded twice and no two instructions overlap.
+	size_t nBytes = byteClasses.size();
+	unique_ptr<atomic<uint8_t>[]> classes(new atomic<uint8_t>[nBytes]);
+	for (size_t i=0; i<nBytes; ++i)
+		classes[i].store(byteClasses[i], memory_order_relaxed);
+	auto markRefAtomic = [&](uint32_t ref, uint8_t type)
+	{
+		uint8_t byteClass = classes[ref].load(memory_order_relaxed);
+		while (!(byteClass & (byteCodeRef|bytePossibleData|byteData))
+				&& !classes[ref].compare_exchange_weak(byteClass, byteClass|type, memory_order_relaxed));
+	};
+	// Sets the flag if no instruction has claimed the byte yet
+	auto claimByte = [&](uint32_t at, uint8_t flag)
+	{
+		uint8_t byteClass = classes[at].load(memory_order_relaxed);
+		do
+		{
+			if (byteClass & (byteInsStart|byteInsBody))
+				return false;
+		} while (!classes[at].compare_exchange_weak(byteClass, byteClass|flag, memory_order_relaxed));
+		return true;
+	};
+	// Claims the first byte of an instruction. If an instruction already has it, the byte is marked as wanted,
+	// in case that instruction is given up later.
+	auto claimStart = [&](uint32_t at)
+	{
+		uint8_t byteClass = classes[at].load(memory_order_relaxed);
+		for (;;)
+		{
+			bool claimed = byteClass & (byteInsStart|byteInsBody);
+			uint8_t newClass = byteClass | (claimed ? byteWanted : (uint8_t)byteInsStart);
+			if (classes[at].compare_exchange_weak(byteClass, newClass, memory_order_relaxed))
+				return !claimed;
+		}
+	};
+
+	unique_ptr<WorkDeque[]> deques(new WorkDeque[nThreads]);
+	vector<vector<DecodedInstruction>> results(nThreads);
+	vector<vector<Branch>> branchResults(nThreads); ///< Branches found by each worker, appended as it decodes
+	atomic<size_t> pending{1}; ///< Targets pushed but not decoded yet
+	atomic<bool> failed{false};
+	mutex errorLock;
+	const char* error = nullptr;
+
+	auto popTarget = [&](unsigned id, uint32_t& target)
+	{
+		for (unsigned i=0; i<nThreads; ++i)
+		{
+			WorkDeque& d = deques[(id+i)%nThreads];
+			lock_guard<mutex> guard(d.lock);
+			if (d.targets.empty())
+				continue;
+			if (i==0)
+			{
+				target = d.targets.back();
+				d.targets.pop_back();
+			}
+			else
+			{
+				target = d.targets.front();
+				d.targets.pop_front();
+			}
+			return true;
+		}
+		return false;
+	};
+	auto pushTarget = [&](unsigned id, uint32_t target)
+	{
+		pending++;
+		WorkDeque& d = deques[id];
+		lock_guard<mutex> guard(d.lock);
+		d.targets.push_back(target);
+	};
+	// Releases the bytes of an instruction the worker gives up, the claimed ones are from start to end.
+	// The flows that stopped at one of them are pushed again, otherwise which code is found would depend on timing.
+	auto unclaim = [&](unsigned id, uint32_t start, uint32_t end)
+	{
+		for (uint32_t i=start; i<end; ++i)
+		{
+			uint8_t flag = i==start ? byteInsStart : byteInsBody;
+			if (classes[i].fetch_and((uint8_t)~(flag|byteWanted), memory_order_relaxed) & byteWanted)
+				pushTarget(id, i);
+		}
+	};
+
+	// The code sections are decoded concurrently, each section is owned by a worker.
+	// Targets in the section being decoded stay with the current worker, others are handed to the owner of their section.
+	auto getSection = [&](uint32_t target)
+	{
+		return isAddrInternal(target) ? (unsigned)parser.getSectionAt(target) : (unsigned)-1;
+	};
+
+	// Each target is decoded linearly until the end of the flow, the branches found are pushed as new targets
+	auto decodeRun = [&](unsigned id, uint32_t ip)
+	{
+		vector<DecodedInstruction>& decoded = results[id];
+		unsigned section = getSection(ip);
+		if (section==(unsigned)-1)
+			return;
+		uint32_t sectionEnd = getCodeSectionEnd(ip);
+		while (ip<sectionEnd)
+		{
+			if (!claimStart(ip))
+				return; // Already decoded, or being decoded by another worker
+
+			InstructionInfo info;
+			const char* decodeError;
+			uint8_t iSize = decodeInstruction(virtualImage+ip, info, decodeError);
+			if (!iSize)
+				throw generateOpcodeErrorInfo(decodeError, ip);
+			if (hasMisplacedRelocations(ip, iSize, info))
+			{
+				unclaim(id, ip, ip+1);
+				return;
+			}
+			// The bytes are claimed in address order, so of two overlapping instructions at least one gets all of its bytes
+			uint32_t insEnd = min<uint32_t>(ip+iSize, nBytes);
+			for (uint32_t i=ip+1; i<insEnd; ++i)
+			{
+				if (!claimByte(i, byteInsBody))
+				{
+					unclaim(id, ip, i);
+					return; // Overlaps an instruction of another flow
+				}
+			}
+			decoded.push_back({ip, iSize, info});
+			if (info.type==insType::condJump || info.type==insType::uncondJump || info.type==insType::call)
+				branchResults[id].push_back(getBranch({ip, virtualImage+ip, iSize, &info}));
+
+			const uint8_t* ins = virtualImage+ip;
+			ip += iSize;
+			uint32_t dest, ref;
+			bool endOfFlow = getInstructionFlow(ins, ip, dest, ref);
+			if (isAddrInternal(ref))
+				markRefAtomic(ref, bytePossibleData);
+			unsigned destSection = dest!=(uint32_t)-1 ? getSection(dest) : (unsigned)-1;
+			if (destSection!=(unsigned)-1)
+			{
+				markRefAtomic(dest, byteCodeRef);
+				pushTarget(destSection==section ? id : destSection%nThreads, dest);
+			}
+			if (endOfFlow)
+				return;
+			// If we reach a referenced address that isn't a known branch dest, stop, since it could be data.
+			if (ip<sectionEnd && classes[ip].load(memory_order_relaxed) & (bytePossibleData|byteData))
+				return;
+		}
+	};
+
+	auto worker = [&](unsigned id)
+	{
+		try
+		{
+			while (!failed)
+			{
+				uint32_t target;
+				if (!popTarget(id, target))
+				{
+					if (!pending)
+						return;
+					this_thread::yield();
+					continue;
+				}
+				decodeRun(id, target);
+				pending--;
+			}
+		}
+		catch (const char* e)
+		{
+			lock_guard<mutex> guard(errorLock);
+			if (!error)
+				error = e;
+			failed = true;
+		}
+	};
+
+	deques[getSection(addr)%nThreads].targets.push_back(addr);
+	vector<thread> threads;
+	for (unsigned i=1; i<nThreads; ++i)
+		threads.emplace_back(worker, i);
+	worker(0);
+	for (thread& t : threads)
+		t.join();
+	if (error)
+		throw error;
+
+	// Merge the results
+	size_t nInstructions=0;
+	for (const vector<DecodedInstruction>& decoded : results)
+		nInstructions += decoded.size();
+	code.reserve(nInstructions, nInstructions*4);
+	for (const vector<DecodedInstruction>& decoded : results)
+		for (const DecodedInstruction& ins : decoded)
+			code.insert(ins.addr, virtualImage+ins.addr, ins.size, ins.info);
+	for (const vector<Branch>& found : branchResults)
+		branches.insert(end(branches), begin(found), end(found));
+	for (size_t i=0; i<nBytes; ++i)
+		byteClasses[i] = classes[i].load(memory_order_relaxed) & ~byteWanted;
+}
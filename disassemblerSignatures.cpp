@@ -0,0 +1,49 @@
+#include "disassembler.h"
+#include "lengthkernel.h"
+#include <chrono>
+
+using namespace std;
+
+SignatureReport Disassembler::decodeSignatures(const vector<Signature>& signatures, bool paddingBoundaries)
+{
+	auto startTime = chrono::steady_clock::now();
+	SignatureReport report = SignatureReport();
+	signaturesHash = hashSignatures(signatures, paddingBoundaries);
+	vector<uint32_t> hits;
+	for (pair<uint32_t,uint32_t>& p : codeBounds)
+		scanSignatures(virtualImage+p.first, p.second-p.first, p.first, signatures, paddingBoundaries, hits);
+	report.nHits = hits.size();
+	auto scanEndTime = chrono::steady_clock::now();
+
+	// The hits are checked by following their flows without decoding them (see isValidRoot),
+	// the lengths of the common instructions are computed in bulk beforehand by the length kernel
+	bool useKernel = isLengthKernelSupported(LengthKernel::sse41) && !hits.empty();
+	vector<uint8_t> lengths;
+	if (useKernel)
+	{
+		lengths.resize(byteClasses.size());
+		for (pair<uint32_t,uint32_t>& p : codeBounds)
+			computeCandidateLengths(virtualImage+p.first, p.second-p.first, lengths.data()+p.first);
+	}
+
+	// Each hit is checked right before it's decoded, against the code of the previous roots too
+	size_t nInstructions = code.size();
+	for (uint32_t hit : hits)
+	{
+		// The possible data isn't decoded by the usual flows either
+		if ((getByteClass(hit) & bytePossibleData) || !isValidRoot(hit, lengths))
+			continue;
+		markRef(hit, byteCodeRef);
+		readCode(hit);
+		report.nRoots++;
+	}
+	code.finalize();
+	report.nInstructions = code.size()-nInstructions;
+	if (report.nInstructions)
+		analyzed = false;
+
+	auto endTime = chrono::steady_clock::now();
+	report.scanTime = chrono::duration<double>(scanEndTime-startTime).count();
+	report.decodeTime = chrono::duration<double>(endTime-scanEndTime).count();
+	return report;
+}
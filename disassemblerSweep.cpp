@@ -0,0 +1,208 @@
+#include "disassembler.h"
+#include "lengthkernel.h"
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+
+/// Size of the chunks of code decoded independently by the linear sweep
+static const uint32_t SWEEP_CHUNK_SIZE = 64*1024;
+/// Number of bytes whose candidate lengths are computed at once by the length kernel
+static const uint32_t SWEEP_WINDOW_SIZE = 4096;
+
+/// Part of a code section decoded linearly by the sweep
+struct SweepChunk
+{
+	uint32_t start;
+	uint32_t end;
+	uint32_t sectionEnd;
+	uint32_t exit; ///< Address right after the last instruction, where the chain of instructions enters the next chunk
+	vector<uint32_t> starts; ///< Addresses of the instructions
+};
+
+void Disassembler::sweepCode(unsigned nThreads)
+{
+	auto startTime = chrono::steady_clock::now();
+	sweepReport = SweepReport();
+	sweepReport.nThreads = nThreads;
+
+	vector<SweepChunk> chunks;
+	for (pair<uint32_t,uint32_t>& p : codeBounds)
+	{
+		sweepReport.sweptBytes += p.second-p.first;
+		for (uint32_t start=p.first; start<p.second; start+=SWEEP_CHUNK_SIZE)
+			chunks.push_back({start, min(start+SWEEP_CHUNK_SIZE, p.second), p.second, 0, {}});
+	}
+	sort(begin(chunks), end(chunks), [](const SweepChunk& a, const SweepChunk& b){return a.start < b.start;});
+
+	// Size of the instruction at ip if it's valid and fits in the section, candidate is the length kernel's guess.
+	// Bytes that aren't the start of a valid instruction are skipped one by one.
+	auto instructionSize = [&](uint32_t ip, uint8_t candidate, uint32_t sectionEnd) -> uint8_t
+	{
+		const char* error;
+		uint8_t size = candidate ? candidate : decodeInstructionLength(virtualImage+ip, error);
+		return ip+size<=sectionEnd ? size : 0;
+	};
+
+	// Every chunk is swept speculatively from its first byte, as if an instruction started there.
+	// The length kernel finds the lengths of the common instructions at every offset of a window in bulk,
+	// the chain of instructions is then walked through the lengths and only the others go through the decoder.
+	// Without SIMD the kernel is slower than the decoder, since it computes a length at every offset.
+	bool useKernel = isLengthKernelSupported(LengthKernel::sse41);
+	atomic<size_t> nextChunk{0};
+	auto worker = [&]()
+	{
+		unique_ptr<uint8_t[]> lengths(new uint8_t[SWEEP_WINDOW_SIZE]);
+		for (size_t i=nextChunk++; i<chunks.size(); i=nextChunk++)
+		{
+			SweepChunk& chunk = chunks[i];
+			uint32_t ip = chunk.start;
+			while (ip<chunk.end)
+			{
+				uint32_t windowStart = ip, windowEnd = min(ip+SWEEP_WINDOW_SIZE, chunk.end);
+				if (useKernel)
+					computeCandidateLengths(virtualImage+windowStart, windowEnd-windowStart, lengths.get());
+				while (ip<windowEnd)
+				{
+					uint8_t size = instructionSize(ip, useKernel ? lengths[ip-windowStart] : 0, chunk.sectionEnd);
+					if (!size)
+					{
+						ip++;
+						continue;
+					}
+					chunk.starts.push_back(ip);
+					ip += size;
+				}
+			}
+			chunk.exit = ip;
+		}
+	};
+	vector<thread> threads;
+	for (unsigned i=1; i<nThreads; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (thread& t : threads)
+		t.join();
+
+	// The previous chunk tells where the chain of instructions really enters a chunk. Decode from there until
+	// we land on an instruction the chunk found by itself, x86 length chains converge after a few instructions.
+	// The chunk's instructions before that point were misaligned, they're replaced.
+	for (size_t k=1; k<chunks.size(); ++k)
+	{
+		SweepChunk& prev = chunks[k-1];
+		SweepChunk& chunk = chunks[k];
+		if (prev.end!=chunk.start || prev.sectionEnd!=chunk.sectionEnd)
+			continue;
+
+		vector<uint32_t> chain;
+		uint32_t ip = prev.exit;
+		auto it = begin(chunk.starts);
+		bool converged=false;
+		for (;;)
+		{
+			it = lower_bound(it, end(chunk.starts), ip);
+			if (it!=end(chunk.starts) && *it==ip)
+			{
+				converged=true;
+				break;
+			}
+			if (ip>=chunk.end)
+				break;
+			uint8_t size = instructionSize(ip, 0, chunk.sectionEnd);
+			if (!size)
+			{
+				ip++;
+				continue;
+			}
+			chain.push_back(ip);
+			ip += size;
+			sweepReport.nResynced++;
+		}
+		chunk.starts.erase(begin(chunk.starts), it);
+		chunk.starts.insert(begin(chunk.starts), begin(chain), end(chain));
+		if (!converged)
+			chunk.exit = ip;
+	}
+
+	// Only the instructions that survived the resync are fully decoded, in parallel too
+	vector<vector<DecodedInstruction>> decoded(chunks.size());
+	nextChunk = 0;
+	auto decoder = [&]()
+	{
+		for (size_t i=nextChunk++; i<chunks.size(); i=nextChunk++)
+		{
+			decoded[i].reserve(chunks[i].starts.size());
+			for (uint32_t start : chunks[i].starts)
+			{
+				InstructionInfo info;
+				const char* error;
+				uint8_t size = decodeInstruction(virtualImage+start, info, error);
+				if (size)
+					decoded[i].push_back({start, size, info});
+			}
+			vector<uint32_t>().swap(chunks[i].starts);
+		}
+	};
+	threads.clear();
+	for (unsigned i=1; i<nThreads; ++i)
+		threads.emplace_back(decoder);
+	decoder();
+	for (thread& t : threads)
+		t.join();
+
+	size_t nSwept=0;
+	for (const vector<DecodedInstruction>& d : decoded)
+		nSwept += d.size();
+	sweptCode.reserve(nSwept);
+	for (vector<DecodedInstruction>& d : decoded)
+	{
+		sweptCode.insert(end(sweptCode), begin(d), end(d));
+		vector<DecodedInstruction>().swap(d);
+	}
+	sweepReport.nSwept = nSwept;
+	sweepReport.sweepTime = chrono::duration<double>(chrono::steady_clock::now()-startTime).count();
+}
+
+void Disassembler::readCodeLinear(uint32_t addr, unsigned nThreads)
+{
+	// The passes decoding again after finding noreturn functions reuse the same sweep
+	if (sweptCode.empty())
+		sweepCode(nThreads);
+	auto startTime = chrono::steady_clock::now();
+
+	// The flow validates the swept instructions, readInstruction takes those it reaches and only decodes the rest.
+	// What it doesn't reach is pruned.
+	sweptHint = 0;
+	readCode(addr);
+	code.finalize();
+	auto endTime = chrono::steady_clock::now();
+
+	// Both are sorted by address
+	sweepReport.nAgreed = 0;
+	sweepReport.agreedBytes = 0;
+	sweepReport.reachableBytes = 0;
+	size_t s=0;
+	for (size_t i=0; i<code.size(); ++i)
+	{
+		uint32_t insAddr = code.getAddr(i);
+		while (s<sweptCode.size() && sweptCode[s].addr<insAddr)
+			s++;
+		sweepReport.reachableBytes += code.getSize(i);
+		if (s<sweptCode.size() && sweptCode[s].addr==insAddr)
+		{
+			sweepReport.nAgreed++;
+			sweepReport.agreedBytes += code.getSize(i);
+		}
+	}
+	sweepReport.nReachable = code.size();
+	sweepReport.nPruned = sweepReport.nSwept - sweepReport.nAgreed;
+	sweepReport.descentTime += chrono::duration<double>(endTime-startTime).count();
+}
+
+const SweepReport& Disassembler::getSweepReport()
+{
+	return sweepReport;
+}
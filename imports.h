@@ -0,0 +1,17 @@
+#ifndef IMPORTS_H_INCLUDED
+#define IMPORTS_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+
+/// Function imported from a DLL, the loader writes its address in an IAT slot
+struct Import
+{
+    uint32_t slot; ///< RVA of the IAT slot
+    std::string dll;
+    std::string name; ///< Empty if the function is imported by ordinal
+    uint16_t ordinal; ///< Only valid if name is empty
+    bool noReturn; ///< The function never returns to its caller, like ExitProcess
+};
+
+#endif // IMPORTS_H_INCLUDED
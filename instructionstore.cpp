@@ -0,0 +1,210 @@
+#include "instructionstore.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+InstructionStore::InstructionStore(uint32_t imageSize)
+: addrs{}, sizes{}, infos{}, offsets{}, arena{}, starts((imageSize+63)/64), nSorted{0}, nUnusedBytes{0}
+{
+}
+
+void InstructionStore::reserve(size_t nInstructions, size_t nBytes)
+{
+	addrs.reserve(nInstructions);
+	sizes.reserve(nInstructions);
+	infos.reserve(nInstructions);
+	offsets.reserve(nInstructions);
+	arena.reserve(nBytes);
+}
+
+void InstructionStore::setStart(uint32_t addr, bool isStart)
+{
+	size_t word = addr/64;
+	if (word >= starts.size())
+	{
+		if (!isStart)
+			return;
+		starts.resize(max(word+1, starts.size()*2));
+	}
+	if (isStart)
+		starts[word] |= 1ULL<<(addr%64);
+	else
+		starts[word] &= ~(1ULL<<(addr%64));
+}
+
+void InstructionStore::insert(uint32_t addr, const uint8_t* bytes, uint8_t size, const InstructionInfo& info)
+{
+	size_t index = find(addr);
+	if (index == npos)
+	{
+		addrs.push_back(addr);
+		sizes.push_back(size);
+		infos.push_back(info);
+		offsets.push_back(arena.size());
+		arena.insert(arena.end(), bytes, bytes+size);
+		setStart(addr, true);
+		return;
+	}
+
+	// The old bytes are left unused in the arena if the new ones don't fit, finalize() will drop them
+	if (size > sizes[index])
+	{
+		nUnusedBytes += sizes[index];
+		offsets[index] = arena.size();
+		arena.insert(arena.end(), bytes, bytes+size);
+	}
+	else
+	{
+		nUnusedBytes += sizes[index]-size;
+		memcpy(&arena[offsets[index]], bytes, size);
+	}
+	sizes[index] = size;
+	infos[index] = info;
+}
+
+void InstructionStore::remove(uint32_t addr)
+{
+	size_t index = find(addr);
+	if (index == npos)
+		return;
+	nUnusedBytes += sizes[index];
+	addrs.erase(addrs.begin()+index);
+	sizes.erase(sizes.begin()+index);
+	infos.erase(infos.begin()+index);
+	offsets.erase(offsets.begin()+index);
+	if (index < nSorted)
+		nSorted--;
+	setStart(addr, false);
+}
+
+void InstructionStore::swapWithNext(size_t index)
+{
+	uint32_t addr = addrs[index];
+	setStart(addrs[index+1], false);
+	swap(sizes[index], sizes[index+1]);
+	swap(infos[index], infos[index+1]);
+	swap(offsets[index], offsets[index+1]);
+	addrs[index+1] = addr+sizes[index];
+	setStart(addrs[index+1], true);
+}
+
+void InstructionStore::finalize()
+{
+	size_t n = addrs.size();
+	if (nSorted == n && !nUnusedBytes)
+		return;
+
+	// Sort the new instructions by address, and merge them with the sorted ones
+	vector<uint32_t> order(n);
+	for (size_t i=0; i<n; ++i)
+		order[i] = i;
+	auto byAddr = [this](uint32_t a, uint32_t b){return addrs[a] < addrs[b];};
+	sort(order.begin()+nSorted, order.end(), byAddr);
+	inplace_merge(order.begin(), order.begin()+nSorted, order.end(), byAddr);
+
+	// Rebuild the arrays in that order, so the bytes are contiguous in the arena
+	vector<uint32_t> newAddrs(n), newOffsets(n);
+	vector<uint8_t> newSizes(n), newArena;
+	vector<InstructionInfo> newInfos(n);
+	newArena.reserve(arena.size()-nUnusedBytes);
+	for (size_t i=0; i<n; ++i)
+	{
+		uint32_t old = order[i];
+		newAddrs[i] = addrs[old];
+		newSizes[i] = sizes[old];
+		newInfos[i] = infos[old];
+		newOffsets[i] = newArena.size();
+		newArena.insert(newArena.end(), arena.begin()+offsets[old], arena.begin()+offsets[old]+sizes[old]);
+	}
+	addrs.swap(newAddrs);
+	sizes.swap(newSizes);
+	infos.swap(newInfos);
+	offsets.swap(newOffsets);
+	arena.swap(newArena);
+	nSorted = n;
+	nUnusedBytes = 0;
+}
+
+void InstructionStore::clear()
+{
+	addrs.clear();
+	sizes.clear();
+	infos.clear();
+	offsets.clear();
+	arena.clear();
+	fill(starts.begin(), starts.end(), 0);
+	nSorted = 0;
+	nUnusedBytes = 0;
+}
+
+bool InstructionStore::contains(uint32_t addr) const
+{
+	size_t word = addr/64;
+	return word < starts.size() && (starts[word]>>(addr%64) & 1);
+}
+
+size_t InstructionStore::find(uint32_t addr) const
+{
+	if (!contains(addr))
+		return npos;
+	auto sortedEnd = addrs.begin()+nSorted;
+	auto it = lower_bound(addrs.begin(), sortedEnd, addr);
+	if (it != sortedEnd && *it == addr)
+		return it-addrs.begin();
+	it = std::find(sortedEnd, addrs.end(), addr);
+	if (it != addrs.end())
+		return it-addrs.begin();
+	return npos;
+}
+
+size_t InstructionStore::size() const
+{
+	return addrs.size();
+}
+
+bool InstructionStore::empty() const
+{
+	return addrs.empty();
+}
+
+uint32_t InstructionStore::getAddr(size_t index) const
+{
+	return addrs[index];
+}
+
+uint8_t InstructionStore::getSize(size_t index) const
+{
+	return sizes[index];
+}
+
+const uint8_t* InstructionStore::getBytes(size_t index) const
+{
+	return arena.data()+offsets[index];
+}
+
+const InstructionInfo& InstructionStore::getInfo(size_t index) const
+{
+	return infos[index];
+}
+
+InstructionRef InstructionStore::operator[](size_t index) const
+{
+	return {addrs[index], arena.data()+offsets[index], sizes[index], &infos[index]};
+}
+
+InstructionStore::const_iterator InstructionStore::begin() const
+{
+	return const_iterator(*this, 0);
+}
+
+InstructionStore::const_iterator InstructionStore::end() const
+{
+	return const_iterator(*this, addrs.size());
+}
+
+size_t InstructionStore::getMemoryUsage() const
+{
+	return addrs.capacity()*sizeof(uint32_t) + sizes.capacity() + infos.capacity()*sizeof(InstructionInfo)
+			+ offsets.capacity()*sizeof(uint32_t) + arena.capacity() + starts.capacity()*sizeof(uint64_t);
+}
@@ -0,0 +1,87 @@
+#ifndef INSTRUCTIONSTORE_H
+#define INSTRUCTIONSTORE_H
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include "decoder.h"
+
+/// View of an instruction of an InstructionStore. Invalidated when the store is modified.
+struct InstructionRef
+{
+	uint32_t addr;
+	const uint8_t* bytes;
+	uint8_t size;
+	const InstructionInfo* info;
+
+	const uint8_t* opcode() const {return bytes+info->nPrefixes;} ///< First byte after the prefixes
+	uint8_t modrm() const {return bytes[info->modrmOffset];} ///< Only valid if info->modrmOffset isn't 0
+	uint8_t sib() const {return bytes[info->sibOffset];} ///< Only valid if info->sibOffset isn't 0
+	const uint8_t* begin() const {return bytes;}
+	const uint8_t* end() const {return bytes+size;}
+	uint8_t operator[](unsigned i) const {return bytes[i];}
+	std::vector<uint8_t> toVector() const {return std::vector<uint8_t>(bytes, bytes+size);}
+};
+
+/// Instructions sorted by address, stored as arrays of addresses, sizes, attributes, and offsets in a single arena
+/// holding the bytes of all the instructions, in the same order.
+/// Instructions inserted after the last finalize() are kept unsorted at the end until the next finalize(),
+/// so indexes stay valid while inserting or editing. Only finalize() and remove() change the indexes.
+class InstructionStore
+{
+	public:
+		static const size_t npos = (size_t)-1;
+
+		class const_iterator
+		{
+			public:
+				const_iterator(const InstructionStore& Store, size_t Index) : store(&Store), index{Index} {}
+				InstructionRef operator*() const {return (*store)[index];}
+				const_iterator& operator++() {++index; return *this;}
+				bool operator!=(const const_iterator& other) const {return index!=other.index;}
+				bool operator==(const const_iterator& other) const {return index==other.index;}
+			private:
+				const InstructionStore* store;
+				size_t index;
+		};
+
+		/// @param imageSize End of the address space, the store grows if an instruction is inserted past it
+		InstructionStore(uint32_t imageSize=0);
+		void reserve(size_t nInstructions, size_t nBytes);
+		/// Adds an instruction, or replaces the instruction starting at the same address
+		void insert(uint32_t addr, const uint8_t* bytes, uint8_t size, const InstructionInfo& info);
+		void remove(uint32_t addr); ///< Removes the instruction starting at addr, if any. O(n)
+		/// Swaps the instruction at index with the one at index+1, which must start right after it.
+		/// The second one then starts at the address of the first, the order by address is kept. O(1)
+		void swapWithNext(size_t index);
+		void finalize(); ///< Sorts the instructions inserted since the last call and compacts the arena
+		void clear();
+
+		bool contains(uint32_t addr) const; ///< Is there an instruction starting at addr. O(1)
+		size_t find(uint32_t addr) const; ///< Index of the instruction starting at addr, or npos
+		size_t size() const;
+		bool empty() const;
+		uint32_t getAddr(size_t index) const;
+		uint8_t getSize(size_t index) const;
+		const uint8_t* getBytes(size_t index) const;
+		const InstructionInfo& getInfo(size_t index) const;
+		InstructionRef operator[](size_t index) const;
+		const_iterator begin() const;
+		const_iterator end() const;
+		size_t getMemoryUsage() const; ///< Number of bytes allocated by the store
+
+	private:
+		void setStart(uint32_t addr, bool isStart);
+
+	private:
+		std::vector<uint32_t> addrs;
+		std::vector<uint8_t> sizes;
+		std::vector<InstructionInfo> infos;
+		std::vector<uint32_t> offsets; ///< Offset of the bytes of each instruction in the arena
+		std::vector<uint8_t> arena;
+		std::vector<uint64_t> starts; ///< Bitmap of the addresses where an instruction starts
+		size_t nSorted; ///< The first nSorted instructions are sorted, the others were inserted since finalize()
+		size_t nUnusedBytes; ///< Bytes of the arena left behind by edits and removals
+};
+
+#endif // INSTRUCTIONSTORE_H
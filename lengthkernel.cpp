@@ -0,0 +1,239 @@
+#include "lengthkernel.h"
+#include "decoder.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define LENGTH_KERNEL_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+/// Flag of the opcode lengths, set when a ModRM byte follows the opcode
+static const uint8_t LENGTH_HAS_MODRM = 0x80;
+
+/// Lengths derived from the decoder's tables, so the kernel doesn't have its own copy of the opcode map
+struct LengthTables
+{
+	/// Length of the opcode and its immediates, with LENGTH_HAS_MODRM. 0 if the full decoder is needed.
+	alignas(16) uint8_t opcode[256];
+	/// Length of the ModRM byte, SIB byte and displacement, indexed by mod<<3|rm
+	alignas(16) uint8_t modrm[32];
+
+	LengthTables()
+	{
+		for (unsigned op=0; op<256; ++op)
+		{
+			uint8_t attr = getOneByteOpcodeAttr(op);
+			// Group 3 immediates depend on the reg field, and FF, C4, C5 and 62 have forms the decoder rejects
+			if ((attr & (opPrefix|opInvalid|opGroup3)) || op==0xFF || op==0xC4 || op==0xC5 || op==0x62)
+			{
+				opcode[op] = 0;
+				continue;
+			}
+			uint8_t length = 1;
+			if (attr & opImm8)
+				length += 1;
+			if (attr & opImm16)
+				length += 2;
+			if (attr & opImmZ)
+				length += 4;
+			if (attr & opMoffs)
+				length += 4;
+			opcode[op] = length | ((attr & opModRM) ? LENGTH_HAS_MODRM : 0);
+		}
+		for (unsigned i=0; i<32; ++i)
+			modrm[i] = getModRM32Size((i>>3)<<6 | (i&7));
+	}
+};
+
+static const LengthTables tables;
+
+static inline uint8_t candidateLength(const uint8_t* code)
+{
+	uint8_t base = tables.opcode[code[0]];
+	if (!(base & LENGTH_HAS_MODRM))
+		return base;
+	uint8_t modrm = code[1];
+	uint8_t length = (base & ~LENGTH_HAS_MODRM) + tables.modrm[(modrm>>6)<<3 | (modrm&7)];
+	if ((modrm&0xC7)==0x04 && (code[2]&7)==5) // SIB without a base, followed by a full displacement
+		length += 4;
+	return length;
+}
+
+static void computeLengthsScalar(const uint8_t* code, size_t n, uint8_t* lengths)
+{
+	for (size_t i=0; i<n; ++i)
+		lengths[i] = candidateLength(code+i);
+}
+
+#ifdef LENGTH_KERNEL_SIMD
+/// Each byte of the result is the entry of a 256 bytes table indexed by the bytes of v.
+/// One pshufb per row of 16 entries, the row of each byte is selected by its high nibble.
+__attribute__((target("sse4.1")))
+static inline __m128i lookup256(const __m128i* table, __m128i v)
+{
+	const __m128i lowMask = _mm_set1_epi8(0x0F);
+	__m128i low = _mm_and_si128(v, lowMask);
+	__m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), lowMask);
+	__m128i result = _mm_setzero_si128();
+	for (int row=0; row<16; ++row)
+	{
+		__m128i inRow = _mm_cmpeq_epi8(high, _mm_set1_epi8(row));
+		result = _mm_or_si128(result, _mm_and_si128(inRow, _mm_shuffle_epi8(_mm_load_si128(table+row), low)));
+	}
+	return result;
+}
+
+__attribute__((target("sse4.1")))
+static void computeLengthsSSE41(const uint8_t* code, size_t n, uint8_t* lengths)
+{
+	const __m128i* opcodeTable = (const __m128i*)tables.opcode;
+	const __m128i modrmLow = _mm_load_si128((const __m128i*)tables.modrm);
+	const __m128i modrmHigh = _mm_load_si128((const __m128i*)tables.modrm+1);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i=0;
+	for (; i+16<=n; i+=16)
+	{
+		__m128i op = _mm_loadu_si128((const __m128i*)(code+i));
+		__m128i modrm = _mm_loadu_si128((const __m128i*)(code+i+1));
+		__m128i sib = _mm_loadu_si128((const __m128i*)(code+i+2));
+
+		__m128i base = lookup256(opcodeTable, op);
+		__m128i hasModRM = _mm_cmpgt_epi8(zero, base);
+		base = _mm_and_si128(base, _mm_set1_epi8(0x7F));
+
+		// mod<<3|rm, the entries 16 to 31 come from the second half of the table
+		__m128i index = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(modrm, 3), _mm_set1_epi8(0x18)),
+									_mm_and_si128(modrm, _mm_set1_epi8(0x07)));
+		__m128i modrmSize = _mm_blendv_epi8(_mm_shuffle_epi8(modrmLow, index),
+											_mm_shuffle_epi8(modrmHigh, _mm_and_si128(index, _mm_set1_epi8(0x0F))),
+											_mm_slli_epi16(index, 3));
+		__m128i noBase = _mm_and_si128(
+			_mm_cmpeq_epi8(_mm_and_si128(modrm, _mm_set1_epi8((char)0xC7)), _mm_set1_epi8(0x04)),
+			_mm_cmpeq_epi8(_mm_and_si128(sib, _mm_set1_epi8(0x07)), _mm_set1_epi8(0x05)));
+		modrmSize = _mm_add_epi8(modrmSize, _mm_and_si128(noBase, _mm_set1_epi8(4)));
+
+		__m128i length = _mm_add_epi8(base, _mm_and_si128(hasModRM, modrmSize));
+		length = _mm_andnot_si128(_mm_cmpeq_epi8(base, zero), length);
+		_mm_storeu_si128((__m128i*)(lengths+i), length);
+	}
+	computeLengthsScalar(code+i, n-i, lengths+i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lookup256(const __m256i* table, __m256i v)
+{
+	const __m256i lowMask = _mm256_set1_epi8(0x0F);
+	__m256i low = _mm256_and_si256(v, lowMask);
+	__m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+	__m256i result = _mm256_setzero_si256();
+	for (int row=0; row<16; ++row)
+	{
+		__m256i inRow = _mm256_cmpeq_epi8(high, _mm256_set1_epi8(row));
+		result = _mm256_or_si256(result, _mm256_and_si256(inRow, _mm256_shuffle_epi8(table[row], low)));
+	}
+	return result;
+}
+
+/// Same as the SSE4.1 kernel on 32 bytes, pshufb works on each 128-bit lane so the tables are in both lanes
+__attribute__((target("avx2")))
+static void computeLengthsAVX2(const uint8_t* code, size_t n, uint8_t* lengths)
+{
+	__m256i opcodeTable[16];
+	for (int row=0; row<16; ++row)
+		opcodeTable[row] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)tables.opcode+row));
+	const __m256i modrmLow = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)tables.modrm));
+	const __m256i modrmHigh = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)tables.modrm+1));
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i=0;
+	for (; i+32<=n; i+=32)
+	{
+		__m256i op = _mm256_loadu_si256((const __m256i*)(code+i));
+		__m256i modrm = _mm256_loadu_si256((const __m256i*)(code+i+1));
+		__m256i sib = _mm256_loadu_si256((const __m256i*)(code+i+2));
+
+		__m256i base = lookup256(opcodeTable, op);
+		__m256i hasModRM = _mm256_cmpgt_epi8(zero, base);
+		base = _mm256_and_si256(base, _mm256_set1_epi8(0x7F));
+
+		__m256i index = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(modrm, 3), _mm256_set1_epi8(0x18)),
+										_mm256_and_si256(modrm, _mm256_set1_epi8(0x07)));
+		__m256i modrmSize = _mm256_blendv_epi8(_mm256_shuffle_epi8(modrmLow, index),
+									_mm256_shuffle_epi8(modrmHigh, _mm256_and_si256(index, _mm256_set1_epi8(0x0F))),
+									_mm256_slli_epi16(index, 3));
+		__m256i noBase = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_and_si256(modrm, _mm256_set1_epi8((char)0xC7)), _mm256_set1_epi8(0x04)),
+			_mm256_cmpeq_epi8(_mm256_and_si256(sib, _mm256_set1_epi8(0x07)), _mm256_set1_epi8(0x05)));
+		modrmSize = _mm256_add_epi8(modrmSize, _mm256_and_si256(noBase, _mm256_set1_epi8(4)));
+
+		__m256i length = _mm256_add_epi8(base, _mm256_and_si256(hasModRM, modrmSize));
+		length = _mm256_andnot_si256(_mm256_cmpeq_epi8(base, zero), length);
+		_mm256_storeu_si256((__m256i*)(lengths+i), length);
+	}
+	computeLengthsScalar(code+i, n-i, lengths+i);
+}
+#endif
+
+bool isLengthKernelSupported(LengthKernel kernel)
+{
+	switch (kernel)
+	{
+	case LengthKernel::best:
+	case LengthKernel::scalar:
+		return true;
+#ifdef LENGTH_KERNEL_SIMD
+	case LengthKernel::sse41:
+		return __builtin_cpu_supports("sse4.1");
+	case LengthKernel::avx2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+/// The fastest kernel the CPU supports
+static LengthKernel getBestKernel()
+{
+	static const LengthKernel best = isLengthKernelSupported(LengthKernel::avx2) ? LengthKernel::avx2
+									: isLengthKernelSupported(LengthKernel::sse41) ? LengthKernel::sse41
+									: LengthKernel::scalar;
+	return best;
+}
+
+void computeCandidateLengths(const uint8_t* code, size_t n, uint8_t* lengths, LengthKernel kernel)
+{
+	if (kernel==LengthKernel::best)
+		kernel = getBestKernel();
+	else if (!isLengthKernelSupported(kernel))
+		throw "Length kernel not supported by this CPU";
+
+	switch (kernel)
+	{
+#ifdef LENGTH_KERNEL_SIMD
+	case LengthKernel::avx2:
+		computeLengthsAVX2(code, n, lengths);
+		break;
+	case LengthKernel::sse41:
+		computeLengthsSSE41(code, n, lengths);
+		break;
+#endif
+	default:
+		computeLengthsScalar(code, n, lengths);
+	}
+}
+
+const char* getLengthKernelName(LengthKernel kernel)
+{
+	if (kernel==LengthKernel::best)
+		kernel = getBestKernel();
+	switch (kernel)
+	{
+	case LengthKernel::avx2:
+		return "AVX2";
+	case LengthKernel::sse41:
+		return "SSE4.1";
+	default:
+		return "scalar";
+	}
+}
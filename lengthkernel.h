@@ -0,0 +1,27 @@
+#ifndef LENGTHKERNEL_H
+#define LENGTHKERNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Implementations of the length kernel, the best one supported by the CPU is used by default
+enum class LengthKernel
+{
+	best,
+	scalar,
+	sse41,
+	avx2
+};
+
+/// The kernel reads this many bytes past the n bytes it computes the lengths of.
+/// The virtual image of PEParser stays readable that far past its end.
+static const unsigned LENGTH_KERNEL_MARGIN = 2;
+
+/// Computes in bulk the length of the instruction that would start at each of the n first bytes of code.
+/// Only the common instructions are handled : no prefixes, one-byte opcodes, 32-bit addressing.
+/// The length is 0 when the instruction needs the full decoder (decodeInstructionLength), including invalid ones.
+void computeCandidateLengths(const uint8_t* code, size_t n, uint8_t* lengths, LengthKernel kernel=LengthKernel::best);
+bool isLengthKernelSupported(LengthKernel kernel);
+const char* getLengthKernelName(LengthKernel kernel=LengthKernel::best);
+
+#endif // LENGTHKERNEL_H
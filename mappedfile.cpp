@@ -0,0 +1,241 @@
+#include "mappedfile.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+MappedFile::MappedFile(std::string path)
+: data{}, dataSize{}, isMapped{false}
+#ifndef _WIN32
+, fd{-1}
+#endif
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+							FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file==INVALID_HANDLE_VALUE)
+		throw "Can't open file";
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		throw "Can't get the size of the file";
+	}
+	dataSize = size.QuadPart;
+	if (!dataSize)
+	{
+		CloseHandle(file);
+		throw "Empty file";
+	}
+	// The view keeps the mapping alive, we don't need the handles after that
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping)
+		throw "Can't map file";
+	data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!data)
+		throw "Can't map file";
+#else
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd<0)
+		throw "Can't open file";
+	struct stat st;
+	if (fstat(fd, &st)<0)
+	{
+		close(fd);
+		throw "Can't get the size of the file";
+	}
+	dataSize = st.st_size;
+	if (!dataSize)
+	{
+		close(fd);
+		throw "Empty file";
+	}
+	void* map = mmap(nullptr, dataSize, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map==MAP_FAILED)
+	{
+		close(fd);
+		throw "Can't map file";
+	}
+	data = (uint8_t*)map;
+#endif
+	isMapped=true;
+}
+
+MappedFile::~MappedFile()
+{
+	if (isMapped)
+	{
+	#ifdef _WIN32
+		UnmapViewOfFile(data);
+	#else
+		munmap(data, dataSize);
+	#endif
+	}
+	else
+		freePages(data, dataSize);
+#ifndef _WIN32
+	close(fd);
+#endif
+}
+
+uint8_t*& MappedFile::getData()
+{
+	return data;
+}
+
+size_t& MappedFile::getSize()
+{
+	return dataSize;
+}
+
+size_t MappedFile::mapInto(uint8_t* dest, size_t offset, size_t size)
+{
+#ifdef _WIN32
+	// Views can't be placed inside an existing allocation, the caller has to copy.
+	(void)dest; (void)offset; (void)size;
+	return 0;
+#else
+	size_t pageSize = getPageSize();
+	if ((uintptr_t)dest % pageSize || offset % pageSize || offset >= dataSize)
+		return 0;
+	// Never map past the end of the file, touching those pages would fault
+	size_t mapSize = min(size, dataSize-offset);
+	mapSize -= mapSize % pageSize;
+	if (!mapSize)
+		return 0;
+	if (mmap(dest, mapSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, offset)==MAP_FAILED)
+		return 0;
+	return mapSize;
+#endif
+}
+
+void MappedFile::resize(size_t newSize)
+{
+	if (isMapped)
+	{
+		uint8_t* newData = allocPages(newSize);
+		memcpy(newData, data, min(dataSize, newSize));
+	#ifdef _WIN32
+		UnmapViewOfFile(data);
+	#else
+		munmap(data, dataSize);
+	#endif
+		data = newData;
+		isMapped = false;
+	}
+	else
+		data = reallocPages(data, dataSize, newSize);
+	dataSize = newSize;
+}
+
+size_t getPageSize()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+uint8_t* allocPages(size_t size)
+{
+#ifdef _WIN32
+	void* ptr = VirtualAlloc(NULL, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+	if (!ptr)
+		throw "Out of memory";
+#else
+	void* ptr = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ptr==MAP_FAILED)
+		throw "Out of memory";
+#endif
+	return (uint8_t*)ptr;
+}
+
+uint8_t* reallocPages(uint8_t* ptr, size_t oldSize, size_t newSize)
+{
+	uint8_t* newPtr = allocPages(newSize);
+	memcpy(newPtr, ptr, min(oldSize, newSize));
+	freePages(ptr, oldSize);
+	return newPtr;
+}
+
+void freePages(uint8_t* ptr, size_t size)
+{
+	if (!ptr)
+		return;
+#ifdef _WIN32
+	(void)size;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, size);
+#endif
+}
+
+uint8_t* reservePages(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+	(void)alignment; // No transparent huge pages, the allocation granularity is enough
+	void* ptr = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+	if (!ptr)
+		throw "Out of memory";
+	return (uint8_t*)ptr;
+#else
+	// Reserve enough to find an aligned start, then give back what's around it
+	size_t pageSize = getPageSize();
+	if (alignment < pageSize)
+		alignment = pageSize;
+	size_t mapSize = size + alignment - pageSize;
+	void* ptr = mmap(nullptr, mapSize, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (ptr==MAP_FAILED)
+		throw "Out of memory";
+	uint8_t* start = (uint8_t*)ptr;
+	uint8_t* aligned = (uint8_t*)(((uintptr_t)start + alignment-1) / alignment * alignment);
+	size_t mapEnd = (size + pageSize-1) / pageSize * pageSize;
+	if (aligned > start)
+		munmap(start, aligned-start);
+	if (start+mapSize > aligned+mapEnd)
+		munmap(aligned+mapEnd, start+mapSize - (aligned+mapEnd));
+	return aligned;
+#endif
+}
+
+void commitPages(uint8_t* ptr, size_t size)
+{
+	if (!size)
+		return;
+	size_t pageSize = getPageSize();
+	uintptr_t start = (uintptr_t)ptr / pageSize * pageSize;
+	uintptr_t end = ((uintptr_t)ptr + size + pageSize-1) / pageSize * pageSize;
+#ifdef _WIN32
+	if (!VirtualAlloc((void*)start, end-start, MEM_COMMIT, PAGE_READWRITE))
+		throw "Out of memory";
+#else
+	if (mprotect((void*)start, end-start, PROT_READ|PROT_WRITE))
+		throw "Out of memory";
+#endif
+}
+
+void adviseHugePages(uint8_t* ptr, size_t size)
+{
+#if defined(MADV_HUGEPAGE)
+	uintptr_t start = ((uintptr_t)ptr + HUGE_PAGE_SIZE-1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	uintptr_t end = ((uintptr_t)ptr + size) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	if (end > start)
+		madvise((void*)start, end-start, MADV_HUGEPAGE);
+#else
+	(void)ptr; (void)size;
+#endif
+}
@@ -0,0 +1,55 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/// Private memory mapping of a whole file. Nothing is read until a page is touched, and pages
+/// are shared with the page cache until they are written to (copy-on-write).
+class MappedFile
+{
+	public:
+		MappedFile(std::string path); ///< Throws a const char* if the file can't be opened or mapped
+		MappedFile(const MappedFile&)=delete;
+		~MappedFile();
+		void operator=(const MappedFile&)=delete;
+
+		uint8_t*& getData(); ///< Start of the file's data. May change at any time (see resize())
+		size_t& getSize(); ///< Size of the file's data. May change at any time (see resize())
+		/// Maps the file's pages starting at offset over dest, copy-on-write.
+		/// Only whole pages are mapped, both dest and offset must be page aligned.
+		/// @return Number of bytes mapped (a multiple of the page size), the caller must copy the rest.
+		size_t mapInto(uint8_t* dest, size_t offset, size_t size);
+		/// Grows the data to newSize bytes, moving it out of the file mapping into anonymous memory.
+		void resize(size_t newSize);
+
+	private:
+		uint8_t* data; // May change at any time
+		size_t dataSize; // May change at any time
+		bool isMapped; // False once the data was moved out of the mapping by resize()
+		#ifndef _WIN32
+		int fd; // Kept open for mapInto()
+		#endif
+};
+
+size_t getPageSize();
+/// Allocates size bytes of zeroed memory. Pages are only backed by the system when first written to.
+uint8_t* allocPages(size_t size);
+/// Moves the content of ptr to a new allocation of newSize bytes, and frees ptr.
+uint8_t* reallocPages(uint8_t* ptr, size_t oldSize, size_t newSize);
+/// Frees memory from allocPages() or reservePages(), size is the whole size allocated or reserved
+void freePages(uint8_t* ptr, size_t size);
+
+/// Size of the transparent huge pages, the ranges given to adviseHugePages() should be aligned on it
+static const size_t HUGE_PAGE_SIZE = 2*1024*1024;
+/// Reserves size bytes of address space. Nothing can be accessed until it's committed with commitPages().
+/// @param alignment Alignment of the start of the range, 0 for the page size
+uint8_t* reservePages(size_t size, size_t alignment=0);
+/// Makes the pages covering size bytes at ptr, in a reserved range, readable and writable.
+/// They read as zeroes and are only backed by the system when first written to. Committing again is harmless.
+void commitPages(uint8_t* ptr, size_t size);
+/// Asks for the whole huge pages in the range to be backed by transparent huge pages. Only a hint, may do nothing.
+void adviseHugePages(uint8_t* ptr, size_t size);
+
+#endif // MAPPEDFILE_H
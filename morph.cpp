@@ -0,0 +1,250 @@
+#include "morph.h"
+#include "mappedfile.h"
+#include "peparser.h"
+#include "disassembler.h"
+#include "transform.h"
+#include "options.h"
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+/// Runs the transforms selected on the command line and writes the result
+static void transformFile(Disassembler& disasm, PEParser& parser, string outPath, unsigned seed, ostream& log)
+{
+	Transform trans(disasm, parser, argRand, seed);
+
+	if (argSubstitute)
+	{
+		log << "Substitute...";
+		unsigned nOps=trans.substitute();
+		log << "OK ("<<nOps<<" instructions)\n";
+	}
+
+	if (argShuffle)
+	{
+		log << "Shuffle...";
+		unsigned nOps=trans.shuffle();
+		log << "OK ("<<nOps<<" shuffles)\n";
+	}
+
+	if (!argEncryptSectionName.empty())
+	{
+		log << "Encrypting...";
+		unsigned short decryptorUsed=trans.encryptSection(argEncryptSectionName);
+		if (decryptorUsed)
+			log << "OK (decryptor "<<decryptorUsed<<")\n";
+		else
+			log << "OK\n";
+	}
+
+	log << "Rebuilding...";
+	/** DONE:
+	/// Have the disassembler implement a updataVirtualImageFromInstructions()
+	/// Have the ObjectParser implement a updateDataFromVirtualImage() that memcpy back the headers and sections.
+	**/
+	/// TODO:
+	/// We still don't handle changing the size, since we can't safely rebuild without relocations, or without
+	/// being absolutely positive we decoded all the instructions/data references and can fix them.
+	/// The output is gathered straight from the virtual image, the raw data isn't updated anymore.
+	disasm.updateVirtualImageFromInstructions();
+	size_t outSize=parser.writeToFile(outPath);
+	log << "OK ("<<outSize<<" bytes)\n";
+}
+
+/// Output path of the nth variant, the number is inserted before the extension
+static string getVariantPath(string outPath, unsigned n)
+{
+	size_t dot = outPath.find_last_of('.');
+	size_t slash = outPath.find_last_of("/\\");
+	if (dot==string::npos || (slash!=string::npos && dot<slash))
+		dot = outPath.size();
+	return outPath.insert(dot, "_"+to_string(n));
+}
+
+void morphFile(std::string inPath, std::string outPath, unsigned seed, std::ostream& log,
+			unsigned nVariants, unsigned nThreads)
+{
+	// Map file, pages are only read when we touch them
+	log << "Reading "<<inPath<<"...";
+	MappedFile file(inPath);
+	log << "OK ("<<file.getSize() << " bytes)\n";
+
+	// Detect file type
+	log << "Detecting file type :\n";
+	log << "PE...";
+	PEParser parser(file, argHugePages);
+	log << "OK"<<endl;
+	log << "Relocations...OK ("<<parser.getRelocations().size()<<" relocated addresses)\n";
+
+	// Disassemble the code sections
+	/** DONE;
+	Modify the disassembler to take an EP pointing to the virtual image
+	Modify the disassembler to take the whole virtual image, not just the .text section, then modify it to take
+	the vector of the bounds of the executable sections instead of just the end of the section or of the image.
+	Update isAddrInternal to check if the addr is within bounds of an executable section.
+	**/
+	/** TODO:
+	Okay, we really need to read the damn relocations. LordPE can list them for reference.
+	WinMD5 has relocations, tons of them.
+	Relocations could be pointing to data or code, but at first we should just assume it's data unless we can prove it's code.
+	We should run the relocation analysis before disassembling, so we know where not to go.
+	If in the code we land on a point that is targeted by a relocation, we return. This could be data.
+	Then after we're done doing the initial disassembly, we take a look at the relocs again.
+	If we find a valid function start pointed by a reloc, we can mark it as "unknown", else mark it as "might be data".
+	Now we look at all the unknown landing points and do a strict thorought analysis.
+    If we're not reasonably sure it's code, we mark as might be data.
+
+	We can search for signatures (such as push ebp/mov ebp,esp) and mark them for analysis.
+	If we find those in the .text section, they are unlikely to be data.
+	Do the dynamic analysis in another class and as a runtime option
+	The dynamic analysis should be able to find data and code being referenced from the known code, we want to
+	keep track of both. We should have a vector of known data references, like we have a vector of branches.
+	The data structure should contain a set of instructions referencing it, a pointer to the data, and the size.
+	When we modify/remove/add an instruction, we need to invalidate part of those data structures.
+	We can rebuild the data structures after running updataVirtualImageFromInstructions() and re-analyzing the image.
+
+	We should mark the ExitProcess function. Every function that always call ExitProcess should be marked as noreturn.
+	This way if we reach a call to a noreturn function, we can stop instead of risking reading garbage or data
+
+	We should probably implement data reference detection directly into the disassembler. For example if we see
+	MOV REG, 0xXXXXXXXX, and 0xXXXXXXXX is an internal address, this is very likely data.
+	For example B8 XXXXXXXX is sometimes used to load an address into EAX.
+	We should do a test run, detect some of those, and see if all the results we get are data.
+	=> The test run is definitely an improvement, because now we don't crash on WinMD5, but it's also WRONG.
+	=> It's terribly wrong, we get false positives ! There are hardcoded function pointers that are moved into
+	=> registers and we shouldn't mark them as data or we'll skip a large part of the code.
+	=> That said, it's safer to skip part of the code, rather than reading data as code and later modifying it.
+	==> Make a compromise. Instead of having the set dataRefs, make it the
+	==> map<uint8_t, enum detectedType> refedAddrs. When we find an explicit JMP/CALL to this address, mark it in
+	==> refedAddrs as code. If we find an instruction refering to an address, if it's not already marked as code, mark
+	==> it as possibleData. This way function pointers still work, since they reference the same addr that is
+	==> explicitely branched to elsewhere. If it's not explicitely branched to, then we wouldn't find it anyway.
+	==> We should probably only check if we're about to read data after a jump or call, since data isn't going to
+	==> appear in the middle of valid non-branching instructions.
+	===> Now, right now we need to check every instruction whether or not we're landing on data.
+	===> There might be a noreturn call with no references to the byte immediatly following it, but references later.
+	====> There's also the problem of being aligned with the data. If the data is referenced at 0x2 and we start
+	====> reading at 0x1, we'll never land exactly on the start of the data reference.
+
+	=> Try to grep for 0x558BEC ou 0x5589E5 (push ebp, mov ebp, esp)
+	=> See in olly if there are no false positives
+	=> We hopefully shouldn't find too many false positives, since most of .text is supposed to be code, not data.
+	=> Anyway, this should be an option not by default since it's dangerous.
+	==> Grep with olly first to see what the results are.
+	===> Maybe see if we can find a cleanup, or if there is a way to search for the cleanup.
+	=> Read the imports table, and grep for calls to imports
+
+	=> Option to randomize/anonymize the metadata. 0 the checksum, fill the VERSIONINFO, add noise to the icon, change timestamp, etc
+	**/
+	vector<Signature> signatures = argSignatures;
+	if (argScanSignatures)
+	{
+		vector<Signature> defaults = getDefaultSignatures();
+		signatures.insert(end(signatures), begin(defaults), end(defaults));
+	}
+
+	log << "Disassembling...";
+	Disassembler disasm(parser, argCacheDir, argDecodeThreads, argLinearSweep,
+						hashSignatures(signatures, argScanSignatures), argShuffle);
+	log << "OK ("<<disasm.getCode().size()<<" instructions";
+	if (disasm.isFromCache())
+		log << ", from cache";
+	log << ")\n";
+	if (argLinearSweep && !disasm.isFromCache())
+	{
+		const SweepReport& r = disasm.getSweepReport();
+		log << "Linear sweep : "<<r.nSwept<<" instructions in "<<r.sweepTime*1000<<"ms with "<<r.nThreads<<" threads ("
+			<<r.sweptBytes/r.sweepTime/1e6<<" MB/s), "<<r.nResynced<<" decoded again at the chunks boundaries\n";
+		log << "Recursive descent : "<<r.nReachable<<" instructions in "<<r.descentTime*1000<<"ms ("
+			<<r.reachableBytes/r.descentTime/1e6<<" MB/s)\n";
+		log << "Agreement : "<<r.nAgreed<<" of the reachable instructions reused from the sweep ("
+			<<(r.reachableBytes ? 100.0*r.agreedBytes/r.reachableBytes : 100.0)<<"% of their bytes), "
+			<<r.nReachable-r.nAgreed<<" decoded by the descent, "<<r.nPruned<<" swept instructions pruned\n";
+	}
+
+	if (!signatures.empty())
+	{
+		log << "Scanning signatures...";
+		SignatureReport r = disasm.decodeSignatures(signatures, argScanSignatures);
+		log << "OK ("<<r.nHits<<" hits, "<<r.nRoots<<" new roots, "<<r.nInstructions<<" new instructions in "
+			<<(r.scanTime+r.decodeTime)*1000<<"ms)\n";
+	}
+
+	// The analysis is shared by all the variants, only the shuffle needs it
+	log << "Analysis...";
+	if (argShuffle)
+	{
+		if (!disasm.isAnalyzed())
+			disasm.analyze();
+		log << "OK ("<<disasm.getBlocks().size()<<" blocks)\n";
+	}
+	else
+		log << "OK (disabled)\n";
+
+	// Must be done before any transform edits the instructions.
+	// Not being able to write the cache doesn't prevent morphing the file.
+	if (!argCacheDir.empty() && !disasm.isFromCache())
+	{
+		log << "Caching...";
+		try {
+			disasm.saveCache();
+			log << "OK\n";
+		}
+		catch (const char* e) {
+			log << "FAIL ("<<e<<")\n";
+		}
+	}
+
+	if (nVariants==1)
+	{
+		transformFile(disasm, parser, outPath, seed, log);
+		return;
+	}
+
+	// Each variant maps the file again, so the copies share their pages until a transform writes to them,
+	// and starts from a copy of the instructions. The decoding and analysis aren't done again.
+	if (!nThreads)
+		nThreads = max(thread::hardware_concurrency(), 1u);
+	nThreads = min(nThreads, nVariants);
+	vector<string> logs(nVariants);
+	atomic<unsigned> nextVariant{0}, nFailed{0};
+	auto worker = [&]()
+	{
+		for (unsigned i=nextVariant++; i<nVariants; i=nextVariant++)
+		{
+			stringstream variantLog;
+			string variantPath = getVariantPath(outPath, i+1);
+			variantLog << "Variant "<<i+1<<" ("<<variantPath<<") :\n";
+			try {
+				MappedFile variantFile(inPath);
+				PEParser variantParser(variantFile, argHugePages);
+				Disassembler variantDisasm(disasm, variantParser);
+				transformFile(variantDisasm, variantParser, variantPath, seed+i, variantLog);
+			}
+			catch (const char* e) {
+				variantLog << "FAIL ("<<e<<")\n";
+				nFailed++;
+			}
+			catch (const exception& e) {
+				variantLog << "FAIL ("<<e.what()<<")\n";
+				nFailed++;
+			}
+			logs[i] = variantLog.str();
+		}
+	};
+	vector<thread> workers;
+	for (unsigned i=0; i<nThreads; ++i)
+		workers.push_back(thread(worker));
+	for (thread& t : workers)
+		t.join();
+
+	for (const string& variantLog : logs)
+		log << variantLog;
+	if (nFailed)
+		throw "Some of the variants failed";
+}
@@ -0,0 +1,16 @@
+#ifndef MORPH_H_INCLUDED
+#define MORPH_H_INCLUDED
+
+#include <string>
+#include <ostream>
+
+/// Runs the whole pipeline on one file : parsing, disassembly, transforms and rebuilding of the output.
+/// The transforms are selected by the command line options. Progress is written to log.
+/// Throws a const char* if any step fails.
+/// @param seed Seed of the random generator used by the transforms, variant n uses seed+n
+/// @param nVariants Number of outputs generated from the same analysis, numbered if there's more than one
+/// @param nThreads Number of variants transformed in parallel, 0 to use one thread per core
+void morphFile(std::string inPath, std::string outPath, unsigned seed, std::ostream& log,
+			unsigned nVariants=1, unsigned nThreads=0);
+
+#endif // MORPH_H_INCLUDED
@@ -28,6 +28,8 @@ class ObjectParser
 		virtual uint32_t getImageBase()=0;
 		virtual uint32_t getCodeBase()=0;
 		virtual void updateDataFromVirtualImage()=0;
+		/// Writes the output file directly from the virtual image, without going through the raw data
+		virtual size_t writeToFile(std::string path)=0;
 		/// Returns an offset to the start of the new section in the virtual image. Will realloc.
 		virtual uint32_t addSection(std::string name, size_t size, uint32_t flags)=0;
 		/// Adds size bytes to the virtual and raw sizes of the last sections. Will realloc.
@@ -7,24 +7,43 @@
 
 using namespace std;
 
-string argPath, argOut, argRandStr, argEncryptSectionName;
+string argPath, argOut, argRandStr, argEncryptSectionName, argBatchList;
+string argCacheDir;
 int argRand{65};
+unsigned argVariants{1};
+unsigned argThreads{0};
+unsigned argDecodeThreads{1};
 bool argSubstitute{false}, argShuffle{false};
+bool argLinearSweep{false};
+bool argScanSignatures{false};
+bool argHugePages{false};
+vector<Signature> argSignatures;
 
 bool parseArguments(int argc, char* argv[])
 {
     char c;
-	while ((c = getopt (argc, argv, "sSho:r:e:")) != -1)
+	while ((c = getopt (argc, argv, "sSlgHho:r:e:b:j:n:c:p:G:")) != -1)
          switch (c)
            {
             case 'h':
-            cout << "Ditto, a generic metamorphic engine\nUsage : ditto [-hs] [-e s] [-r n] -o output input\n\n"
-                    "-o f\tOutput file\n"
+            cout << "Ditto, a generic metamorphic engine\nUsage : ditto [-hslgH] [-e s] [-r n] [-n n] [-c dir] [-p n] [-G sig] -o output input\n"
+                    "        ditto [-hslgH] [-e s] [-r n] [-j n] [-c dir] [-p n] [-G sig] -b list -o pattern\n\n"
+                    "-o f\tOutput file. In batch mode, %s is replaced by the name of the input file\n"
                     "-r n\tProbability, between 1 and 100, of each operations of the transforms. 65 by default.\n"
                     "-h  \tShow this help\n"
                     "-s  \tIn-place substitution:Replace instructions with equivalent instructions of the same size\n"
                     "-S  \tShuffle small blocks of instructions when their order isn't important.\n"
-                    "-e s\tEncrypts the section s, the entry point will be moved to a polymorphic decryptor\n";
+                    "-e s\tEncrypts the section s, the entry point will be moved to a polymorphic decryptor\n"
+                    "-b f\tBatch mode, morphs every file listed in f (one per line), or every file in the directory f\n"
+                    "-n n\tGenerates n variants from a single analysis, their number is added to the output names\n"
+                    "-j n\tNumber of worker threads, one per core by default\n"
+                    "-c d\tCache the disassembly of each input in the directory d, and reuse it on the next runs\n"
+                    "-p n\tDecode each input with n threads. The instructions found can vary slightly between runs\n"
+                    "-l  \tLinear sweep of the code sections in parallel (-p threads, or one per core). The recursive\n"
+                    "    \tdescent keeps the swept instructions it reaches, and reports how much they agree\n"
+                    "-g  \tAlso decode the functions no branch reaches, found by their prologue or after padding\n"
+                    "-G s\tAlso decode the functions starting with the hexadecimal signature s, like 558BEC. Repeatable\n"
+                    "-H  \tBack the large code sections with transparent huge pages, when the system supports it\n";
 			exit(0);
             break;
 			case 's':
@@ -33,6 +52,24 @@ bool parseArguments(int argc, char* argv[])
             case 'S':
             argShuffle=true;
             break;
+            case 'l':
+            argLinearSweep=true;
+            break;
+            case 'g':
+            argScanSignatures=true;
+            break;
+            case 'H':
+            argHugePages=true;
+            break;
+            case 'G':
+            try {
+                argSignatures.push_back(parseSignature(optarg));
+            }
+            catch (const char* e) {
+                cout << "Error:" << e << "\n";
+                return false;
+            }
+            break;
             case 'o':
             argOut = optarg;
             break;
@@ -42,6 +79,36 @@ bool parseArguments(int argc, char* argv[])
             case 'e':
             argEncryptSectionName = optarg;
             break;
+            case 'b':
+            argBatchList = optarg;
+            break;
+            case 'j':
+            if (atoi(optarg)<1)
+            {
+                cout << "Error:Option -j requires a number of threads\n";
+                return false;
+            }
+            argThreads = atoi(optarg);
+            break;
+            case 'n':
+            if (atoi(optarg)<1)
+            {
+                cout << "Error:Option -n requires a number of variants\n";
+                return false;
+            }
+            argVariants = atoi(optarg);
+            break;
+            case 'c':
+            argCacheDir = optarg;
+            break;
+            case 'p':
+            if (atoi(optarg)<1)
+            {
+                cout << "Error:Option -p requires a number of threads\n";
+                return false;
+            }
+            argDecodeThreads = atoi(optarg);
+            break;
             case '?':
               if (optopt == 'o')
                 fprintf (stderr, "Option -o requires an argument.\n");
@@ -49,6 +116,18 @@ bool parseArguments(int argc, char* argv[])
                 fprintf (stderr, "Option -r requires a numerical argument.\n");
 			  else if (optopt == 'e')
                 fprintf (stderr, "Option -e requires the name of a section.\n");
+			  else if (optopt == 'b')
+                fprintf (stderr, "Option -b requires a file or a directory.\n");
+			  else if (optopt == 'j')
+                fprintf (stderr, "Option -j requires a number of threads.\n");
+			  else if (optopt == 'n')
+                fprintf (stderr, "Option -n requires a number of variants.\n");
+			  else if (optopt == 'c')
+                fprintf (stderr, "Option -c requires a directory.\n");
+			  else if (optopt == 'p')
+                fprintf (stderr, "Option -p requires a number of threads.\n");
+			  else if (optopt == 'G')
+                fprintf (stderr, "Option -G requires a signature.\n");
               else if (isprint (optopt))
                 fprintf (stderr, "Unknown option `-%c' or missing argument.\n", optopt);
               else
@@ -61,7 +140,7 @@ bool parseArguments(int argc, char* argv[])
             }
 	if (optind < argc)
 		argPath = argv[optind];
-	else
+	else if (argBatchList.empty())
 	{
 		cout << "Error: no input file\n";
 		return false;
@@ -2,10 +2,20 @@
 #define OPTIONS_H_INCLUDED
 
 #include <string>
+#include <vector>
+#include "signaturescanner.h"
 
-extern std::string argPath, argOut, argRandStr, argEncryptSectionName;
+extern std::string argPath, argOut, argRandStr, argEncryptSectionName, argBatchList;
+extern std::string argCacheDir; ///< Directory of the analysis cache, empty to disable it
 extern int argRand;
+extern unsigned argVariants; ///< Number of output files generated from the same analysis
+extern unsigned argThreads; ///< Number of worker threads, 0 to use one per core
+extern unsigned argDecodeThreads; ///< Number of threads decoding each input
 extern bool argSubstitute, argShuffle;
+extern bool argLinearSweep; ///< Sweep the code sections in parallel before the recursive descent, and report
+extern bool argScanSignatures; ///< Decode the code found by the default signatures and after padding
+extern bool argHugePages; ///< Load the large code sections in transparent huge pages
+extern std::vector<Signature> argSignatures; ///< Signatures of functions given on the command line
 
 bool parseArguments(int argc, char* argv[]);
 
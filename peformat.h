@@ -92,11 +92,27 @@ struct SectionHeader
 	uint32_t characteristics;		// Flags (see IMAGE_SCN_ defines below)
 };
 
+enum imageDirectoryEntry // Indexes in PEOptHeader::dataDirectory
+{
+	IMAGE_DIRECTORY_ENTRY_IMPORT=1,
+	IMAGE_DIRECTORY_ENTRY_BASERELOC=5
+};
+
+struct ImportDescriptor // The import directory is an array of these, ended by one filled with 0
+{
+	uint32_t originalFirstThunk;	// RVA of the lookup table (names or ordinals), 0 with some old linkers
+	uint32_t timeDateStamp;
+	uint32_t forwarderChain;
+	uint32_t name;					// RVA of the name of the DLL
+	uint32_t firstThunk;			// RVA of the IAT, overwritten by the loader with the addresses
+};
+
 enum imageSectionCharacteristics
 {
 	IMAGE_SCN_CNT_CODE=0x00000020,
 	IMAGE_SCN_CNT_INITIALIZED_DATA=0x00000040,
-	IMAGE_SCN_MEM_READ_EXECUTE = 0x60000000
+	IMAGE_SCN_MEM_READ_EXECUTE = 0x60000000,
+	IMAGE_SCN_MEM_WRITE=0x80000000
 };
 
 #endif // PEFORMAT_H_INCLUDED
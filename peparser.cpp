@@ -2,13 +2,37 @@
 #include <iostream>
 #include <algorithm>
 #include <mem.h>
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
 
 using namespace std;
 
-PEParser::PEParser(uint8_t*& Data, size_t& DataSize)
-: data{Data}, dataSize{DataSize},
-virtualImage{}, virtualImageSize{},
-coffHeader{}, peHeader{}, sectionHeaders{}, relocs{}
+/// Room reserved after the virtual image, so adding and expanding sections doesn't have to move it
+static const size_t VIRTUAL_IMAGE_GROWTH = 16*1024*1024;
+/// Bytes readable after the end of the virtual image. A section can end at the end of the image, and the decoder
+/// reads up to a whole instruction past the end of the section, the length kernels LENGTH_KERNEL_MARGIN bytes.
+static const size_t VIRTUAL_IMAGE_TAIL = 16;
+
+PEParser::PEParser(uint8_t*& Data, size_t& DataSize, bool HugePages)
+: PEParser(Data, DataSize, nullptr, HugePages)
+{
+}
+
+PEParser::PEParser(MappedFile& File, bool HugePages)
+: PEParser(File.getData(), File.getSize(), &File, HugePages)
+{
+}
+
+PEParser::PEParser(uint8_t*& Data, size_t& DataSize, MappedFile* File, bool HugePages)
+: file{File}, data{Data}, dataSize{DataSize},
+virtualImage{}, virtualImageSize{}, virtualImageReserved{}, hugePages{HugePages},
+coffHeader{}, peHeader{}, sectionHeaders{}, sectionInfos{}, pageSections{}, pageShift{}, sectionNames{}, relocs{}, relocatedBytes{}, relocTargets{}, imports{}, importSlots{}
 {
 	//DOS header
     if (dataSize < sizeof(DOSHeader))
@@ -60,16 +84,19 @@ coffHeader{}, peHeader{}, sectionHeaders{}, relocs{}
 			virtualImageSize=sectionEnd;
 	}
 
-	// Load virtual image
-	virtualImage = new uint8_t[virtualImageSize];
-	memcpy(virtualImage, data, headersSize);
+	// Load virtual image. Only the pages written to are backed by memory, the zeroes after the raw data never are.
+	virtualImageReserved = virtualImageSize + VIRTUAL_IMAGE_GROWTH;
+	virtualImage = reservePages(virtualImageReserved, hugePages ? HUGE_PAGE_SIZE : 0);
+	commitPages(virtualImage, virtualImageSize+VIRTUAL_IMAGE_TAIL);
+	loadIntoVirtualImage(0, 0, headersSize);
 	for (SectionHeader* h : sectionHeaders)
 	{
-		uint8_t* pStart = data+h->rawDataOffset;
-		uint8_t* vStart = virtualImage+h->virtualAddress;
-		size_t loadSize = min(h->rawDataSize, h->virtualSize);
-		memcpy(((uint8_t*)h)-(uint32_t)data+(uint32_t)virtualImage, h, sizeof(SectionHeader));
-		memcpy(vStart, pStart, loadSize);
+		size_t size = min(h->rawDataSize, h->virtualSize);
+		// Pages mapped from the file can't be huge pages, those sections are copied
+		bool huge = hugePages && h->characteristics & IMAGE_SCN_CNT_CODE && size >= HUGE_PAGE_SIZE;
+		if (huge)
+			adviseHugePages(virtualImage+h->virtualAddress, size);
+		loadIntoVirtualImage(h->virtualAddress, h->rawDataOffset, size, !huge);
 	}
 
 	// Rebase our various pointers on the virtual image
@@ -77,112 +104,153 @@ coffHeader{}, peHeader{}, sectionHeaders{}, relocs{}
 		sectionHeaders[i] = (SectionHeader*)((uint8_t*)sectionHeaders[i] + (uint32_t)virtualImage - (uint32_t)data);
 	coffHeader = (COFFHeader*)((uint8_t*)coffHeader + (uint32_t)virtualImage - data);
 	peHeader = (PEOptHeader*)((uint8_t*)peHeader+ (uint32_t)virtualImage - data);
+
+	indexSections();
+	readRelocations();
+	readImports();
+}
+
+PEParser::~PEParser()
+{
+	freePages(virtualImage, virtualImageReserved);
 }
 
-std::vector<std::string> PEParser::getSectionNames()
+void PEParser::loadIntoVirtualImage(uint32_t virtualAddr, uint32_t rawOffset, size_t size, bool mapFile)
 {
-	std::vector<std::string> names;
-	names.reserve(sectionHeaders.size());
-	for (auto sectionHeader : sectionHeaders)
+	// Whole pages are mapped straight from the file when the alignments allow it.
+	// They're shared with the page cache and only copied if something writes to them.
+	size_t mapped=0;
+	if (file && mapFile)
+		mapped = file->mapInto(virtualImage+virtualAddr, rawOffset, size);
+	memcpy(virtualImage+virtualAddr+mapped, data+rawOffset+mapped, size-mapped);
+}
+
+void PEParser::resizeData(size_t newSize)
+{
+	if (file)
+		file->resize(newSize);
+	else
+		data = (uint8_t*)realloc(data, newSize);
+}
+
+void PEParser::resizeVirtualImage(size_t newSize)
+{
+	if (newSize+VIRTUAL_IMAGE_TAIL <= virtualImageReserved)
 	{
-		string name(sectionHeader->name,8);
-		name.erase(find_if(name.rbegin(),name.rend(),not1(ptr_fun<int,int>(std::isspace))).base(),end(name));
-		name=string(name.c_str());
-		names.push_back(name);
+		commitPages(virtualImage+virtualImageSize, newSize-virtualImageSize+VIRTUAL_IMAGE_TAIL);
+		return;
 	}
-	return names;
+	size_t newReserved = newSize + VIRTUAL_IMAGE_GROWTH;
+	uint8_t* newImage = reservePages(newReserved, hugePages ? HUGE_PAGE_SIZE : 0);
+	commitPages(newImage, newSize+VIRTUAL_IMAGE_TAIL);
+	memcpy(newImage, virtualImage, virtualImageSize);
+	freePages(virtualImage, virtualImageReserved);
+	virtualImage = newImage;
+	virtualImageReserved = newReserved;
 }
 
-std::pair<uint8_t*,size_t> PEParser::getSectionData(std::string sectionName)
+void PEParser::indexSections()
 {
-    auto it = find_if(begin(sectionHeaders), end(sectionHeaders),
-					[sectionName](SectionHeader* h){return string(string(h->name,8).c_str())==sectionName;});
-    if (it==end(sectionHeaders))
-		throw std::invalid_argument("Section does not exist");
+	sectionInfos.clear();
+	sectionNames.clear();
+	pageShift = 12;
+	for (size_t i=0; i<sectionHeaders.size(); ++i)
+	{
+		SectionHeader* h = sectionHeaders[i];
+		uint32_t start = h->virtualAddress;
+		sectionInfos.push_back({start, start+h->virtualSize, start+min(h->virtualSize, h->rawDataSize),
+								h->rawDataOffset, h->characteristics});
+		// The first section with a name wins, like the old linear searches
+		sectionNames.insert({getSectionName(i), (SectionHandle)i});
+		// Small alignments need smaller pages, the sections are aligned but not their ends
+		if (start)
+			pageShift = min(pageShift, (unsigned)__builtin_ctz(start));
+	}
 
-//	vector<uint8_t> sectionData;
-	SectionHeader* header = *it;
-	//if (header->virtualSize < header->rawDataSize)
-	//	cout << "WARNING: Virtual size is smaller by 0x"<<hex<<(int)header->rawDataSize-(int)header->virtualSize<<dec<<" bytes\n";
-//	uint8_t* start = (uint8_t*)data+header->rawDataOffset;
-	size_t size = min(header->rawDataSize, header->virtualSize);
-	if (size > dataSize)
-		throw std::out_of_range("Section limit is after end of data");
-//	for (uint8_t* c=start; c<limit; ++c)
-//		sectionData.push_back(*c);
+	pageSections.assign((virtualImageSize>>pageShift)+1, INVALID_SECTION);
+	for (size_t i=0; i<sectionInfos.size(); ++i)
+	{
+		const SectionInfo& info = sectionInfos[i];
+		for (uint32_t page=info.start>>pageShift; page<<pageShift < info.end && page<pageSections.size(); ++page)
+			if (pageSections[page]==INVALID_SECTION)
+				pageSections[page] = i;
+	}
+}
 
-	return pair<uint8_t*,size_t>(data+header->rawDataOffset, size);
+size_t PEParser::getSectionCount()
+{
+	return sectionHeaders.size();
+}
 
-//	return sectionData;
+SectionHandle PEParser::findSection(const std::string& name)
+{
+	auto it = sectionNames.find(name);
+	return it==end(sectionNames) ? INVALID_SECTION : it->second;
+}
+
+SectionHandle PEParser::getSectionAt(uint32_t rva)
+{
+	uint32_t page = rva>>pageShift;
+	if (page >= pageSections.size())
+		return INVALID_SECTION;
+	SectionHandle section = pageSections[page];
+	if (section==INVALID_SECTION || rva<sectionInfos[section].start || rva>=sectionInfos[section].end)
+		return INVALID_SECTION;
+	return section;
+}
+
+std::string PEParser::getSectionName(SectionHandle section)
+{
+	// The name is padded with nulls, and isn't terminated if it's 8 characters long
+	const char* name = sectionHeaders.at(section)->name;
+	return string(name, find(name, name+8, '\0'));
+}
+
+std::pair<uint8_t*,size_t> PEParser::getSectionData(SectionHandle section)
+{
+	SectionHeader* header = sectionHeaders.at(section);
+	size_t size = min(header->rawDataSize, header->virtualSize);
+	if (header->rawDataOffset+size > dataSize)
+		throw "Section limit is after end of data";
+	return pair<uint8_t*,size_t>(data+header->rawDataOffset, size);
 }
 
 uint32_t PEParser::getEntryPoint()
 {
-	// Find the section containing the entry point
-	// substract virtual offset from RVA entry point to get physical entry point
-	unsigned long entry = peHeader->addressOfEntryPoint;
-	for (SectionHeader* h : sectionHeaders)
-	{
-		unsigned long start = h->virtualAddress;
-		unsigned long limit = start+h->virtualSize;
-		if (entry>=start && entry<limit)
-			return entry;
-	}
-	throw "Can't find the section containing the entry point";
+	uint32_t entry = peHeader->addressOfEntryPoint;
+	if (getSectionAt(entry)==INVALID_SECTION)
+		throw "Can't find the section containing the entry point";
+	return entry;
 }
 
 uint32_t PEParser::getRelEntryPoint()
 {
-	// Find the section containing the entry point
-	// substract virtual offset from RVA entry point to get physical entry point
-	unsigned long entry = peHeader->addressOfEntryPoint;
-	for (SectionHeader* h : sectionHeaders)
-	{
-		unsigned long start = h->virtualAddress;
-		unsigned long limit = start+h->virtualSize;
-		if (entry>=start && entry<limit)
-		{
-			//cout<<"EP is in "<< h->name<<"\n";
-			return entry - h->virtualAddress;
-		}
-	}
-	throw "Can't find the section containing the entry point";
+	// Substract the start of the section containing the entry point
+	uint32_t entry = peHeader->addressOfEntryPoint;
+	SectionHandle section = getSectionAt(entry);
+	if (section==INVALID_SECTION)
+		throw "Can't find the section containing the entry point";
+	return entry - sectionInfos[section].start;
 }
 
-uint32_t PEParser::getSectionRawAddr(std::string sectionName)
+uint32_t PEParser::getSectionRawAddr(SectionHandle section)
 {
-	auto it = find_if(begin(sectionHeaders), end(sectionHeaders),
-					[sectionName](SectionHeader* h){return string(string(h->name,8).c_str())==sectionName;});
-    if (it==end(sectionHeaders))
-		throw std::invalid_argument("Section does not exist");
-	return (uint32_t)(*it)->rawDataOffset;
+	return sectionHeaders.at(section)->rawDataOffset;
 }
 
-size_t PEParser::getSectionRawSize(std::string sectionName)
+size_t PEParser::getSectionRawSize(SectionHandle section)
 {
-	auto it = find_if(begin(sectionHeaders), end(sectionHeaders),
-					[sectionName](SectionHeader* h){return string(string(h->name,8).c_str())==sectionName;});
-    if (it==end(sectionHeaders))
-		throw std::invalid_argument("Section does not exist");
-	return (*it)->rawDataSize;
+	return sectionHeaders.at(section)->rawDataSize;
 }
 
-uint32_t PEParser::getSectionVirtualAddr(std::string sectionName)
+uint32_t PEParser::getSectionVirtualAddr(SectionHandle section)
 {
-	auto it = find_if(begin(sectionHeaders), end(sectionHeaders),
-					[sectionName](SectionHeader* h){return string(string(h->name,8).c_str())==sectionName;});
-    if (it==end(sectionHeaders))
-		throw std::invalid_argument("Section does not exist");
-	return (uint32_t)(*it)->virtualAddress;
+	return sectionHeaders.at(section)->virtualAddress;
 }
 
-size_t PEParser::getSectionVirtualSize(std::string sectionName)
+size_t PEParser::getSectionVirtualSize(SectionHandle section)
 {
-	auto it = find_if(begin(sectionHeaders), end(sectionHeaders),
-					[sectionName](SectionHeader* h){return string(string(h->name,8).c_str())==sectionName;});
-    if (it==end(sectionHeaders))
-		throw std::invalid_argument("Section does not exist");
-	return (*it)->virtualSize;
+	return sectionHeaders.at(section)->virtualSize;
 }
 
 uint8_t*& PEParser::getVirtualImage()
@@ -190,15 +258,34 @@ uint8_t*& PEParser::getVirtualImage()
 	return virtualImage;
 }
 
-std::pair<uint32_t,uint32_t> PEParser::getSectionVirtualBounds(std::string sectionName)
+std::pair<uint32_t,uint32_t> PEParser::getSectionVirtualBounds(SectionHandle section)
+{
+	const SectionInfo& info = sectionInfos.at(section);
+	return pair<uint32_t,uint32_t>(info.start, info.end);
+}
+
+uint32_t PEParser::getSectionFlags(SectionHandle section)
 {
-	auto it = find_if(begin(sectionHeaders), end(sectionHeaders),
-					[sectionName](SectionHeader* h){return string(string(h->name,8).c_str())==sectionName;});
-    if (it==end(sectionHeaders))
-		throw std::invalid_argument("Section does not exist");
-	uint32_t start=(*it)->virtualAddress;
-	uint32_t end=start+(*it)->virtualSize;
-	return pair<uint32_t,uint32_t>(start,end);
+	return sectionInfos.at(section).flags;
+}
+
+uint32_t PEParser::getFileOffset(uint32_t rva)
+{
+	SectionHandle section = getSectionAt(rva);
+	if (section==INVALID_SECTION || rva>=sectionInfos[section].loadedEnd)
+		return (uint32_t)-1;
+	return sectionInfos[section].rawOffset + rva-sectionInfos[section].start;
+}
+
+uint32_t PEParser::getCodeSectionEnd(uint32_t rva)
+{
+	SectionHandle section = getSectionAt(rva);
+	if (section==INVALID_SECTION)
+		return 0;
+	const SectionInfo& info = sectionInfos[section];
+	if (!(info.flags & IMAGE_SCN_CNT_CODE) || rva>=info.loadedEnd)
+		return 0;
+	return info.loadedEnd;
 }
 
 uint32_t PEParser::getImageBase()
@@ -214,16 +301,9 @@ uint32_t PEParser::getCodeBase()
 std::vector<std::pair<uint32_t,uint32_t>> PEParser::getCodeSectionsVirtualBounds()
 {
 	vector<std::pair<uint32_t,uint32_t>> bounds;
-    for (SectionHeader* h : sectionHeaders)
-	{
-		if (h->characteristics & IMAGE_SCN_CNT_CODE)
-		{
-			//cout << "CODE SECTION:"<<string(h->name,8)<<"\n";
-			size_t size = min(h->virtualSize, h->rawDataSize);
-			uint32_t virtualStart=h->virtualAddress;
-			bounds.push_back(pair<uint32_t,uint32_t>{virtualStart,virtualStart+size});
-		}
-	}
+	for (const SectionInfo& info : sectionInfos)
+		if (info.flags & IMAGE_SCN_CNT_CODE)
+			bounds.push_back(pair<uint32_t,uint32_t>{info.start,info.loadedEnd});
 	return bounds;
 }
 
@@ -243,6 +323,83 @@ void PEParser::updateDataFromVirtualImage()
 	}
 }
 
+size_t PEParser::writeToFile(std::string path)
+{
+	// List the regions of the output file in order. The headers and the loaded part of the sections
+	// come from the virtual image, everything else (padding, overlay, ...) from the raw data.
+	vector<pair<const uint8_t*,size_t>> regions;
+	size_t headersSize=((uint8_t*)(sectionHeaders.back()+1)) - virtualImage;
+	regions.push_back({virtualImage, headersSize});
+	size_t pos=headersSize;
+
+	vector<SectionHeader*> rawOrder = sectionHeaders;
+	sort(begin(rawOrder), end(rawOrder),
+		[](SectionHeader* a, SectionHeader* b){return a->rawDataOffset < b->rawDataOffset;});
+	for (SectionHeader* h : rawOrder)
+	{
+		size_t rawStart = h->rawDataOffset;
+		size_t rawEnd = min((size_t)rawStart+h->rawDataSize, dataSize);
+		size_t loadEnd = min(rawStart+min(h->rawDataSize, h->virtualSize), rawEnd);
+		if (rawStart < pos) // Overlaps what we already wrote, keep the first writer
+			continue;
+		if (rawStart > pos)
+			regions.push_back({data+pos, rawStart-pos});
+		if (loadEnd > rawStart)
+			regions.push_back({virtualImage+h->virtualAddress, loadEnd-rawStart});
+		if (rawEnd > loadEnd)
+			regions.push_back({data+loadEnd, rawEnd-loadEnd});
+		pos = max(pos, rawEnd);
+	}
+	if (dataSize > pos)
+		regions.push_back({data+pos, dataSize-pos});
+
+	// Gather the regions straight into the file
+#ifdef _WIN32
+	fstream outFile;
+	outFile.open(path.c_str(),ios_base::out | ios_base::binary | ios_base::trunc);
+	if (!outFile.is_open())
+		throw "Failed to open output file";
+	for (const pair<const uint8_t*,size_t>& r : regions)
+		outFile.write((const char*)r.first, r.second);
+	if (!outFile)
+		throw "Failed to write output file";
+	outFile.close();
+#else
+	int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0755);
+	if (fd<0)
+		throw "Failed to open output file";
+	vector<iovec> iovs;
+	iovs.reserve(regions.size());
+	for (const pair<const uint8_t*,size_t>& r : regions)
+		if (r.second)
+			iovs.push_back({(void*)r.first, r.second});
+	for (size_t i=0; i<iovs.size();)
+	{
+		int count = min(iovs.size()-i, (size_t)IOV_MAX);
+		ssize_t written = writev(fd, &iovs[i], count);
+		if (written<0)
+		{
+			close(fd);
+			throw "Failed to write output file";
+		}
+		// Skip what was written, and resume in the middle of a region after a short write
+		while (i<iovs.size() && (size_t)written >= iovs[i].iov_len)
+			written -= iovs[i++].iov_len;
+		if (written)
+		{
+			iovs[i].iov_base = (uint8_t*)iovs[i].iov_base + written;
+			iovs[i].iov_len -= written;
+		}
+	}
+	close(fd);
+#endif
+
+	size_t size=0;
+	for (const pair<const uint8_t*,size_t>& r : regions)
+		size += r.second;
+	return size;
+}
+
 void PEParser::setEntryPoint(uint32_t value)
 {
 	peHeader->addressOfEntryPoint = value;
@@ -287,8 +444,8 @@ uint32_t PEParser::addSection(std::string name, size_t size, uint32_t flags)
 
 	// Realloc
 	uint8_t* oldImageAddr = virtualImage;
-	data = (uint8_t*)realloc(data, alignedRawEnd);
-	virtualImage = (uint8_t*)realloc(virtualImage,alignedVEnd);
+	resizeData(alignedRawEnd);
+	resizeVirtualImage(alignedVEnd);
 
 	// Rebase headers
 	for (uint8_t i=0; i<sectionHeaders.size(); ++i)
@@ -324,6 +481,7 @@ uint32_t PEParser::addSection(std::string name, size_t size, uint32_t flags)
 	// Update sizes
 	dataSize = alignedRawEnd;
 	virtualImageSize = alignedVEnd;
+	indexSections();
 
 	return (uint32_t)newHeader->virtualAddress;
 }
@@ -332,8 +490,9 @@ void PEParser::expandLastSectionBy(size_t size)
 {
 	// Realloc
 	uint8_t* oldImageAddr = virtualImage;
-	data = (uint8_t*)realloc(data, dataSize+size);
-	virtualImage = (uint8_t*)realloc(virtualImage,virtualImageSize+size);
+	size_t newDataSize = dataSize+size;
+	resizeData(newDataSize);
+	resizeVirtualImage(virtualImageSize+size);
 
 	// Rebase headers
 	for (uint8_t i=0; i<sectionHeaders.size(); ++i)
@@ -356,8 +515,9 @@ void PEParser::expandLastSectionBy(size_t size)
 	}
 
 	// Update sizes
-	dataSize += size;
+	dataSize = newDataSize;
 	virtualImageSize += size;
+	indexSections();
 }
 
 bool PEParser::isLastSectionRECode()
@@ -376,3 +536,192 @@ uint32_t PEParser::getLastSectionEnd()
 	SectionHeader* header = sectionHeaders.back();
 	return header->virtualAddress + header->virtualSize;
 }
+
+void PEParser::readRelocations()
+{
+	relocs.clear();
+	relocatedBytes.assign((virtualImageSize+63)/64, 0);
+	relocTargets.clear();
+	if ((uint32_t)peHeader->numberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_BASERELOC)
+		return;
+	uint32_t dirStart = peHeader->dataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress;
+	uint32_t dirSize = peHeader->dataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size;
+	if (!dirStart || !dirSize || dirStart >= virtualImageSize)
+		return;
+	dirSize = min<uint32_t>(dirSize, virtualImageSize-dirStart);
+
+	// The bytes the other types of relocations change are still marked, without a Relocation, so that they're
+	// never moved or taken for a 32-bit field
+	auto markBytes = [&](uint32_t addr, uint32_t size)
+	{
+		for (uint32_t b=addr; b<virtualImageSize && b-addr<size; ++b)
+			relocatedBytes[b/64] |= 1ULL<<(b%64);
+	};
+
+	// Packers leave invalid entries, they're skipped. A chunk that doesn't fit ends the directory.
+	uint32_t imageBase = peHeader->imageBase;
+	uint32_t pos = dirStart, dirEnd = dirStart+dirSize;
+	while (pos+sizeof(RelocationChunk) <= dirEnd)
+	{
+		RelocationChunk chunk;
+		memcpy(&chunk, virtualImage+pos, sizeof(RelocationChunk));
+		if (chunk.sizeOfChunk < sizeof(RelocationChunk) || chunk.sizeOfChunk > dirEnd-pos)
+			break;
+		const uint8_t* entries = virtualImage+pos+sizeof(RelocationChunk);
+		size_t nEntries = (chunk.sizeOfChunk-sizeof(RelocationChunk))/sizeof(RelocationEntry);
+		for (size_t i=0; i<nEntries; ++i)
+		{
+			uint16_t entry;
+			memcpy(&entry, entries+i*2, 2);
+			uint16_t type = entry>>12;
+			uint32_t addr = chunk.virtualAddress + (entry&0xFFF);
+			if (type == IMAGE_REL_BASED_ABSOLUTE) // Padding
+				continue;
+			if (addr < chunk.virtualAddress || addr >= virtualImageSize)
+				continue;
+			if (type == IMAGE_REL_BASED_HIGH || type == IMAGE_REL_BASED_LOW)
+				markBytes(addr, 2);
+			else if (type == IMAGE_REL_BASED_HIGHADJ)
+			{
+				markBytes(addr, 2);
+				i++; // The next entry holds the low half of the address
+			}
+			else if (type == IMAGE_REL_BASED_HIGHLOW && virtualImageSize >= 4 && addr <= virtualImageSize-4)
+			{
+				uint32_t value;
+				memcpy(&value, virtualImage+addr, 4);
+				relocs.push_back({addr, value-imageBase});
+				markBytes(addr, 4);
+			}
+			else // Truncated, 64-bit or for another CPU
+				markBytes(addr, 8);
+		}
+		pos += chunk.sizeOfChunk;
+	}
+
+	// The linkers write them in order, but nothing requires it
+	auto byAddr = [](const Relocation& a, const Relocation& b){return a.addr < b.addr;};
+	if (!is_sorted(begin(relocs), end(relocs), byAddr))
+		sort(begin(relocs), end(relocs), byAddr);
+
+	// Code reached only through an absolute address, like the cases of a jump table or a callback,
+	// has nothing else telling it's the start of an instruction
+	for (const Relocation& r : relocs)
+		if (getCodeSectionEnd(r.target))
+			relocTargets.push_back(r.target);
+	sort(begin(relocTargets), end(relocTargets));
+	relocTargets.erase(unique(begin(relocTargets), end(relocTargets)), end(relocTargets));
+}
+
+const std::vector<Relocation>& PEParser::getRelocations()
+{
+	return relocs;
+}
+
+bool PEParser::isRelocated(uint32_t addr)
+{
+	return addr/64 < relocatedBytes.size() && relocatedBytes[addr/64] & 1ULL<<(addr%64);
+}
+
+bool PEParser::hasRelocations(uint32_t addr, size_t size)
+{
+	for (uint32_t i=addr; i<addr+size; ++i)
+		if (isRelocated(i))
+			return true;
+	return false;
+}
+
+bool PEParser::hasRelocationTargets(uint32_t addr, size_t size)
+{
+	auto it = lower_bound(begin(relocTargets), end(relocTargets), addr);
+	return it!=end(relocTargets) && *it-addr < size;
+}
+
+const Relocation* PEParser::getRelocation(uint32_t addr)
+{
+	auto it = lower_bound(begin(relocs), end(relocs), addr,
+						[](const Relocation& r, uint32_t addr){return r.addr < addr;});
+	if (it==end(relocs) || it->addr!=addr)
+		return nullptr;
+	return &*it;
+}
+
+/// Imported functions that never return, whatever DLL they come from
+static const char* const noReturnImports[] =
+{
+	"ExitProcess", "ExitThread", "FreeLibraryAndExitThread", "RtlExitUserProcess", "RtlExitUserThread",
+	"exit", "_exit", "_Exit", "quick_exit", "abort", "_amsg_exit", "longjmp", "_longjmp",
+	"_CxxThrowException", "_invalid_parameter_noinfo_noreturn", "__std_terminate", "?terminate@@YAXXZ"
+};
+
+void PEParser::readImports()
+{
+	imports.clear();
+	importSlots.clear();
+	if ((uint32_t)peHeader->numberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_IMPORT)
+		return;
+	uint32_t dirStart = peHeader->dataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress;
+	if (!dirStart)
+		return;
+
+	auto readWord = [&](uint32_t rva, uint32_t& word)
+	{
+		if (rva >= virtualImageSize || virtualImageSize-rva < 4)
+			return false;
+		memcpy(&word, virtualImage+rva, 4);
+		return true;
+	};
+	auto readString = [&](uint32_t rva, string& str)
+	{
+		const char* start = (const char*)virtualImage+rva;
+		if (rva >= virtualImageSize || !memchr(start, 0, virtualImageSize-rva))
+			return false;
+		str = start;
+		return true;
+	};
+
+	// Packed and bound files can have entries the loader doesn't use or can't resolve, they're skipped.
+	// The table ends at the first empty descriptor, or where it leaves the image.
+	for (uint32_t pos=dirStart;; pos+=sizeof(ImportDescriptor))
+	{
+		if (pos >= virtualImageSize || virtualImageSize-pos < sizeof(ImportDescriptor))
+			break;
+		ImportDescriptor desc;
+		memcpy(&desc, virtualImage+pos, sizeof(ImportDescriptor));
+		if (!desc.name && !desc.firstThunk)
+			break;
+
+		string dll;
+		if (!readString(desc.name, dll))
+			continue;
+		// The IAT may already hold addresses if the imports are bound, the lookup table still has the names
+		uint32_t lookup = desc.originalFirstThunk ? desc.originalFirstThunk : desc.firstThunk;
+		uint32_t thunk;
+		for (uint32_t i=0; readWord(lookup+i*4, thunk) && thunk; ++i)
+		{
+			// The slot is kept even if the name can't be read, the loader still writes an address there
+			Import import{desc.firstThunk+i*4, dll, "", 0, false};
+			if (thunk & 0x80000000)
+				import.ordinal = thunk & 0xFFFF;
+			else if (readString(thunk+2, import.name)) // After the hint
+			{
+				for (const char* name : noReturnImports)
+					if (import.name==name)
+						import.noReturn = true;
+			}
+			importSlots[import.slot] = imports.size();
+			imports.push_back(import);
+		}
+	}
+}
+
+const std::vector<Import>& PEParser::getImports()
+{
+	return imports;
+}
+
+const Import* PEParser::getImport(uint32_t slot)
+{
+	auto it = importSlots.find(slot);
+	return it==end(importSlots) ? nullptr : &imports[it->second];
+}
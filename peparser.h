@@ -5,49 +5,112 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include <unordered_map>
 #include "peformat.h"
 #include "relocation.h"
+#include "imports.h"
+#include "mappedfile.h"
+
+/// Index of a section in the headers
+typedef uint16_t SectionHandle;
+static const SectionHandle INVALID_SECTION = 0xFFFF;
 
 class PEParser
 {
 	public:
-		PEParser(uint8_t*& Data, size_t& DataSize);
+		/// @param HugePages Back the large code sections with transparent huge pages, to cut the TLB misses when
+		/// decoding and analyzing them. They're copied instead of mapped from the file.
+		PEParser(uint8_t*& Data, size_t& DataSize, bool HugePages=false);
+		PEParser(MappedFile& File, bool HugePages=false); ///< Pages of the file are mapped in the virtual image when possible
 		PEParser(const PEParser&)=delete;
-		~PEParser()=default;
+		~PEParser();
 		void operator=(const PEParser&)=delete;
 
-		std::vector<std::string> getSectionNames();
-		std::pair<uint8_t*,size_t> getSectionData(std::string sectionName);
-		size_t getSectionRawSize(std::string sectionName);
-		uint32_t getSectionRawAddr(std::string sectionName);
-		size_t getSectionVirtualSize(std::string sectionName);
-		uint32_t getSectionVirtualAddr(std::string sectionName);
+		size_t getSectionCount(); ///< The handles of the sections are 0 to getSectionCount()-1, in the headers order
+		SectionHandle findSection(const std::string& name); ///< Section with this name, or INVALID_SECTION. O(1)
+		/// Section whose virtual bounds contain the RVA, or INVALID_SECTION. O(1), looked up in a table of pages.
+		SectionHandle getSectionAt(uint32_t rva);
+		std::string getSectionName(SectionHandle section);
+		std::pair<uint8_t*,size_t> getSectionData(SectionHandle section);
+		size_t getSectionRawSize(SectionHandle section);
+		uint32_t getSectionRawAddr(SectionHandle section);
+		size_t getSectionVirtualSize(SectionHandle section);
+		uint32_t getSectionVirtualAddr(SectionHandle section);
+		std::pair<uint32_t,uint32_t> getSectionVirtualBounds(SectionHandle section);
+		uint32_t getSectionFlags(SectionHandle section); ///< Characteristics of the section, IMAGE_SCN_*
+		/// Offset in the raw data of the byte loaded at the RVA, or -1 if it isn't loaded from the file. O(1)
+		uint32_t getFileOffset(uint32_t rva);
+		/// End of the part of the code section containing the RVA loaded from the file, or 0 if there is none. O(1)
+		uint32_t getCodeSectionEnd(uint32_t rva);
         uint32_t getEntryPoint();
 		uint32_t getRelEntryPoint();
 		uint8_t*& getVirtualImage();
-		std::pair<uint32_t,uint32_t> getSectionVirtualBounds(std::string sectionName);
 		std::vector<std::pair<uint32_t,uint32_t>> getCodeSectionsVirtualBounds();
 		uint32_t getImageBase();
 		uint32_t getCodeBase();
 		std::pair<uint8_t*,size_t> getData();
 		void updateDataFromVirtualImage();
+		/// Writes the file built from the virtual image's headers and sections, and the raw padding around them.
+		/// Doesn't modify the raw data, so it's not necessary to call updateDataFromVirtualImage() first.
+		/// @return Size of the file written
+		size_t writeToFile(std::string path);
 		uint32_t addSection(std::string name, size_t size, uint32_t flags);
 		void expandLastSectionBy(size_t size);
 		void setEntryPoint(uint32_t value);
 		bool isLastSectionRECode();
 		uint32_t getLastSectionEnd();
-		//void readRelocations();
-        //std::vector<Relocation> getRelocations();
+		/// Parses the base relocations directory, the constructor already does it.
+		/// Only the 32-bit relocations get a Relocation. The bytes of the other types are marked as relocated,
+		/// and the invalid entries are skipped.
+		void readRelocations();
+		const std::vector<Relocation>& getRelocations(); ///< Sorted by address
+		bool isRelocated(uint32_t addr); ///< Is the byte at addr part of a relocated field, of any type. O(1)
+		bool hasRelocations(uint32_t addr, size_t size); ///< Is any byte of the range part of a relocated field
+		const Relocation* getRelocation(uint32_t addr); ///< Relocation of the field starting at addr, or nullptr. O(log n)
+		/// Does a relocated field point in the range. Only the targets in the code sections are indexed. O(log n)
+		bool hasRelocationTargets(uint32_t addr, size_t size);
+		/// Parses the import directory, the constructor already does it. The invalid entries are skipped.
+		void readImports();
+		const std::vector<Import>& getImports();
+		const Import* getImport(uint32_t slot); ///< Import whose address the loader writes at slot, or nullptr. O(1)
+	private:
+		PEParser(uint8_t*& Data, size_t& DataSize, MappedFile* File, bool HugePages);
+		/// Loads size bytes of the raw data at rawOffset in the virtual image at virtualAddr
+		void loadIntoVirtualImage(uint32_t virtualAddr, uint32_t rawOffset, size_t size, bool mapFile=true);
+		void resizeData(size_t newSize); ///< Grows the raw data, doesn't update dataSize
+		/// Grows the virtual image in its reserved range, or moves it to a bigger one. Doesn't update virtualImageSize.
+		void resizeVirtualImage(size_t newSize);
+		/// Builds the table of pages and the index of names from the section headers.
+		/// Called again whenever a section is added or resized.
+		void indexSections();
 	private:
+		MappedFile* file; // Owner of data, or nullptr if the data was allocated by the caller
 	    uint8_t*& data; // May change at any time
 		size_t& dataSize; // May change at any time
 		uint8_t* virtualImage; // May change at any time
 		size_t virtualImageSize; // May change at any time
+		size_t virtualImageReserved; // Size of the address range reserved for the virtual image to grow in place
+		bool hugePages;
 		COFFHeader* coffHeader;
 		PEOptHeader* peHeader;
 		std::vector<SectionHeader*> sectionHeaders;
+		/// What the lookups need from the section headers, in one place
+		struct SectionInfo
+		{
+			uint32_t start, end; // Virtual bounds
+			uint32_t loadedEnd; // End of the part loaded from the raw data
+			uint32_t rawOffset;
+			uint32_t flags;
+		};
+		std::vector<SectionInfo> sectionInfos; // Indexed by handle
+		std::vector<SectionHandle> pageSections; // Section of each page of the virtual image
+		unsigned pageShift; // The pages are small enough that no page holds the start of two sections
+		std::unordered_map<std::string, SectionHandle> sectionNames;
 		std::vector<Relocation> relocs;
-		//bool doneReadingRelocations; // True when we've read the relocations
+		std::vector<uint64_t> relocatedBytes; // Bitmap of the bytes of the virtual image part of a relocated field
+		std::vector<uint32_t> relocTargets; // Sorted targets of the relocations in the code sections
+		std::vector<Import> imports;
+		std::unordered_map<uint32_t, uint32_t> importSlots; // IAT slot to index in imports
 };
 
 #endif // PEPARSER_H
@@ -1,6 +1,8 @@
 #ifndef RELOCATION_H_INCLUDED
 #define RELOCATION_H_INCLUDED
 
+#include <stdint.h>
+
 enum RelocationType
 {
     IMAGE_REL_BASED_ABSOLUTE=0,
@@ -17,13 +19,21 @@ enum RelocationType
 struct RelocationChunk
 {
     uint32_t virtualAddress; ///< Start RVA this chunk's relocations apply to
-    uint32_t sizeOfChunk; ///< Size in bytes of the chunk, header not included
+    uint32_t sizeOfChunk; ///< Size in bytes of the chunk, header included
 };
 
-struct Relocation
+/// Entry of a RelocationChunk, as stored in the file
+struct RelocationEntry
 {
     uint16_t offset : 12;
     uint16_t type : 4; ///< Directly castable to a RelocationType
 };
 
+/// Absolute address stored in the image, that the loader adjusts when the image isn't loaded at its base
+struct Relocation
+{
+    uint32_t addr; ///< RVA of the 32-bit field
+    uint32_t target; ///< RVA the field points to
+};
+
 #endif // RELOCATION_H_INCLUDED
@@ -0,0 +1,148 @@
+#include "signaturescanner.h"
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define SIGNATURE_SCANNER_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+vector<Signature> getDefaultSignatures()
+{
+	return {
+		{0x55, 0x8B, 0xEC},				// push ebp, mov ebp,esp
+		{0x55, 0x89, 0xE5},				// push ebp, mov ebp,esp (other encoding)
+		{0x8B, 0xFF, 0x55, 0x8B, 0xEC}	// mov edi,edi, push ebp, mov ebp,esp
+	};
+}
+
+Signature parseSignature(const string& hex)
+{
+	if (hex.empty() || hex.size()%2)
+		throw "Signatures must be an even number of hexadecimal digits";
+	Signature signature;
+	for (size_t i=0; i<hex.size(); i+=2)
+	{
+		uint8_t byte=0;
+		for (size_t j=i; j<i+2; ++j)
+		{
+			char c = hex[j];
+			if (c>='0' && c<='9')
+				byte = byte<<4 | (c-'0');
+			else if (c>='a' && c<='f')
+				byte = byte<<4 | (c-'a'+10);
+			else if (c>='A' && c<='F')
+				byte = byte<<4 | (c-'A'+10);
+			else
+				throw "Signatures must be an even number of hexadecimal digits";
+		}
+		signature.push_back(byte);
+	}
+	return signature;
+}
+
+uint32_t hashSignatures(const vector<Signature>& signatures, bool paddingBoundaries)
+{
+	if (signatures.empty() && !paddingBoundaries)
+		return 0;
+	// FNV-1a, each signature is preceded by its size so their bytes can't be regrouped differently
+	uint32_t hash = 0x811c9dc5;
+	auto add = [&](uint8_t byte){hash = (hash^byte)*0x01000193;};
+	add(paddingBoundaries);
+	for (const Signature& signature : signatures)
+	{
+		add(signature.size());
+		for (uint8_t byte : signature)
+			add(byte);
+	}
+	return hash ? hash : 1;
+}
+
+static inline bool isPadding(uint8_t byte)
+{
+	return byte==0xCC || byte==0x90;
+}
+
+static bool matchAt(const uint8_t* code, size_t n, size_t i, uint32_t addr, const vector<Signature>& signatures,
+					bool paddingBoundaries)
+{
+	if (paddingBoundaries && i>=2 && !((addr+i)%16)
+		&& isPadding(code[i-1]) && isPadding(code[i-2]) && !isPadding(code[i]))
+		return true;
+	for (const Signature& s : signatures)
+		if (i+s.size()<=n && !memcmp(code+i, s.data(), s.size()))
+			return true;
+	return false;
+}
+
+#ifdef SIGNATURE_SCANNER_SIMD
+/// Positions of the block of 16 bytes at code+i where a match starts, as a bitmask.
+/// Each signature is compared on its first and last bytes at the 16 positions at once, only the candidates are checked.
+__attribute__((target("sse2")))
+static unsigned matchBlock(const uint8_t* code, size_t i, uint32_t addr, const vector<Signature>& signatures,
+						bool paddingBoundaries)
+{
+	__m128i block = _mm_loadu_si128((const __m128i*)(code+i));
+	unsigned matches=0;
+	if (paddingBoundaries)
+	{
+		auto padding = [](__m128i v)
+		{
+			return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xCC)), _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0x90)));
+		};
+		__m128i after = _mm_and_si128(padding(_mm_loadu_si128((const __m128i*)(code+i-1))),
+									padding(_mm_loadu_si128((const __m128i*)(code+i-2))));
+		unsigned aligned = 1u << ((16-(addr+i)%16)%16);
+		matches = _mm_movemask_epi8(_mm_andnot_si128(padding(block), after)) & aligned;
+	}
+	for (const Signature& s : signatures)
+	{
+		size_t last = s.size()-1;
+		__m128i first = _mm_cmpeq_epi8(block, _mm_set1_epi8((char)s[0]));
+		__m128i lastBytes = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(code+i+last)), _mm_set1_epi8((char)s[last]));
+		unsigned candidates = _mm_movemask_epi8(_mm_and_si128(first, lastBytes)) & ~matches;
+		while (candidates)
+		{
+			unsigned j = __builtin_ctz(candidates);
+			candidates &= candidates-1;
+			if (last<2 || !memcmp(code+i+j+1, s.data()+1, last-1))
+				matches |= 1u<<j;
+		}
+	}
+	return matches;
+}
+#endif
+
+void scanSignatures(const uint8_t* code, size_t n, uint32_t addr, const vector<Signature>& signatures,
+					bool paddingBoundaries, vector<uint32_t>& hits)
+{
+	if (signatures.empty() && !paddingBoundaries)
+		return;
+	size_t i=0;
+#ifdef SIGNATURE_SCANNER_SIMD
+	if (__builtin_cpu_supports("sse2"))
+	{
+		size_t maxSize=1;
+		for (const Signature& s : signatures)
+			if (s.size()>maxSize)
+				maxSize = s.size();
+		// The padding looks 2 bytes back, the signatures up to maxSize-1 bytes ahead of the block
+		for (; i<2 && i<n; ++i)
+			if (matchAt(code, n, i, addr, signatures, paddingBoundaries))
+				hits.push_back(addr+i);
+		for (; i+16+maxSize-1<=n; i+=16)
+		{
+			unsigned matches = matchBlock(code, i, addr, signatures, paddingBoundaries);
+			while (matches)
+			{
+				hits.push_back(addr+i+__builtin_ctz(matches));
+				matches &= matches-1;
+			}
+		}
+	}
+#endif
+	for (; i<n; ++i)
+		if (matchAt(code, n, i, addr, signatures, paddingBoundaries))
+			hits.push_back(addr+i);
+}
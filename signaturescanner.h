@@ -0,0 +1,28 @@
+#ifndef SIGNATURESCANNER_H
+#define SIGNATURESCANNER_H
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+/// Bytes usually found at the start of a function
+typedef std::vector<uint8_t> Signature;
+
+/// push ebp/mov ebp,esp in both encodings, and the hot-patchable mov edi,edi/push ebp/mov ebp,esp
+std::vector<Signature> getDefaultSignatures();
+/// Parses a signature written in hexadecimal, like "558BEC". Throws a const char* if it's invalid.
+Signature parseSignature(const std::string& hex);
+
+/// Identifies the signatures and the padding option for the analysis cache, 0 if there is nothing to scan
+uint32_t hashSignatures(const std::vector<Signature>& signatures, bool paddingBoundaries);
+
+/// Finds every position of code where one of the signatures starts, and if paddingBoundaries is set,
+/// the 16-byte aligned positions that follow at least two bytes of INT3 or NOP padding.
+/// All the signatures are searched in a single pass, with SSE2 when the CPU supports it.
+/// @param addr Address of code, the alignment and the hits are relative to it
+/// @param hits The addresses found are appended, sorted
+void scanSignatures(const uint8_t* code, size_t n, uint32_t addr, const std::vector<Signature>& signatures,
+					bool paddingBoundaries, std::vector<uint32_t>& hits);
+
+#endif // SIGNATURESCANNER_H
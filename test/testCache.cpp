@@ -0,0 +1,96 @@
+#include "tests.h"
+#include "testPE.h"
+#include "../morph.h"
+#include "../options.h"
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <cstdio>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char* TEST_CACHE_DIR = "testCache";
+
+static vector<uint8_t> readFile(const string& path)
+{
+	ifstream in(path, ios::binary);
+	return vector<uint8_t>(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+/// Output of a run of the whole pipeline with a fixed seed
+static vector<uint8_t> morph(bool shuffle, bool useCache, bool linearSweep=false)
+{
+	argSubstitute = true;
+	argShuffle = shuffle;
+	argLinearSweep = linearSweep;
+	argCacheDir = useCache ? TEST_CACHE_DIR : "";
+	stringstream log;
+	morphFile("testCache.exe", "testCacheMorphed.exe", 1, log);
+	return readFile("testCacheMorphed.exe");
+}
+
+static void removeCacheDir()
+{
+	if (DIR* dir = opendir(TEST_CACHE_DIR))
+	{
+		while (dirent* entry = readdir(dir))
+			remove((string(TEST_CACHE_DIR)+'/'+entry->d_name).c_str());
+		closedir(dir);
+	}
+	rmdir(TEST_CACHE_DIR);
+}
+
+/// The analysis decodes a function only called through a register. Whatever the options of the runs that shared
+/// the cache before, a run gives the same output as without the cache.
+static void testSharedCache(unsigned& nFailed)
+{
+	const uint8_t bytes[] = {
+		0xB8, 0, 0, 0, 0,					// 1000 mov eax, 1010
+		0xFF, 0xD0,							// 1005 call eax
+		0x89, 0xC8,							// 1007 mov eax, ecx
+		0xC3,								// 1009 ret
+		0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC,
+		0x89, 0xC8,							// 1010 mov eax, ecx
+		0x89, 0xD9,							// 1012 mov ecx, ebx
+		0x01, 0xC8,							// 1014 add eax, ecx
+		0xC3,								// 1016 ret
+	};
+	vector<uint8_t> code(begin(bytes), end(bytes));
+	putAddress(code, 0x01, 0x1010);
+	writeTestPE("testCache.exe", code, {0x01});
+	removeCacheDir();
+#ifdef _WIN32
+	mkdir(TEST_CACHE_DIR);
+#else
+	mkdir(TEST_CACHE_DIR, 0755);
+#endif
+	int oldRand = argRand;
+	argRand = 100; // Every instruction that can be substituted is
+
+	vector<uint8_t> plain = morph(false, false);
+	vector<uint8_t> shuffled = morph(true, false);
+	vector<uint8_t> swept = morph(false, false, true);
+	check(nFailed, plain!=shuffled, "the analysis decodes more code");
+	check(nFailed, morph(true, true)==shuffled, "shuffle, cache written");
+	check(nFailed, morph(true, true)==shuffled, "shuffle, from the cache");
+	check(nFailed, morph(false, true)==plain, "no shuffle after a shuffle");
+	check(nFailed, morph(false, true)==plain, "no shuffle, from the cache");
+	check(nFailed, morph(true, true)==shuffled, "shuffle after no shuffle");
+	check(nFailed, morph(false, true, true)==swept, "linear sweep after recursive descent");
+	check(nFailed, morph(false, true)==plain, "recursive descent after linear sweep");
+
+	argRand = oldRand;
+	argSubstitute = argShuffle = argLinearSweep = false;
+	argCacheDir.clear();
+	removeCacheDir();
+	remove("testCache.exe");
+	remove("testCacheMorphed.exe");
+}
+
+void testCache(unsigned& nFailed)
+{
+	testSharedCache(nFailed);
+}
@@ -0,0 +1,71 @@
+#include "tests.h"
+#include "testPE.h"
+#include "../mappedfile.h"
+#include "../peparser.h"
+#include "../disassembler.h"
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+
+static BranchType getBranchType(Disassembler& disasm, uint32_t source)
+{
+	const vector<Branch>& branches = disasm.getBranches();
+	auto it = find_if(begin(branches), end(branches), [&](const Branch& b){return b.source==source;});
+	return it==end(branches) ? (BranchType)-1 : it->type;
+}
+
+/// Two paths reach the same block with a different ebx, one of them through a jump only resolved by the analysis.
+/// The call through ebx after that block must stay unresolved.
+static void testTwoPaths(unsigned& nFailed)
+{
+	// The addresses are built with XOR and ADD, so no MOV makes them possible data
+	vector<uint8_t> code(0xA0, 0xCC);
+	const uint8_t entry[] = {
+		0x31, 0xC9,							// 1000 xor ecx, ecx
+		0x81, 0xC1, 0, 0, 0, 0,				// 1002 add ecx, 1040
+		0x85, 0xD2,							// 1008 test edx, edx
+		0x74, 0x14,							// 100A jz 1020
+		0x31, 0xC0,							// 100C xor eax, eax
+		0x81, 0xC0, 0, 0, 0, 0,				// 100E add eax, 1060
+		0x31, 0xDB,							// 1014 xor ebx, ebx
+		0x81, 0xC3, 0, 0, 0, 0,				// 1016 add ebx, 1080
+		0xEB, 0x22,							// 101C jmp 1040
+	};
+	const uint8_t secondPath[] = {
+		0x31, 0xC0,							// 1020 xor eax, eax
+		0x81, 0xC0, 0, 0, 0, 0,				// 1022 add eax, 1060
+		0x31, 0xDB,							// 1028 xor ebx, ebx
+		0x81, 0xC3, 0, 0, 0, 0,				// 102A add ebx, 1090
+		0xFF, 0xE1,							// 1030 jmp ecx
+	};
+	copy(begin(entry), end(entry), begin(code));
+	copy(begin(secondPath), end(secondPath), begin(code)+0x20);
+	code[0x40] = 0xFF; code[0x41] = 0xE0;	// 1040 jmp eax, both paths agree on eax
+	code[0x60] = 0xFF; code[0x61] = 0xD3;	// 1060 call ebx, they don't on ebx
+	code[0x62] = 0xC3;						// 1062 ret
+	code[0x80] = 0xC3;						// 1080 ret
+	code[0x90] = 0xC3;						// 1090 ret
+	putAddress(code, 0x04, 0x1040);
+	putAddress(code, 0x10, 0x1060);
+	putAddress(code, 0x18, 0x1080);
+	putAddress(code, 0x24, 0x1060);
+	putAddress(code, 0x2C, 0x1090);
+	writeTestPE("testConstants.exe", code, {0x04, 0x10, 0x18, 0x24, 0x2C});
+
+	{
+		MappedFile file("testConstants.exe");
+		PEParser parser(file);
+		Disassembler disasm(parser);
+		disasm.analyze();
+		check(nFailed, getBranchType(disasm, 0x1030)==BranchType::jump, "jmp ecx resolved");
+		check(nFailed, getBranchType(disasm, 0x1040)==BranchType::jump, "jmp eax resolved");
+		check(nFailed, getBranchType(disasm, 0x1060)==BranchType::regCall, "call ebx unresolved");
+	}
+	remove("testConstants.exe");
+}
+
+void testConstants(unsigned& nFailed)
+{
+	testTwoPaths(nFailed);
+}
@@ -0,0 +1,43 @@
+#include "tests.h"
+#include <iostream>
+
+/// Regression tests of the analysis on small executables written for each of them in the working directory.
+/// Usage : testDitto
+
+using namespace std;
+
+void check(unsigned& nFailed, bool condition, const char* what)
+{
+	if (condition)
+		return;
+	cout << "\tFAIL : " << what << "\n";
+	nFailed++;
+}
+
+/// Runs a test, an exception counts as a failed check
+static unsigned runTest(const char* name, void (*test)(unsigned&))
+{
+	cout << name << "...\n";
+	unsigned nFailed = 0;
+	try {
+		test(nFailed);
+	}
+	catch (const char* e) {
+		check(nFailed, false, e);
+	}
+	return nFailed;
+}
+
+int main()
+{
+	unsigned nFailed = 0;
+	nFailed += runTest("Constants", testConstants);
+	nFailed += runTest("Cache", testCache);
+	nFailed += runTest("Shuffle", testShuffle);
+
+	if (nFailed)
+		cout << nFailed << " checks failed\n";
+	else
+		cout << "OK\n";
+	return nFailed ? 1 : 0;
+}
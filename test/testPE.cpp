@@ -0,0 +1,122 @@
+#include "testPE.h"
+#include "../peformat.h"
+#include "../relocation.h"
+#include <fstream>
+#include <cstring>
+
+using namespace std;
+
+static const uint32_t TEST_FILE_ALIGNMENT = 0x200;
+static const uint32_t TEST_SECTION_ALIGNMENT = 0x1000;
+
+static uint32_t alignUp(uint32_t value, uint32_t alignment)
+{
+	return (value+alignment-1)/alignment*alignment;
+}
+
+/// Base relocations directory, one chunk per page
+static vector<uint8_t> buildRelocations(vector<uint32_t> relocs)
+{
+	vector<uint8_t> dir;
+	for (size_t i=0; i<relocs.size();)
+	{
+		RelocationChunk chunk;
+		chunk.virtualAddress = (TEST_CODE_RVA+relocs[i])/0x1000*0x1000;
+		vector<uint16_t> entries;
+		for (; i<relocs.size() && (TEST_CODE_RVA+relocs[i])/0x1000*0x1000==chunk.virtualAddress; ++i)
+			entries.push_back(IMAGE_REL_BASED_HIGHLOW<<12 | (TEST_CODE_RVA+relocs[i])%0x1000);
+		if (entries.size()%2) // Chunks are 32-bit aligned
+			entries.push_back(IMAGE_REL_BASED_ABSOLUTE<<12);
+		chunk.sizeOfChunk = sizeof(RelocationChunk) + entries.size()*2;
+		size_t pos = dir.size();
+		dir.resize(pos+chunk.sizeOfChunk);
+		memcpy(dir.data()+pos, &chunk, sizeof(RelocationChunk));
+		memcpy(dir.data()+pos+sizeof(RelocationChunk), entries.data(), entries.size()*2);
+	}
+	return dir;
+}
+
+void writeTestPE(const string& path, const vector<uint8_t>& code, const vector<uint32_t>& relocs)
+{
+	vector<uint8_t> relocDir = buildRelocations(relocs);
+	unsigned short nSections = relocDir.empty() ? 1 : 2;
+	uint32_t headersSize = sizeof(DOSHeader)+4+sizeof(COFFHeader)+sizeof(PEOptHeader)+nSections*sizeof(SectionHeader);
+	uint32_t codeRawSize = alignUp(code.size(), TEST_FILE_ALIGNMENT);
+	uint32_t relocRVA = TEST_CODE_RVA + alignUp(code.size(), TEST_SECTION_ALIGNMENT);
+
+	DOSHeader dos;
+	memset(&dos, 0, sizeof(DOSHeader));
+	dos.signature[0] = 'M';
+	dos.signature[1] = 'Z';
+	dos.e_lfanew = sizeof(DOSHeader);
+
+	COFFHeader coff;
+	memset(&coff, 0, sizeof(COFFHeader));
+	coff.machine = 0x14C; // i386
+	coff.numberOfSections = nSections;
+	coff.sizeOfOptionalHeader = sizeof(PEOptHeader);
+	coff.characteristics = 0x102; // Executable, 32-bit
+
+	PEOptHeader pe;
+	memset(&pe, 0, sizeof(PEOptHeader));
+	pe.signature = 0x10B;
+	pe.sizeOfCode = codeRawSize;
+	pe.addressOfEntryPoint = TEST_CODE_RVA;
+	pe.baseOfCode = TEST_CODE_RVA;
+	pe.imageBase = TEST_IMAGE_BASE;
+	pe.sectionAlignment = TEST_SECTION_ALIGNMENT;
+	pe.fileAlignment = TEST_FILE_ALIGNMENT;
+	pe.majorSubsystemVersion = 4;
+	pe.sizeOfImage = relocDir.empty() ? relocRVA : relocRVA+alignUp(relocDir.size(), TEST_SECTION_ALIGNMENT);
+	pe.sizeOfHeaders = alignUp(headersSize, TEST_FILE_ALIGNMENT);
+	pe.subsystem = 3; // Console
+	pe.numberOfRvaAndSizes = 16;
+	if (!relocDir.empty())
+	{
+		pe.dataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress = relocRVA;
+		pe.dataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size = relocDir.size();
+	}
+
+	SectionHeader sections[2];
+	memset(sections, 0, sizeof(sections));
+	memcpy(sections[0].name, ".text", 5);
+	sections[0].virtualSize = code.size();
+	sections[0].virtualAddress = TEST_CODE_RVA;
+	sections[0].rawDataSize = codeRawSize;
+	sections[0].rawDataOffset = pe.sizeOfHeaders;
+	sections[0].characteristics = IMAGE_SCN_CNT_CODE|IMAGE_SCN_MEM_READ_EXECUTE;
+	memcpy(sections[1].name, ".reloc", 6);
+	sections[1].virtualSize = relocDir.size();
+	sections[1].virtualAddress = relocRVA;
+	sections[1].rawDataSize = alignUp(relocDir.size(), TEST_FILE_ALIGNMENT);
+	sections[1].rawDataOffset = pe.sizeOfHeaders+codeRawSize;
+	sections[1].characteristics = IMAGE_SCN_CNT_INITIALIZED_DATA|0x40000000; // Readable
+
+	vector<uint8_t> file(pe.sizeOfHeaders);
+	uint8_t* pos = file.data();
+	auto put = [&](const void* data, size_t size)
+	{
+		memcpy(pos, data, size);
+		pos += size;
+	};
+	put(&dos, sizeof(DOSHeader));
+	put("PE\0\0", 4);
+	put(&coff, sizeof(COFFHeader));
+	put(&pe, sizeof(PEOptHeader));
+	put(sections, nSections*sizeof(SectionHeader));
+	file.insert(end(file), begin(code), end(code));
+	file.resize(pe.sizeOfHeaders+codeRawSize);
+	file.insert(end(file), begin(relocDir), end(relocDir));
+	file.resize(sections[1].rawDataOffset+sections[1].rawDataSize);
+
+	ofstream out(path, ios::binary|ios::trunc);
+	out.write((const char*)file.data(), file.size());
+	if (!out)
+		throw "Can't write the test file";
+}
+
+void putAddress(vector<uint8_t>& code, uint32_t offset, uint32_t rva)
+{
+	uint32_t va = TEST_IMAGE_BASE+rva;
+	memcpy(code.data()+offset, &va, 4);
+}
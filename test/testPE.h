@@ -0,0 +1,19 @@
+#ifndef TESTPE_H_INCLUDED
+#define TESTPE_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+static const uint32_t TEST_IMAGE_BASE = 0x400000;
+static const uint32_t TEST_CODE_RVA = 0x1000;
+
+/// Writes a minimal executable around the code. The code is loaded at TEST_CODE_RVA in a single code section,
+/// followed by the relocations section if there are any, and the entry point is its first byte.
+/// @param relocs Offsets in code of the 32-bit absolute addresses the loader relocates
+void writeTestPE(const std::string& path, const std::vector<uint8_t>& code, const std::vector<uint32_t>& relocs={});
+
+/// Writes the virtual address of the RVA at offset in code, as the linker does for an absolute address
+void putAddress(std::vector<uint8_t>& code, uint32_t offset, uint32_t rva);
+
+#endif // TESTPE_H_INCLUDED
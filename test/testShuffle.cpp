@@ -0,0 +1,52 @@
+#include "tests.h"
+#include "testPE.h"
+#include "../mappedfile.h"
+#include "../peparser.h"
+#include "../disassembler.h"
+#include "../transform.h"
+#include <cstdio>
+
+using namespace std;
+
+/// Number of swaps in a function whose second instruction is a case of a jump table, or only its first one
+static unsigned shuffleJumpTable(uint32_t secondCase)
+{
+	vector<uint8_t> code = {
+		0xE8, 0x0B, 0, 0, 0,				// 1000 call 1010
+		0x8B, 0x44, 0x24, 0x04,				// 1005 mov eax, [esp+4]
+		0xFF, 0x24, 0x85, 0, 0, 0, 0,		// 1009 jmp [eax*4+1018]
+		0x89, 0xD8,							// 1010 mov eax, ebx
+		0x89, 0xCA,							// 1012 mov edx, ecx
+		0xC3,								// 1014 ret
+		0xCC, 0xCC, 0xCC,
+		0, 0, 0, 0,							// 1018 dd 1010
+		0, 0, 0, 0,							// 101C dd secondCase
+	};
+	putAddress(code, 0x0C, 0x1018);
+	putAddress(code, 0x18, 0x1010);
+	putAddress(code, 0x1C, secondCase);
+	writeTestPE("testShuffle.exe", code, {0x0C, 0x18, 0x1C});
+
+	unsigned nShuffles;
+	{
+		MappedFile file("testShuffle.exe");
+		PEParser parser(file);
+		Disassembler disasm(parser);
+		Transform trans(disasm, parser, 100, 1);
+		nShuffles = trans.shuffle();
+	}
+	remove("testShuffle.exe");
+	return nShuffles;
+}
+
+/// Nothing branches to the second case, only the jump table points to it, it must not move
+static void testJumpTable(unsigned& nFailed)
+{
+	check(nFailed, shuffleJumpTable(0x1010)==1, "independent instructions swapped");
+	check(nFailed, shuffleJumpTable(0x1012)==0, "case of a jump table not moved");
+}
+
+void testShuffle(unsigned& nFailed)
+{
+	testJumpTable(nFailed);
+}
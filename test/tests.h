@@ -0,0 +1,12 @@
+#ifndef TESTS_H_INCLUDED
+#define TESTS_H_INCLUDED
+
+/// Counts the check as failed and tells which one if the condition is false
+void check(unsigned& nFailed, bool condition, const char* what);
+
+/// Each test builds its input, runs it and counts the checks that failed in nFailed
+void testConstants(unsigned& nFailed);
+void testCache(unsigned& nFailed);
+void testShuffle(unsigned& nFailed);
+
+#endif // TESTS_H_INCLUDED
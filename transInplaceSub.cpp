@@ -1,55 +1,67 @@
 #include "transform.h"
 #include <iostream>
 #include <cstdlib>
-#include <ctime>
+#include <cstring>
 
 using namespace std;
 
 unsigned Transform::substitute()
 {
-	// We need to make a copy, since we'd invalidate the iterators of the original in the middle of the loop.
-	const std::map<uint32_t ,std::vector<uint8_t>> code = disasm.getCode();
+	// Edits are done in place or added at the end of the store, so the indexes stay valid during the loop
+	// and the instructions we add aren't visited.
+	const InstructionStore& code = disasm.getCode();
+	size_t nIns = code.size();
 	unsigned nSubs=0; // Number of instructions substituted, obviously
 
-    for (std::pair<uint32_t ,std::vector<uint8_t>> ins : code)
+    for (size_t i=0; i<nIns; ++i)
 	{
-		if (ins.second.empty())
+		uint8_t size = code.getSize(i);
+		if (!size)
 			continue;
 		if (!getRandBool()) // true/false ratio corresponds to the -r XX parameter.
 			continue;
-		uint8_t op=ins.second[0];
-		opType type = disasm.getOperandsType(ins.second);
+		// Work on a copy, editing the store can move its bytes
+		uint32_t addr = code.getAddr(i);
+		uint8_t ins[16];
+		memcpy(ins, code.getBytes(i), size);
+		// The decoder already found where the fields are, so prefixed instructions are handled too
+		InstructionInfo info = code.getInfo(i);
+		if (info.opcodeSize!=1)
+			continue;
+		uint8_t* opcode = ins+info.nPrefixes;
+		uint8_t op=*opcode;
+		opType type = info.operands;
 
 		// 0x80/0x82 Aliases
 		if (op==0x80)
 		{
-			ins.second[0]=0x82;
-			disasm.editInstruction(ins.first, ins.second);
+			*opcode=0x82;
+			disasm.editInstruction(addr, ins, size);
 			nSubs++;
 			continue;
 		}
 		else if (op==0x82)
 		{
-			ins.second[0]=0x80;
-			disasm.editInstruction(ins.first, ins.second);
+			*opcode=0x80;
+			disasm.editInstruction(addr, ins, size);
 			nSubs++;
 			continue;
 		}
 		// 0xF6/0xF7 /0 /1 TEST aliases
 		if (op==0xF6 || op==0xF7)
 		{
-			uint8_t op2=ins.second[1];
+			uint8_t op2=ins[info.modrmOffset];
 			if (getReg(op2)==0)
 			{
-				ins.second[1]=op2 | 0b00001000; // Set ModRM:Reg to 1
-				disasm.editInstruction(ins.first, ins.second);
+				ins[info.modrmOffset]=op2 | 0b00001000; // Set ModRM:Reg to 1
+				disasm.editInstruction(addr, ins, size);
 				nSubs++;
 				continue;
 			}
 			else if (getReg(op2)==1)
 			{
-				ins.second[1]=op2 & 0b11110111; // Set ModRM:Reg to 0
-				disasm.editInstruction(ins.first, ins.second);
+				ins[info.modrmOffset]=op2 & 0b11110111; // Set ModRM:Reg to 0
+				disasm.editInstruction(addr, ins, size);
 				nSubs++;
 				continue;
 			}
@@ -58,13 +70,13 @@ unsigned Transform::substitute()
 		// Eb Gb <=> Gb Eb substitutions
 		if ((type==opType::EbGb && op!=0x84) || (type==opType::GbEb && op!=0x86))
 		{
-			uint8_t op2=ins.second[1];
+			uint8_t op2=ins[info.modrmOffset];
 			if (getMod(op2)==3)
 			{
 				uint8_t reg = getReg(op2), rm=getRM(op2);
-				ins.second[0]+= type==opType::EbGb ? 2 : -2; // Invert order
-				ins.second[1]=0xC0+(rm<<3)+reg; // Swap registers
-				disasm.editInstruction(ins.first, ins.second);
+				*opcode+= type==opType::EbGb ? 2 : -2; // Invert order
+				ins[info.modrmOffset]=0xC0+(rm<<3)+reg; // Swap registers
+				disasm.editInstruction(addr, ins, size);
 				nSubs++;
 				continue;
 			}
@@ -72,13 +84,13 @@ unsigned Transform::substitute()
 		// Ev Gv <=> Gv Ev substitutions
 		else if ((type==opType::EvGv&&op!=0x85) || (type==opType::GvEv&&op!=0x87))
 		{
-			uint8_t op2=ins.second[1];
+			uint8_t op2=ins[info.modrmOffset];
 			if (getMod(op2)==3)
 			{
 				uint8_t reg = getReg(op2), rm=getRM(op2);
-				ins.second[0]+= type==opType::EvGv ? 2 : -2; // Invert order
-				ins.second[1]=0xC0+(rm<<3)+reg; // Swap registers
-				disasm.editInstruction(ins.first, ins.second);
+				*opcode+= type==opType::EvGv ? 2 : -2; // Invert order
+				ins[info.modrmOffset]=0xC0+(rm<<3)+reg; // Swap registers
+				disasm.editInstruction(addr, ins, size);
 				nSubs++;
 				continue;
 			}
@@ -86,12 +98,12 @@ unsigned Transform::substitute()
 		// Switch operands of TEST and XCHG instructions
 		else if (op>=0x84&&op<=0x87)
 		{
-			uint8_t op2=ins.second[1];
+			uint8_t op2=ins[info.modrmOffset];
 			if (getMod(op2)==3)
 			{
 				uint8_t reg = getReg(op2), rm=getRM(op2);
-				ins.second[1]=0xC0+(rm<<3)+reg; // Swap registers
-				disasm.editInstruction(ins.first, ins.second);
+				ins[info.modrmOffset]=0xC0+(rm<<3)+reg; // Swap registers
+				disasm.editInstruction(addr, ins, size);
 				nSubs++;
 				continue;
 			}
@@ -99,23 +111,20 @@ unsigned Transform::substitute()
 
 		// If an instruction uses a SIB byte with a scale of 0 (*1), we can swap base and index
 		// Compatible operands : Gv M, Gv Ev, Ev Gv, Gb Eb, Eb Gb and probably others
-		if (Disassembler::getOperandsType(ins.second)==opType::GvEv
-			|| Disassembler::getOperandsType(ins.second)==opType::EvGv
-			|| Disassembler::getOperandsType(ins.second)==opType::GbEb
-			|| Disassembler::getOperandsType(ins.second)==opType::EbGb
-			|| Disassembler::getOperandsType(ins.second)==opType::GvM)
+		if (type==opType::GvEv || type==opType::EvGv || type==opType::GbEb
+			|| type==opType::EbGb || type==opType::GvM)
 		{
-			uint8_t op2=ins.second[1];
-			if (getMod(op2)!=3 && getRM(op2)==4) // No direct register, SIB byte
+			uint8_t op2=ins[info.modrmOffset];
+			if (info.sibOffset) // No direct register, SIB byte
 			{
-				uint8_t op3=ins.second[2];
+				uint8_t op3=ins[info.sibOffset];
 				// If the SIB is correct, we can swap Base and Index
                 if (getMod(op3)==0 && getRM(op3)!=4 && getReg(op3)!=4
 					&& ((getMod(op2)==0&&getReg(op3)!=5&&getRM(op3)!=5)||getMod(op2)!=0))
 				{
 					uint8_t reg = getReg(op3), rm=getRM(op3);
-					ins.second[2]=(rm<<3)+reg; // Swap registers
-					disasm.editInstruction(ins.first, ins.second);
+					ins[info.sibOffset]=(rm<<3)+reg; // Swap registers
+					disasm.editInstruction(addr, ins, size);
 					nSubs++;
 					continue;
 				}
@@ -127,31 +136,33 @@ unsigned Transform::substitute()
 				// Or we can simply change the Scale to another value
 				else if (getReg(op3)==4 && (getMod(op2)!=0 || (getMod(op2)==0&&getRM(op3)!=5)))
 				{
-					if (getRM(op3)!=4) // Move SIB to ModRM, add NOP
+					// Removing the SIB moves the displacement, the loader would patch the wrong bytes
+					if (getRM(op3)!=4 && !parser.hasRelocations(addr, size)) // Move SIB to ModRM, add NOP
 					{
 						uint8_t base = getRM(op3);
-						ins.second[1]=(op2&0b11111000) | base; // Move the base to the ModRM:RM
-						ins.second.erase(begin(ins.second)+2); // Remove the SIB
-						pair<uint32_t ,vector<uint8_t>> nopIns;
-						nopIns.second.push_back(0x90);
+						ins[info.modrmOffset]=(op2&0b11111000) | base; // Move the base to the ModRM:RM
+						memmove(ins+info.sibOffset, ins+info.sibOffset+1, size-info.sibOffset-1); // Remove the SIB
+						size--;
+						uint8_t nop=0x90;
+						uint32_t nopAddr;
 						// Either prepend or append the NOP
-						if (::rand()%2) // Prepend
+						if (getRand()%2) // Prepend
 						{
-							nopIns.first=ins.first;
-							ins.first++;
+							nopAddr=addr;
+							addr++;
 						}
 						else // Append
-							nopIns.first=ins.first+ins.second.size();
-						disasm.editInstruction(ins.first, ins.second);
-						disasm.editInstruction(nopIns.first, nopIns.second);
+							nopAddr=addr+size;
+						disasm.editInstruction(addr, ins, size);
+						disasm.editInstruction(nopAddr, &nop, 1);
 						nSubs++;
 						continue;
 					}
 					else // Change scale
 					{
-						uint8_t scale = (getMod(op3) + ::rand()%3+1) & 0b11; // Get a different scale
-						ins.second[2]=(op3&0b00111111) | (scale<<6); // Apply new scale
-						disasm.editInstruction(ins.first, ins.second);
+						uint8_t scale = (getMod(op3) + getRand()%3+1) & 0b11; // Get a different scale
+						ins[info.sibOffset]=(op3&0b00111111) | (scale<<6); // Apply new scale
+						disasm.editInstruction(addr, ins, size);
 						nSubs++;
 						continue;
 					}
@@ -1,75 +1,122 @@
 #include "transform.h"
-#include <list>
-#include <iostream>
+#include <vector>
+#include <cstring>
 
 using namespace std;
 
-unsigned Transform::shuffle()
+bool Transform::haveSameRelocations(InstructionRef ins1, InstructionRef ins2)
+{
+	bool relocated1 = parser.hasRelocations(ins1.addr, ins1.size), relocated2 = parser.hasRelocations(ins2.addr, ins2.size);
+	if (!relocated1 && !relocated2)
+		return true;
+	// After the swap, the bytes of ins2 come first
+	for (unsigned i=0; i<ins1.size+ins2.size; ++i)
+	{
+		uint32_t from = i<ins2.size ? ins2.addr+i : ins1.addr+i-ins2.size;
+		if (parser.isRelocated(ins1.addr+i) != parser.isRelocated(from))
+			return false;
+	}
+	return true;
+}
+
+/// Size of the memory written by a MOV Eb Gb, Ev Gv, Eb Ib or Ev Iz to memory, or 0 if it's another instruction
+static unsigned getStoreSize(InstructionRef ins)
+{
+	if (ins.info->opcodeSize!=1 || !ins.info->modrmOffset || (ins.modrm()>>6)==3
+		|| (ins.info->prefixes & (prefixAdSize|prefixSegment)))
+		return 0;
+	uint8_t op = *ins.opcode();
+	if (op==0x88 || op==0xC6)
+		return 1;
+	if (op==0x89 || op==0xC7)
+		return (ins.info->prefixes & prefixOpSize) ? 2 : 4;
+	return 0;
+}
+
+/// True if both instructions store to an address made of the same registers, with displacements far enough apart
+static bool storeToDisjointMemory(InstructionRef ins1, InstructionRef ins2)
 {
-	/** ideas go here
-	Work on NOPs as a last resort. Normally we should ignore NOPs, but it's slow.
-	We should build a list of the next 3 adjacent non-nop instructions.
-	If they aren't adjacent, continue until they are.
-	Every end of a loop, we remove the first item of the list, and add the next adjacent instruction
+	unsigned size1 = getStoreSize(ins1), size2 = getStoreSize(ins2);
+	if (!size1 || !size2 || (ins1.modrm()&0xC7)!=(ins2.modrm()&0xC7)
+		|| (ins1.info->sibOffset && ins1.sib()!=ins2.sib()))
+		return false;
+	int64_t disp1=0, disp2=0;
+	if (ins1.info->dispSize==1)
+	{
+		disp1 = (int8_t)ins1[ins1.info->dispOffset];
+		disp2 = (int8_t)ins2[ins2.info->dispOffset];
+	}
+	else if (ins1.info->dispSize==4)
+	{
+		int32_t d1, d2;
+		memcpy(&d1, ins1.bytes+ins1.info->dispOffset, 4);
+		memcpy(&d2, ins2.bytes+ins2.info->dispOffset, 4);
+		disp1 = d1;
+		disp2 = d2;
+	}
+	return disp1+size1<=disp2 || disp2+size2<=disp1;
+}
 
-	We need to write a function getUsedRegister(instruction) wich returns the list of all the registers used
-	If for example we push or read a value at [ESP], then ESP is affected. If we LEAVE, ESP and EBP are affected.
+bool Transform::canSwap(InstructionRef ins1, InstructionRef ins2, uint16_t liveAfter)
+{
+	// Only instructions flowing to the next one can move, the branches stay where the blocks end
+	for (insType type : {ins1.info->type, ins2.info->type})
+		if (type!=insType::other && type!=insType::nop && type!=insType::stack)
+			return false;
+	if (ins2.addr != ins1.addr+ins1.size)
+		return false;
+	// Nothing may land on the second instruction, or point inside the two.
+	// The relocated addresses are checked too, the code only reached through them is never marked as a branch dest.
+	for (uint32_t addr=ins1.addr+1; addr<ins2.addr+ins2.size; ++addr)
+		if (disasm.getByteClass(addr) & (byteCodeRef|bytePossibleData|byteData))
+			return false;
+	if (parser.hasRelocationTargets(ins1.addr+1, ins1.size+ins2.size-1))
+		return false;
 
-	Try to find shuffling on the 3 instructions first, if we can't, search on the two first only.
-	If we don't NEED the three instructions to be independent to shuffle, then only use the first two, it's faster.
+	// Neither may read what the other writes, and they can only both write something nobody reads after them
+	uint16_t defs1 = ins1.info->defs, defs2 = ins2.info->defs;
+	uint16_t conflicts = (defs1 & ins2.info->uses) | (defs2 & ins1.info->uses) | (defs1 & defs2 & (liveAfter|regMemory));
+	if (conflicts==regMemory && storeToDisjointMemory(ins1, ins2))
+		conflicts = 0;
+	return !conflicts && haveSameRelocations(ins1, ins2);
+}
 
-	If none of the 2 first instructions are not a JMP/CALL/etc or something dangerous,
-	if the getUsedRegister of the two have a null intersection, shuffle the two and continue
+unsigned Transform::shuffle()
+{
+	// Swaps adjacent instructions of the blocks that don't depend on each other.
+	// The registers and flags live after each instruction come from the liveness of the blocks,
+	// so two instructions writing the same dead flags can trade places.
+	disasm.updateVirtualImageFromInstructions(); // Sorts the instructions the other transforms edited
+	if (!disasm.isAnalyzed())
+		disasm.analyze();
 
-	If the first two are OxC7 MOV Ev Iv with the same ModRM, shuffle the two.
-	It's ok since they write to the same kind of destination, only the displacement/addr can change.
-	**/
 	unsigned nShuffles = 0;
-	const std::map<uint32_t ,std::vector<uint8_t>> code = disasm.getCode();
-	if (code.size() < 3)
-		return 0;
-	std::list<std::pair<uint32_t ,std::vector<uint8_t>>> curInss;
-	for (std::pair<uint32_t ,std::vector<uint8_t>> ins : code)
+	const InstructionStore& code = disasm.getCode();
+	vector<size_t> indexes; // Instructions of the current block
+	vector<uint16_t> liveAfter;
+	for (const Block& block : disasm.getBlocks())
 	{
-		uint8_t curInssSize = curInss.size();
-		if (curInssSize<3)
+		indexes.clear();
+		for (size_t i=code.find(block.startAddr);
+			i!=InstructionStore::npos && i<code.size() && code.getAddr(i)<block.endAddr; ++i)
+			indexes.push_back(i);
+		liveAfter.resize(indexes.size());
+		uint16_t live = block.liveOut;
+		for (size_t i=indexes.size(); i-->0;)
 		{
-			curInss.push_back(ins);
-			if (curInssSize<3)
-				continue;
+			liveAfter[i] = live;
+			const InstructionInfo& info = code.getInfo(indexes[i]);
+			live = (live & ~info.defs) | info.uses;
 		}
-		else
+
+		for (size_t i=0; i+1<indexes.size(); ++i)
 		{
-			curInss.pop_front();
-			curInss.push_back(ins);
+			if (!canSwap(code[indexes[i]], code[indexes[i+1]], liveAfter[i+1]) || !getRandBool())
+				continue;
+			disasm.swapInstructions(code.getAddr(indexes[i]));
+			nShuffles++;
+			++i; // We're done with the two instructions
 		}
-
-		// Check that addresses are continuous
-		if ((++curInss.begin())->first != curInss.begin()->first + curInss.begin()->second.size())
-			continue;
-
-		if (curInss.back().first != (++curInss.begin())->first + (++curInss.begin())->second.size())
-			continue;
-
-		// If the first two are OxC7 MOV Ev Iv with the same ModRM, shuffle the two.
-		if (curInss.begin()->second.size()>=2 && (++curInss.begin())->second.size()>=2)
-			if (curInss.begin()->second[0]==0xC7 && (++curInss.begin())->second[0]==0xC7)
-				if (curInss.begin()->second[1] == (++curInss.begin())->second[1])
-				{
-					// Swap instructions
-					uint32_t addr1 = curInss.begin()->first;
-					uint32_t addr2 = (++curInss.begin())->first;
-					disasm.editInstruction(addr1, (++curInss.begin())->second);
-					disasm.editInstruction(addr2, curInss.begin()->second);
-					nShuffles++;
-
-					// We're done with the two first instructions
-					curInss.pop_front();
-					curInss.pop_front();
-					continue;
-
-					// TODO: We should check that the two instructions dont write at addresses that overlap
-				}
 	}
 
 	return nShuffles;
@@ -2,24 +2,25 @@
 #include "peparser.h"
 #include <iostream>
 #include <cstdlib>
-#include <ctime>
 
 using namespace std;
 
-Transform::Transform(Disassembler& disassembler, PEParser& Parser, uint8_t Rand)
-: disasm(disassembler), parser(Parser), rand(Rand)
+Transform::Transform(Disassembler& disassembler, PEParser& Parser, uint8_t Rand, unsigned Seed)
+: disasm(disassembler), parser(Parser), rand(Rand), randGen(Seed)
 {
-	srand(time(NULL));
-
-	//disasm.analyze();
 }
 
 bool Transform::getRandBool()
 {
-	int r = ::rand()%100;
+	int r = getRand()%100;
 	return (r<rand);
 }
 
+unsigned Transform::getRand()
+{
+	return randGen();
+}
+
 unsigned short Transform::encryptSection(std::string sectionName)
 {
 	unsigned short decryptorUsed=0;
@@ -32,10 +33,13 @@ unsigned short Transform::encryptSection(std::string sectionName)
 	uint8_t codeNormal[] = {0x8D,0x0D,0,0,0,0,0x8B,1,0x35,0,0,0,0,0x89,1,0x83,0xC1,4,
 										0x8D,5,0,0,0,0,0x3B,0xC8,0x72,0xEA,0xE9,0,0,0,0};
 
-	uint32_t key=(::rand()%0xEEEE) + ((::rand()%0xEEEE)<<16);
+	uint32_t key=(getRand()%0xEEEE) + ((getRand()%0xEEEE)<<16);
 	uint32_t oldEP = parser.getEntryPoint();
 	uint32_t imageBase = parser.getImageBase();
-	pair<uint32_t,uint32_t> bounds = parser.getSectionVirtualBounds(sectionName);
+	SectionHandle section = parser.findSection(sectionName);
+	if (section==INVALID_SECTION)
+		throw "Section does not exist";
+	pair<uint32_t,uint32_t> bounds = parser.getSectionVirtualBounds(section);
 	uint32_t dataStart = bounds.first+imageBase, dataEnd = bounds.second+imageBase;
 
 	// Create section
@@ -58,12 +62,12 @@ unsigned short Transform::encryptSection(std::string sectionName)
 	// Generate decryptor
 	size_t decryptCodeSize;
 	uint8_t* decryptCode;
-	if (::rand()%2) // Use the decryptor with obfuscated ret to the old ep
+	if (getRand()%2) // Use the decryptor with obfuscated ret to the old ep
 	{
 		decryptCodeSize = 48;
 		uint32_t absOldEP = imageBase + oldEP;
 		uint32_t absFirstRet = imageBase + decryptorPos+18;
-		uint16_t random = ::rand()&0xFFFF;
+		uint16_t random = getRand()&0xFFFF;
 		*(uint16_t*)(codeObf+1) = absFirstRet>>16;
 		*(uint16_t*)(codeObf+3) = absOldEP>>16;
 		*(uint16_t*)(codeObf+6) = random;
@@ -118,7 +122,9 @@ unsigned short Transform::encryptSection(std::string sectionName)
 	/// We should scan the end of the section before generating the decryptor. Often the end is padded with 0s,
 	/// we should skip the last contigous block of 0s and only crypt until this block.
 
-	/// We NEED to parse the damn relocations and imports.
+	/// We NEED to parse the damn imports.
+	/// TODO: The loader applies the relocations of the section before the decryptor runs, so a rebased image
+	/// breaks if the section has any (see parser.hasRelocations). The decryptor should skip those fields.
 
 	/// TODO: BUG: Dammit the crypter on .data causes everything serious to fail ! Including blender, NPP, Bitcoin, etc.
 
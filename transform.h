@@ -3,16 +3,18 @@
 
 #include "disassembler.h"
 #include "peparser.h"
+#include <random>
 
 class Transform
 {
 	public:
-		Transform(Disassembler& disassembler, PEParser& Parser, uint8_t Rand);
+		/// @param Seed Seed of the random generator. Each Transform has its own, so they can run in parallel.
+		Transform(Disassembler& disassembler, PEParser& Parser, uint8_t Rand, unsigned Seed);
 		/// Substitutes instructions with equivalent instructions of the same size.
 		/// @return The number of substitutions done
 		unsigned substitute();
-		/// Substitutes small sets of instructions with equivalent instructions of the same size.
-		/// @return The number of substitutions done
+		/// Swaps adjacent instructions that don't depend on each other, using the analysis of the disassembler.
+		/// @return The number of swaps done
 		unsigned shuffle();
 		/// Encrypts a section and move the entry point to a generated polymorphic decryptor.
 		/// @return Id of the decryptor used, or 0 if a generic decryptor was used.
@@ -20,10 +22,18 @@ class Transform
 	protected:
 		/// Uses the rand probability given in the constructor
 		bool getRandBool();
+		unsigned getRand(); ///< Random number from this Transform's generator
+		/// The loader patches the relocated fields where they are, so two adjacent instructions can only trade places
+		/// if the relocated fields end up at the same addresses. ins2 must start right after ins1.
+		bool haveSameRelocations(InstructionRef ins1, InstructionRef ins2);
+		/// Can ins2, which starts right after ins1, be moved before it without changing what the code does
+		/// @param liveAfter RegisterMask of what's live after ins2
+		bool canSwap(InstructionRef ins1, InstructionRef ins2, uint16_t liveAfter);
 	private:
 		Disassembler& disasm;
 		PEParser& parser;
 		uint8_t rand;
+		std::mt19937 randGen;
 };
 
 /**